@@ -64,6 +64,9 @@ public class VSNR_2D implements PlugInFilter {
 
     private VsnrDllLoader dll = null;
 
+    // pixels sent to the dll per call (the planes of a stack are denoised by batches)
+    private static final int BATCH_SIZE = 1 << 24;
+
     // --------------------------------------------------------------------
 
     @Override
@@ -345,7 +348,10 @@ public class VSNR_2D implements PlugInFilter {
         ImagePlus result = image.duplicate();
         result.setTitle("vsnr_" + image.getTitle());
 
-        Image2D input, output;
+        ArrayList<Image2D> batch = new ArrayList<Image2D>();
+        int size = image.getWidth()*image.getHeight();
+        int maxPlanes = Math.max(1, BATCH_SIZE / size);
+        int planes = 0;
         int k = 0;
 
         FloatBuffer buffPsis = getBuffPsi(listFilters);
@@ -357,14 +363,20 @@ public class VSNR_2D implements PlugInFilter {
 
                 for (int t = 0 ; t < frame ; t++) {
 
-                    IJ.showStatus("Denoising slice "+(z+1)+"/"+slice+" - chan "+(c+1)+"/"+chan+" - frame "+(t+1)+"/"+frame);
-
-                    input  = new Image2D(result, z, c, t, bLog);
-                    output = input.denoise(buffPsis, length, nit, beta, nBlock, dll);
+                    Image2D input = new Image2D(result, z, c, t, bLog);
 
-                    output.agregate(result, bLog);
+                    // all the planes of a batch are denoised by one call
+                    if (planes > 0 && planes + input.getDim() > maxPlanes) {
+                        IJ.showStatus("Denoising planes "+(k+1)+"-"+(k+batch.size())+"/"+slice*chan*frame);
+                        denoiseBatch(batch, planes, buffPsis, length, result);
+                        k += batch.size();
+                        IJ.showProgress(k, slice*chan*frame);
+                        batch.clear();
+                        planes = 0;
+                    }
 
-                    IJ.showProgress(++k, slice*chan*frame);
+                    batch.add(input);
+                    planes += input.getDim();
 
                 }
 
@@ -372,12 +384,36 @@ public class VSNR_2D implements PlugInFilter {
 
         }
 
-        input  = null;
-        output = null;
+        IJ.showStatus("Denoising planes "+(k+1)+"-"+(k+batch.size())+"/"+slice*chan*frame);
+        denoiseBatch(batch, planes, buffPsis, length, result);
+        IJ.showProgress(slice*chan*frame, slice*chan*frame);
 
         return result;
     }
 
+    // Denoises the images of batch (planes channels in total) with one call to VSNR_2D_FIJI_GPU_BATCH
+    // and writes them to result
+    private void denoiseBatch(ArrayList<Image2D> batch, int planes, FloatBuffer buffPsis, int length, ImagePlus result)
+    {
+        int size = image.getWidth()*image.getHeight();
+        float[] u0  = new float[planes*size];
+        float[] u   = new float[planes*size];
+        float[] max = new float[planes];
+        int p = 0;
+
+        for (Image2D img : batch)
+            p = img.pack(u0, max, p);
+
+        if (dll.VSNR_2D_FIJI_GPU_BATCH(buffPsis, length, FloatBuffer.wrap(u0), image.getHeight(), image.getWidth(), planes, nit, beta, FloatBuffer.wrap(u), nBlock, FloatBuffer.wrap(max)) != 0)
+            exitWindow("Error :\nNot enough memory on the GPU for one plane, or the GPU failed !\nRead the logs.");
+
+        p = 0;
+        for (Image2D img : batch) {
+            p = img.unpack(u, p);
+            img.agregate(result, bLog);
+        }
+    }
+
     // -
     private FloatBuffer getBuffPsi(ArrayList<Float> psis)
     {
@@ -472,20 +508,6 @@ public class VSNR_2D implements PlugInFilter {
             }
         }
 
-        public Image2D(int width, int height, int channel, int frame, int slice, Boolean bColor)
-        {
-            this.width  = width;
-            this.height = height;
-            this.bColor = bColor;
-            this.slice  = slice;
-            this.chan   = channel;
-            this.frame  = frame;
-
-            int dim = (bColor ? 3 : 1);
-
-            this.allocate(dim, width*height);
-        }
-
         private void allocate(int dim, int size)
         {
             try {
@@ -506,16 +528,29 @@ public class VSNR_2D implements PlugInFilter {
             return img.getProcessor();
         }
 
-        public Image2D denoise(FloatBuffer buffPsis, int length, int nit, float beta, int nBlock, VsnrDllLoader dll)
+        // number of planes (3 for RGB images)
+        public int getDim()
         {
-            Image2D output = new Image2D(width, height, chan, frame, slice, bColor);
-
-            int dim = (bColor ? 3 : 1);
+            // -
+            return (bColor ? 3 : 1);
+        }
 
-            for (int i = 0 ; i < dim ; i++)
-                dll.VSNR_2D_FIJI_GPU(buffPsis, length, getBuffer(i), height, width, nit, beta, output.getBuffer(i), nBlock, max[i]);
+        // copies the planes to u0 and their maximum to max from plane p, returns the next plane
+        public int pack(float[] u0, float[] max, int p)
+        {
+            for (int i = 0 ; i < getDim() ; i++, p++) {
+                System.arraycopy(arr[i], 0, u0, p*width*height, width*height);
+                max[p] = this.max[i];
+            }
+            return p;
+        }
 
-            return output;
+        // copies the planes back from u from plane p, returns the next plane
+        public int unpack(float[] u, int p)
+        {
+            for (int i = 0 ; i < getDim() ; i++, p++)
+                System.arraycopy(u, p*width*height, arr[i], 0, width*height);
+            return p;
         }
 
         public FloatBuffer getBuffer(int k)
@@ -607,8 +642,11 @@ public class VSNR_2D implements PlugInFilter {
     // dll interface
     private interface VsnrDllLoader extends Library {
 
-        // CUDA denoise function
-        public void VSNR_2D_FIJI_GPU(FloatBuffer psis, int length, FloatBuffer u0, int n0, int n1, int nit, float beta, FloatBuffer u, int nBlock, float max);
+        // CUDA denoise function, returns 0 or -1 on a GPU error
+        public int VSNR_2D_FIJI_GPU(FloatBuffer psis, int length, FloatBuffer u0, int n0, int n1, int nit, float beta, FloatBuffer u, int nBlock, float max);
+
+        // CUDA denoise function, nPlanes planes of n0 x n1 in one call, returns 0 or -1 on a GPU error
+        public int VSNR_2D_FIJI_GPU_BATCH(FloatBuffer psis, int length, FloatBuffer u0, int n0, int n1, int nPlanes, int nit, float beta, FloatBuffer u, int nBlock, FloatBuffer max);
 
         // return dimBlocks max
         public int getMaxBlocks();
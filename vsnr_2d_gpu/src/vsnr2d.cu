@@ -20,93 +20,15 @@
 
 #include <math.h>
 #include <stdio.h>
-#include "cuda.h"
-#include "cuda_runtime.h"
-#include "cufft.h"
-#include <cuda_runtime.h>
-#include <cublas_v2.h>
-
-#define PI (3.141592653589793)
-
-#define SQ(a) ((a)*(a))
-#define MAX(a, b) ((a) > (b) ? (a) : (b))
-#define MIN(a, b) ((a) < (b) ? (a) : (b))
-
-typedef cufftComplex CuC; // struct { float x, y }
-typedef cufftReal    CuR; // float
+#include <stdlib.h>
+#include <string.h>
+#include "vsnr_engine.cuh"
 
 
 // DEBUG
 // -------------------------------------------------------------------------
 
 
-// Disp lastCudaError in file
-void __dispLastCudaError(FILE* file, const char* string)
-{
-    // -
-    fprintf(file,"~ %s: %s\n", string, cudaGetErrorString(cudaGetLastError()));
-}
-
-// Disp a string relative to err from a cufft function in file
-void __dispCufftError(FILE* file, const char* string, int err)
-{
-    switch (err) {
-        case 0 :
-            fprintf(file, "# %s: CUFFT_SUCCESS\n", string);
-            break;
-        case 1 :
-            fprintf(file, "# %s: CUFFT_INVALID_PLAN\n", string);
-            break;
-        case 2 :
-            fprintf(file, "# %s: CUFFT_ALLOC_FAILED\n", string);
-            break;
-        case 3 :
-            fprintf(file, "# %s: CUFFT_INVALID_TYPE\n", string);
-            break;
-        case 4 :
-            fprintf(file, "# %s: CUFFT_INVALID_VALUE\n", string);
-            break;
-        case 5 :
-            fprintf(file, "# %s: CUFFT_INTERNAL_ERROR\n", string);
-            break;
-        case 6 :
-            fprintf(file, "# %s: CUFFT_EXEC_FAILED\n", string);
-            break;
-        case 7 :
-            fprintf(file, "# %s: CUFFT_SETUP_FAILED\n", string);
-            break;
-        case 8 :
-            fprintf(file, "# %s: CUFFT_INVALID_SIZE\n", string);
-            break;
-        case 9 :
-            fprintf(file, "# %s: CUFFT_UNALIGNED_DATA\n", string);
-            break;
-        case 10 :
-            fprintf(file, "# %s: CUFFT_INCOMPLETE_PARAMETER_LIST\n", string);
-            break;
-        case 11 :
-            fprintf(file, "# %s: CUFFT_INVALID_DEVICE\n", string);
-            break;
-        case 12 :
-            fprintf(file, "# %s: CUFFT_PARSE_ERROR\n", string);
-            break;
-        case 13 :
-            fprintf(file, "# %s: CUFFT_NO_WORKSPACE\n", string);
-            break;
-        case 14 :
-            fprintf(file, "# %s: CUFFT_NOT_IMPLEMENTED\n", string);
-            break;
-        case 15 :
-            fprintf(file, "# %s: CUFFT_LICENSE_ERROR\n", string);
-            break;
-        case 16 :
-            fprintf(file, "# %s: CUFFT_NOT_SUPPORTED\n", string);
-            break;
-        default :
-            fprintf(file, "# %s: UNKNOW_ERROR\n", string);
-    }
-}
-
 // Displays a complex array as a vector
 void disp_array2(FILE* file, float* u, int n)
 {
@@ -137,321 +59,62 @@ void disp_carray2(FILE* file, CuC* u, int n)
 // -------------------------------------------------------------------------
 
 
-// Computes out = u1.*u2
-__global__ void product_carray(CuC* u1, CuC* u2, CuC* out, int n)
-{
-    int i    = blockIdx.x * blockDim.x + threadIdx.x;
-    int step = blockDim.x * gridDim.x;
-
-    for ( ; i < n ; i += step) {
-        out[i].x = (u1[i].x * u2[i].x) - (u1[i].y * u2[i].y);
-        out[i].y = (u1[i].y * u2[i].x) + (u1[i].x * u2[i].y);
-    }
-}
-
-// Normalize an array
-__global__ void normalize(CuR* u, int n)
-{
-    int i    = blockIdx.x * blockDim.x + threadIdx.x;
-    int step = blockDim.x * gridDim.x;
-
-    for ( ; i < n ; i += step)
-        u[i] = u[i] / (float)n;
-}
-
-// u = u*val;
-__global__ void multiply(CuR* u, int n, float val)
-{
-    int i    = blockIdx.x * blockDim.x + threadIdx.x;
-    int step = blockDim.x * gridDim.x;
-
-    for ( ; i < n ; i += step)
-        u[i] = u[i] * val;
-}
-
-// u = u/val;
-__global__ void divide(CuR* u, int n, float val)
+// u = u/val[p] on each plane p of n pixels
+__global__ void divide_planes(CuR* u, float* val, int n, int N)
 {
     int i    = blockIdx.x * blockDim.x + threadIdx.x;
     int step = blockDim.x * gridDim.x;
 
-    for ( ; i < n ; i += step)
-        u[i] = u[i] / val;
+    for ( ; i < N ; i += step)
+        u[i] = u[i] / val[i / n];
 }
 
-// adds two vectors w = u + v
-__global__ void add(CuR* u, CuR* v, CuR* w, int n)
+// scale[p] = sqrtf(||u_p||) on each plane p of n pixels out of B, one block per plane
+__global__ void scale_planes(CuR* u, float* scale, int n, int B)
 {
-    int i    = blockIdx.x * blockDim.x + threadIdx.x;
-    int step = blockDim.x * gridDim.x;
+    __shared__ float s[1024];
+    int t = threadIdx.x;
 
-    for ( ; i < n ; i += step)
-        w[i] = u[i] + v[i];
-}
-
-// substracts two vectors w = u - v
-__global__ void substract(CuR* u, CuR* v, CuR* w, int n)
-{
-    int i    = blockIdx.x * blockDim.x + threadIdx.x;
-    int step = blockDim.x * gridDim.x;
+    for (int p = blockIdx.x ; p < B ; p += gridDim.x) {
+        float v = 0.0;
 
-    for ( ; i < n ; i += step)
-        w[i] = u[i] - v[i];
-}
+        for (int i = t ; i < n ; i += blockDim.x)
+            v += SQ(u[(size_t)p*n + i]);
+        s[t] = v;
+        __syncthreads();
 
-// Sets finite difference 1
-__global__ void setd1(CuR* d1, int n, int n1)
-{
-    int i     = blockIdx.x * blockDim.x + threadIdx.x ;
-    int step  = blockDim.x * gridDim.x;
-    int id[2] = {0, n1-1};
-
-    for ( ; i < n ; i += step) {
-        if      (i == id[0]) d1[i] =  1;
-        else if (i == id[1]) d1[i] = -1;
-        else                 d1[i] =  0;
-    }
-}
-
-// Sets finite difference 2
-__global__ void setd2(CuR* d2, int n, int n1)
-{
-    int i     = blockIdx.x * blockDim.x + threadIdx.x;
-    int step  = blockDim.x * gridDim.x;
-    int id[2] = {0, n-n1};
-
-    for ( ; i < n ; i += step) {
-        if      (i == id[0]) d2[i] =  1;
-        else if (i == id[1]) d2[i] = -1;
-        else                 d2[i] =  0;
-    }
-}
-
-// Compute Phi
-__global__ void compute_phi(CuC* fphi1, CuC* fphi2, CuC* fphi, float beta, int n)
-{
-    int i    = blockIdx.x * blockDim.x + threadIdx.x;
-    int step = blockDim.x * gridDim.x;
-
-    for ( ; i < n ; i += step) {
-        fphi[i].x = 1 + beta*(fphi1[i].x*fphi1[i].x + fphi1[i].y*fphi1[i].y + fphi2[i].x*fphi2[i].x + fphi2[i].y*fphi2[i].y);
-        fphi[i].y = 0;
-    }
-}
-
-// Computes tmpi = -lambdai + beta * yi
-__global__ void betay_m_lambda(CuR* lambda1, CuR* lambda2, CuR* y1, CuR* y2, CuR* tmp1, CuR* tmp2, float beta, int n)
-{
-    int i    = blockIdx.x * blockDim.x + threadIdx.x;
-    int step = blockDim.x * gridDim.x;
-
-    for ( ; i < n ; i += step) {
-        tmp1[i] = (beta * y1[i]) - lambda1[i];
-        tmp2[i] = (beta * y2[i]) - lambda2[i];
-    }
-}
-
-// Computes w = conj(u) * v
-__global__ void conju_x_v(CuC* u, CuC* v, CuC* w, int n)
-{
-    int i    = blockIdx.x * blockDim.x + threadIdx.x;
-    int step = blockDim.x * gridDim.x;
-    float a1, a2, b1, b2;
-
-    for ( ; i < n ; i += step) {
-        a1 = u[i].x;
-        b1 = u[i].y;
-        a2 = v[i].x;
-        b2 = v[i].y;
-        w[i].x = (a1 * a2) + (b1 * b2);
-        w[i].y = (b2 * a1) - (b1 * a2);
-    }
-}
-
-// fx = (tmp1 + tmp2) / fphi;
-__global__ void update_fx(CuC* ftmp1, CuC* ftmp2, CuC* fphi, CuC* fx, int n)
-{
-    int i    = blockIdx.x * blockDim.x + threadIdx.x;
-    int step = blockDim.x * gridDim.x;
+        for (int h = 1 ; h < (int)blockDim.x ; h *= 2) {
+            if (t % (2*h) == 0 && t + h < (int)blockDim.x) s[t] += s[t+h];
+            __syncthreads();
+        }
 
-    for ( ; i < n ; i += step) {
-        fx[i].x = (ftmp1[i].x + ftmp2[i].x) / fphi[i].x;
-        fx[i].y = (ftmp1[i].y + ftmp2[i].y) / fphi[i].x;
+        if (t == 0) scale[p] = sqrtf(sqrtf(s[0]));
+        __syncthreads();
     }
 }
 
-// -
-__global__ void update_y(CuR* d1u0, CuR* d2u0, CuR* tmp1, CuR* tmp2, CuR* lambda1, CuR* lambda2, CuR* y1, CuR* y2, float beta, int n)
+// u = (u0 - w/n)*max[p] on each plane p of n pixels, w = n (psi * x) being returned by VSNR_ADMM
+__global__ void store_planes(CuR* u0, CuR* w, float* max, CuR* u, int n, int N)
 {
     int i    = blockIdx.x * blockDim.x + threadIdx.x;
     int step = blockDim.x * gridDim.x;
-    float ng, t1, t2;
-
-    for ( ; i < n ; i += step) {
-        t1 = d1u0[i] - (tmp1[i] + (lambda1[i] / beta));
-        t2 = d2u0[i] - (tmp2[i] + (lambda2[i] / beta));
-        ng = sqrtf((t1 * t1) + (t2 * t2));
-
-        if (ng > 1.0 / beta) {
-            y1[i] = d1u0[i] - t1 * (1.0 - (1.0 / (beta * ng)));
-            y2[i] = d2u0[i] - t2 * (1.0 - (1.0 / (beta * ng)));
-        } else {
-            y1[i] = d1u0[i];
-            y2[i] = d2u0[i];
-        }
-    }
-}
 
-// -
-__global__ void update_lambda(CuR* lambda, CuR* tmp, CuR* y, float beta, int n)
-{
-    int i    = blockIdx.x * blockDim.x + threadIdx.x ;
-    int step = blockDim.x * gridDim.x;
-
-    for ( ; i < n ; i += step)
-        lambda[i] = lambda[i] + (beta * (tmp[i] - y[i]));
+    for ( ; i < N ; i += step)
+        u[i] = (u0[i] - w[i] / n) * max[i / n];
 }
 
-// Main function
-void VSNR_ADMM_GPU(float* u0, float* psi, int n0, int n1, int nit, float beta, float* u, int dimGrid, int dimBlock)
-{
-    cufftHandle planR2C, planC2R;
-    CuC *fpsi, *fu0;
-    CuC *fd1, *fd2, *fphi1, *fphi2, *fphi, *ftmp1, *ftmp2, *fx;
-    CuR *d1, *d2, *d1u0, *d2u0, *tmp1, *tmp2, *y1, *y2, *lambda1, *lambda2;
-
-    int n = n0*n1;
-    int m = n0*(n1/2+1);
+// Device buffers to denoise B planes of n0 x n1 at once, see VSNR_2D_FIJI_GPU_BATCH. The planes are one
+// n0 x n1 x B grid of the engine (D = 2, stacked along n2) run by its stencil solver, 1 R2C + 1 C2R of B
+// transforms per iteration. Plane p is filtered by scale[p]*fpsi.
+struct VSNR_BATCH : VSNR_ENGINE<2> {
+    int B;
 
-    cudaMalloc((void**)&fpsi, m*sizeof(CuC));
-    cudaMalloc((void**)&fu0,  m*sizeof(CuC));
-    cudaMalloc((void**)&d1u0, n*sizeof(CuR));
-    cudaMalloc((void**)&d2u0, n*sizeof(CuR));
-
-    // Allocation for the main loop
-    cudaMalloc((void**)&tmp1,  n*sizeof(CuR));
-    cudaMalloc((void**)&tmp2,  n*sizeof(CuR));
-    cudaMalloc((void**)&ftmp1, m*sizeof(CuC));
-    cudaMalloc((void**)&ftmp2, m*sizeof(CuC));
-
-    cufftPlan2d(&planR2C, n0, n1, CUFFT_R2C);
-    cufftPlan2d(&planC2R, n0, n1, CUFFT_C2R);
-
-    cufftExecR2C(planR2C, u0,  fu0); // fu0 = fftn(u0);
-    cufftExecR2C(planR2C, psi, fpsi); // fpsi = fftn(psi);
-
-    // Computes d1 and fd1
-    cudaMalloc((void**)&d1,  n*sizeof(CuR));
-    cudaMalloc((void**)&fd1, m*sizeof(CuC));
-    setd1<<<dimGrid,dimBlock>>>(d1, n, n1);  // d1[0] = 1; d1[n1-1] = -1;
-    cufftExecR2C(planR2C, d1, fd1); // fd1 = fftn(d1);
-    cudaFree(d1);
-
-    // Computes d2 and fd2
-    cudaMalloc((void**)&d2,  n*sizeof(CuR));
-    cudaMalloc((void**)&fd2, m*sizeof(CuC));
-    setd2<<<dimGrid,dimBlock>>>(d2, n, n1);  // d2[0] = 1; d2[n-n1] = -1;
-    cufftExecR2C(planR2C, d2, fd2); // fd2 = fftn(d2)
-    cudaFree(d2);
-
-    // Computes d1u0
-    product_carray<<<dimGrid,dimBlock>>>(fd1, fu0, ftmp1, m);
-    cufftExecC2R(planC2R, ftmp1, d1u0);  // d1u0 = ifftn(fd1.*fu0);
-    normalize<<<dimGrid,dimBlock>>>(d1u0, n);
-
-    // Computes d2u0
-    product_carray<<<dimGrid,dimBlock>>>(fd2, fu0, ftmp2, m);
-    cufftExecC2R(planC2R, ftmp2, d2u0);  // d2u0 = ifftn(fd2.*fu0);
-    normalize<<<dimGrid,dimBlock>>>(d2u0, n);
-
-    cudaFree(fu0); // This is unused until the end
-
-    // Computes fphi1 and fphi2
-    cudaMalloc((void**)&fphi1, m*sizeof(CuC));
-    cudaMalloc((void**)&fphi2, m*sizeof(CuC));
-    product_carray<<<dimGrid,dimBlock>>>(fd1, fpsi, fphi1, m); // fphi1 = fpsi.*fd1;
-    product_carray<<<dimGrid,dimBlock>>>(fd2, fpsi, fphi2, m); // fphi2 = fpsi.*fd2;
-
-    cudaFree(fd1);
-    cudaFree(fd2);
-
-    // Computes fphi
-    cudaMalloc((void**)&fphi, m*sizeof(CuC));
-    compute_phi<<<dimGrid,dimBlock>>>(fphi1, fphi2, fphi, beta, m);
-
-    // Initialization
-    cudaMalloc((void**)&y1, 	 n*sizeof(CuR));
-    cudaMalloc((void**)&y2, 	 n*sizeof(CuR));
-    cudaMalloc((void**)&lambda1, n*sizeof(CuR));
-    cudaMalloc((void**)&lambda2, n*sizeof(CuR));
-    cudaMalloc((void**)&fx, 	 m*sizeof(CuC));
-
-    cudaMemset(y1, 		0, n*sizeof(CuR));
-    cudaMemset(y2, 		0, n*sizeof(CuR));
-    cudaMemset(lambda1, 0, n*sizeof(CuR));
-    cudaMemset(lambda2, 0, n*sizeof(CuR));
-
-    // Main algorithm
-    for (int k = 0 ; k < nit ; ++k) {
-
-        // -------------------------------------------------------------
-        // First step, x update : (I+beta ATA)x = AT (-lambda+beta*ATy)
-        // -------------------------------------------------------------
-        // ftmp1 = conj(fphi1).*(fftn(-lambda1+beta*y1));
-        // ftmp2 = conj(fphi2).*(fftn(-lambda2+beta*y2));
-        betay_m_lambda<<<dimGrid,dimBlock>>>(lambda1, lambda2, y1, y2, tmp1, tmp2, beta, n);
-        cufftExecR2C(planR2C, tmp1, ftmp1);
-        cufftExecR2C(planR2C, tmp2, ftmp2);
-        conju_x_v<<<dimGrid,dimBlock>>>(fphi1, ftmp1, ftmp1, m);
-        conju_x_v<<<dimGrid,dimBlock>>>(fphi2, ftmp2, ftmp2, m);
-        update_fx<<<dimGrid,dimBlock>>>(ftmp1, ftmp2, fphi, fx, m);
-
-        // --------------------------------------------------------
-        // Second step y update : y = prox_{f1/beta}(Ax+lambda/beta)
-        // --------------------------------------------------------
-        product_carray<<<dimGrid,dimBlock>>>(fphi1, fx, ftmp1, m);
-        product_carray<<<dimGrid,dimBlock>>>(fphi2, fx, ftmp2, m);
-        cufftExecC2R(planC2R, ftmp1, tmp1); // tmp1 = Ax1
-        cufftExecC2R(planC2R, ftmp2, tmp2); // tmp2 = Ax2
-        normalize<<<dimGrid,dimBlock>>>(tmp1, n);
-        normalize<<<dimGrid,dimBlock>>>(tmp2, n);
-        update_y<<<dimGrid,dimBlock>>>(d1u0, d2u0, tmp1, tmp2, lambda1, lambda2, y1, y2, beta, n);
-
-        // --------------------------
-        // Third step lambda update
-        // --------------------------
-        update_lambda<<<dimGrid,dimBlock>>>(lambda1, tmp1, y1, beta, n);
-        update_lambda<<<dimGrid,dimBlock>>>(lambda2, tmp2, y2, beta, n);
-
-    }
+    cufftHandle planBank;  // 1 R2C transform, see CREATE_BANK
+    void *arena, *work;    // one allocation holding the buffers and the work area of the 3 plans
 
-    // Last but not the least : u = u0 - (psi * x)
-    product_carray<<<dimGrid,dimBlock>>>(fx, fpsi, ftmp1, m);
-    cufftExecC2R(planC2R, ftmp1, u);
-    normalize<<<dimGrid,dimBlock>>>(u, n);
-    substract<<<dimGrid,dimBlock>>>(u0, u, u, n);
-
-    // Free memory
-    cudaFree(fpsi);
-    cudaFree(fphi);
-    cudaFree(fphi1);
-    cudaFree(fphi2);
-    cudaFree(ftmp1);
-    cudaFree(ftmp2);
-    cudaFree(fx);
-
-    cudaFree(d1u0);
-    cudaFree(d2u0);
-    cudaFree(y1);
-    cudaFree(y2);
-    cudaFree(lambda1);
-    cudaFree(lambda2);
-    cudaFree(tmp1);
-    cudaFree(tmp2);
-
-    cufftDestroy(planR2C);
-    cufftDestroy(planC2R);
-}
+    float *max;            // B, per plane
+    CuR *u0;               // B*n
+};
 
 // Sets Gabor
 __global__ void create_gabor(CuR* psi, int n0, int n1, float level, float sigmax, float sigmay, float angle, float phase, float lambda)
@@ -480,221 +143,277 @@ __global__ void create_gabor(CuR* psi, int n0, int n1, float level, float sigmax
     }
 }
 
-// Sets dirac
-__global__ void create_dirac(CuR* psi, float val, int n)
-{
-    int i    = blockIdx.x * blockDim.x + threadIdx.x;
-    int step = blockDim.x * gridDim.x;
-
-    for ( ; i < n ; i += step) {
-        if (i == 0) psi[i] = val;
-        else        psi[i] = 0.0;
-    }
-}
-
-// Sets Psi = |Psi|^2
-__global__ void compute_squared_norm(CuC* fpsi, int m)
-{
-    int i    = blockIdx.x * blockDim.x + threadIdx.x;
-    int step = blockDim.x * gridDim.x;
-
-    for ( ; i < m ; i += step) {
-        fpsi[i].x = SQ(fpsi[i].x) + SQ(fpsi[i].y);
-        fpsi[i].y = 0.0;
-    }
-}
-
-// Sets Psi = sqrtf(|Psi|^2)
-__global__ void compute_norm(CuC* fpsi, int m)
-{
-    int i    = blockIdx.x * blockDim.x + threadIdx.x;
-    int step = blockDim.x * gridDim.x;
-
-    for ( ; i < m ; i += step) {
-        fpsi[i].x = sqrtf(SQ(fpsi[i].x) + SQ(fpsi[i].y));
-        fpsi[i].y = 0.0;
-    }
-}
-
 // Sets fsum = sqrtf(fsum)
-__global__ void compute_sqrtf(CuC* fsum, int m)
-{
-    int i    = blockIdx.x * blockDim.x + threadIdx.x;
-    int step = blockDim.x * gridDim.x;
-
-    for ( ; i < m ; i += step) {
-        fsum[i].x = sqrtf(fsum[i].x);
-        fsum[i].y = 0.0;
-    }
-}
-
-// Sets ftmp = fpsi * fd
-__global__ void compute_product(CuC* fpsi, CuC* fd, float* ftmp, int m)
+__global__ void compute_sqrtf(float* fsum, int m)
 {
     int i    = blockIdx.x * blockDim.x + threadIdx.x;
     int step = blockDim.x * gridDim.x;
 
     for ( ; i < m ; i += step)
-        ftmp[i] = fpsi[i].x * fd[i].x;
+        fsum[i] = sqrtf(fsum[i]);
 }
 
-// Sets fsum += fpsitemp / alpha
-__global__ void update_psi(CuC* fpsitemp, CuC* fsum, float alpha, int m)
+// Gabor of create_gabor (level 1, phase and lambda 0), p = sigmax, sigmay, angle
+VSNR_GABOR gabor(float* p, VSNR_GRID g)
 {
-    int i    = blockIdx.x * blockDim.x + threadIdx.x;
-    int step = blockDim.x * gridDim.x;
-
-    for ( ; i < m ; i += step) {
-        fsum[i].x += fpsitemp[i].x / alpha;
-    }
+    VSNR_GABOR gb;
+    float theta = p[2] * PI / 180.0;
+
+    memset(&gb, 0, sizeof(VSNR_GABOR));
+    gb.R[0] = cosf(theta);  gb.R[1] = sinf(theta);
+    gb.R[2] = -sinf(theta); gb.R[3] = cosf(theta);
+    gb.sigma[0] = p[0];
+    gb.sigma[1] = p[1];
+    gb.frac[0]  = (g.n1 % 2) / 2.0; // n/2.0 + 1
+    gb.frac[1]  = (g.n0 % 2) / 2.0;
+    gb.amp = sqrtf(p[0]*p[1]) / PI;
+    gb.r   = gabor_aliases<2>(gb, g);
+    return gb;
 }
 
-// This function creates the filters from a Java list of filters
-void CREATE_FILTERS(float* psis, float* gu0, int length, float* gpsi, int n0, int n1, int dimGrid, int dimBlock)
+// This function creates the filters from a Java list of filters.
+// fpsi = sqrtf(sum_i |PSI_i|^2 eta_i / (sqrt(n) mmax_i)) is the filter of a plane of norm 1, the plane u0
+// uses sqrtf(||u0||) fpsi, i.e. PSI = sqrtf(sum_i |PSI_i|^2/alpha_i) with alpha_i = sqrt(n) n^2 mmax_i / (||u0|| eta_i)
+// once transformed back and forth (fftn(ifftn(.)) = n).
+// |PSI_i|^2 is set in closed form, only the Gabor filters too wide for the plane are sampled and transformed.
+// fphi, res and the work buffers of the ADMM, not in use yet, hold the filters being built, mmax_i stays on the device.
+void CREATE_BANK(VSNR_BATCH* b, float* psis, int length, int n0, int n1, int dimGrid, int dimBlock)
 {
     int i = 0;
     int n = n0*n1;
     int m = n0*(n1/2+1);
-    cublasHandle_t handle;
-
-    float eta, alpha, max1, max2, mmax, norm;
-    float *psitemp, *ftmp;
-    CuC *fpsitemp, *fsum, *fd1, *fd2;
-    CuR *d1, *d2;
-    cufftHandle planR2C, planC2R;
-    int imax;
-
-    cudaMalloc((void**)&psitemp,  n*sizeof(float));
-    cudaMalloc((void**)&fpsitemp, m*sizeof(CuC));
-    cudaMalloc((void**)&ftmp, 	  m*sizeof(float));
-    cudaMalloc((void**)&fsum, 	  m*sizeof(CuC));
-    cudaMalloc((void**)&d1, 	  n*sizeof(CuR));
-    cudaMalloc((void**)&fd1,	  m*sizeof(CuC));
-    cudaMalloc((void**)&d2, 	  n*sizeof(CuR));
-    cudaMalloc((void**)&fd2,	  m*sizeof(CuC));
-
-    cudaMemset(fsum, 0, m*sizeof(CuC));
-
-    cublasCreate(&handle);
-
-    cufftPlan2d(&planR2C, n0, n1, CUFFT_R2C);
-    cufftPlan2d(&planC2R, n0, n1, CUFFT_C2R);
-
-    // Computes the l2 norm of u0 on GPU
-    cublasSnrm2(handle, n, gu0, 1, &norm);
-
-    // Computes d1 and fd1
-    setd1<<<dimGrid,dimBlock>>>(d1, n, n1); // d1[0] = 1; d1[n1-1] = -1;
-    cufftExecR2C(planR2C, d1, fd1);
-    compute_norm<<<dimGrid,dimBlock>>>(fd1, m); // fd1 = |fd1|;
-    cudaFree(d1);
-
-    // Computes d2 and fd2
-    setd2<<<dimGrid,dimBlock>>>(d2, n, n1); // d2[0] = 1; d2[(n0-1)*n1] = -1;
-    cufftExecR2C(planR2C, d2, fd2);
-    compute_norm<<<dimGrid,dimBlock>>>(fd2, m); // fd2 = |fd2|;
-    cudaFree(d2);
+
+    float eta;
+    VSNR_GABOR gb;
+    float *psitemp  = b->tmp.c[0];
+    float *mmax     = b->res; // device, 1 float
+    float *fpsitemp = b->fphi;
+    float *fpsi     = b->fpsi;
+    CuC *fgabor     = b->ftmp.c[0];
+    VSNR_GRID g = {n0, n1, 1, {1, 1, 1}};
+
+    cudaMemset(fpsi, 0, m*sizeof(float));
 
     // Computes PSI = sum_{i=1}^m |PSI_i|^2/alpha_i, where alpha_i is defined in the paper.
     while (i < length) {
 
         if (psis[i] == 0) {
-            create_dirac<<<dimGrid,dimBlock>>>(psitemp, 1, n);
+            create_dirac_spectrum<<<dimGrid,dimBlock>>>(fpsitemp, 1, m); // fpsitemp = |fftn(dirac)|^2;
             eta = psis[i+1];
             i += 2;
         } else if (psis[i] == 1) {
             // 1 : amplitude, 2 : gammaX, 3 : gammaY, 4 : angle, 5 : phase_psi, 6 :frequency
-            create_gabor<<<dimGrid,dimBlock>>>(psitemp, n0, n1, 1, psis[i+2], psis[i+3], psis[i+4], 0, 0);
+            gb = gabor(&psis[i+2], g);
+            if (gb.r >= 0) {
+                create_gabor_spectrum<2><<<dimGrid,dimBlock>>>(fpsitemp, gb, g); // fpsitemp = |fftn(gabor)|^2;
+            } else {
+                create_gabor<<<dimGrid,dimBlock>>>(psitemp, n0, n1, 1, psis[i+2], psis[i+3], psis[i+4], 0, 0);
+                cufftExecR2C(b->planBank, psitemp, fgabor);
+                compute_squared_norm<<<dimGrid,dimBlock>>>(fgabor, fpsitemp, m); // fpsitemp = |fgabor|^2;
+            }
             eta = psis[i+1];
             i += 5;
         }
 
-        cufftExecR2C(planR2C, psitemp, fpsitemp);
+        cudaMemset(mmax, 0, sizeof(float));
+        fd_product_max<2><<<dimGrid,dimBlock>>>(fpsitemp, g, mmax); // mmax = max_k |fdk|*|fpsitemp|;
 
-        compute_squared_norm<<<dimGrid,dimBlock>>>(fpsitemp, m); // fpsitemp = |fpsitemp|^2;
-
-        compute_product<<<dimGrid,dimBlock>>>(fpsitemp, fd1, ftmp, m); // ftmp = |fd1|*|fpsitemp|;
-        cublasIsamax(handle, m, ftmp, 1, &imax);
-        cudaMemcpy(&max1, &ftmp[imax-1], sizeof(float), cudaMemcpyDeviceToHost); // max1 = ftmp[imax];
-
-        compute_product<<<dimGrid,dimBlock>>>(fpsitemp, fd2, ftmp, m); // ftmp = |fd2|*|fpsitemp|;
-        cublasIsamax(handle, m, ftmp, 1, &imax);
-        cudaMemcpy(&max2, &ftmp[imax-1], sizeof(float), cudaMemcpyDeviceToHost); // max2 = ftmp[imax];
-
-        mmax = MAX(max1, max2);
-
-        alpha = sqrtf((float)n) * SQ((float)n) * mmax / (norm * eta);
-
-        update_psi<<<dimGrid,dimBlock>>>(fpsitemp, fsum, alpha, m); // fsum += |fpsitemp|^2 / alpha_i;
+        update_psi<<<dimGrid,dimBlock>>>(fpsitemp, fpsi, mmax, eta / sqrtf((float)n), m); // fpsi += |fpsitemp|^2 / alpha_i, alpha_i = sqrt(n) mmax_i / eta_i;
 
     }
 
-    compute_sqrtf<<<dimGrid,dimBlock>>>(fsum, m); // fsum = sqrtf(fsum);
-
-    cufftExecC2R(planC2R, fsum, gpsi);
-
-    cudaFree(psitemp);
-    cudaFree(fpsitemp);
-    cudaFree(ftmp);
-    cudaFree(fsum);
-    cudaFree(fd1);
-    cudaFree(fd2);
-    cufftDestroy(planR2C);
-    cufftDestroy(planC2R);
-    cublasDestroy(handle);
+    compute_sqrtf<<<dimGrid,dimBlock>>>(fpsi, m); // fpsi = sqrtf(fpsi);
 }
 
 // -
 _export_ int getMaxGrid()
 {
-    struct cudaDeviceProp properties;
-    int device;
-    cudaGetDevice(&device);
-    cudaGetDeviceProperties(&properties, device);
-    return properties.maxGridSize[1];
+    int grid, blocks;
+    device_limits(&grid, &blocks);
+    return grid;
 }
 
 // -
 _export_ int getMaxBlocks()
 {
-    struct cudaDeviceProp properties;
-    int device;
-    cudaGetDevice(&device);
-    cudaGetDeviceProperties(&properties, device);
-    return properties.maxThreadsDim[0];
+    int grid, blocks;
+    device_limits(&grid, &blocks);
+    return blocks;
 }
 
-// -
-_export_ void VSNR_2D_FIJI_GPU(float* psis, int length, float* u0, int n0, int n1, int nit, float beta, float* u, int nBlocks, float max)
+// Plans the B transforms of a batch without their work area, they use b->work once the arena is
+// allocated (fewer planes never need more), and sets its grid. Returns the bytes of work area they need.
+size_t plan_batch(VSNR_BATCH* b, int n0, int n1)
 {
+    int dims[2] = {n0, n1};
     int n = n0*n1;
-    float *gu, *gu0, *gpsi;
+    int m = n0*(n1/2+1);
+    size_t workR2C = 0, workC2R = 0;
+    VSNR_GRID g = {n0, n1, b->B, {1, 1, 1}};
+
+    b->grid = g;
+    b->n = b->B*n;
+    b->m = b->B*m;
+
+    if (b->planR2C) cufftDestroy(b->planR2C);
+    if (b->planC2R) cufftDestroy(b->planC2R);
+
+    cufftCreate(&b->planR2C);
+    cufftCreate(&b->planC2R);
+    cufftSetAutoAllocation(b->planR2C, 0);
+    cufftSetAutoAllocation(b->planC2R, 0);
+    cufftMakePlanMany(b->planR2C, 2, dims, NULL, 1, n, NULL, 1, m, CUFFT_R2C, b->B, &workR2C);
+    cufftMakePlanMany(b->planC2R, 2, dims, NULL, 1, m, NULL, 1, n, CUFFT_C2R, b->B, &workC2R);
+
+    if (b->work) {
+        cufftSetWorkArea(b->planR2C, b->work);
+        cufftSetWorkArea(b->planC2R, b->work);
+    }
+    return MAX(workR2C, workC2R);
+}
+
+// Carves the buffers of a batch from the arena at p (NULL to size it), returns its bytes
+size_t carve_batch(VSNR_BATCH* b, char* p, int n, int m, size_t work)
+{
+    char* p0 = p;
+    size_t N = (size_t)b->B*n;
+    size_t M = (size_t)b->B*m;
+
+    b->fpsi  = (float*)carve(&p, m*sizeof(float));
+    b->fphi  = (float*)carve(&p, m*sizeof(float));
+    b->res   = (float*)carve(&p, VSNR_RES_SIZE*sizeof(float));
+
+    b->scale = (float*)carve(&p, b->B*sizeof(float));
+    b->max   = (float*)carve(&p, b->B*sizeof(float));
+
+    b->fx        = (CuC*)carve(&p, M*sizeof(CuC));
+    b->ftmp.c[0] = (CuC*)carve(&p, M*sizeof(CuC));
+    b->u0        = (CuR*)carve(&p, N*sizeof(CuR));
+    b->tmp.c[0]  = (CuR*)carve(&p, N*sizeof(CuR));
+
+    for (int k = 0 ; k < 2 ; ++k) {
+        b->du0.c[k] = carve(&p, N*sizeof(CuR));
+        b->y.c[k]   = carve(&p, N*sizeof(CuR));
+        b->l.c[k]   = carve(&p, N*sizeof(CuR));
+    }
+
+    b->work = carve(&p, work);
+    return p - p0;
+}
+
+// Frees a batch (members may be NULL)
+void free_batch(VSNR_BATCH* b)
+{
+    cudaFree(b->arena);
+    destroy_events(b);
+
+    if (b->planR2C)  cufftDestroy(b->planR2C);
+    if (b->planC2R)  cufftDestroy(b->planC2R);
+    if (b->planBank) cufftDestroy(b->planBank);
+}
+
+// Denoises nPlanes planes of n0 x n1 stored one after the other in u0 into u, plane p is divided by max[p].
+// The filters are built once and the planes go through batched transforms, as many at a time as the
+// device memory allows. Returns 0, or -1 if a plane is too large for the int indices of the kernels (see
+// VSNR_MAX_SAMPLES), if the device memory cannot be allocated or if a CUDA call fails (u is then not set).
+_export_ int VSNR_2D_FIJI_GPU_BATCH(float* psis, int length, float* u0, int n0, int n1, int nPlanes, int nit, float beta, float* u, int nBlocks, float* max)
+{
+    size_t avail, total, plane, shared, work, workBank = 0;
+    VSNR_BATCH b;
+    CuR* w;
+
+    // a batch holds at least one plane
+    if (2*(size_t)n0*(n1/2+1) + (size_t)n0*n1 > VSNR_MAX_SAMPLES) {
+        fprintf(stderr, "~ VSNR_2D_FIJI_GPU_BATCH: %d x %d plane too large\n", n0, n1);
+        return -1;
+    }
+
+    int n = n0*n1;
+    int m = n0*(n1/2+1);
+
+    memset(&b, 0, sizeof(VSNR_BATCH));
+    b.solver    = VSNR_SOLVER_STENCIL;
+    b.precision = VSNR_PRECISION_FLOAT;
+    b.accel     = VSNR_ACCEL_NONE;
+    b.alpha     = 1;
+
+    // 1. Planes per batch : 8 real + 2 complex buffers, and about 1 complex buffer of cufft work area per plane,
+    // on top of the filters shared by all planes (at least 1 plane, the allocation tells if it fits)
+    cudaMemGetInfo(&avail, &total);
+    avail  = avail * 9 / 10;
+    plane  = 8*n*sizeof(CuR) + 3*m*sizeof(CuC);
+    shared = 2*m*sizeof(float);
+    b.B = (int)MIN((size_t)nPlanes, (avail > shared ? avail - shared : 0) / plane);
+    b.B = (int)MIN((size_t)b.B, (size_t)VSNR_MAX_SAMPLES / (2*(size_t)m + n)); // int indices
+    b.B = MAX(b.B, 1);
 
     int dimBlock = MIN(nBlocks, getMaxBlocks());
     dimBlock = MAX(dimBlock, 1);
-    int dimGrid = MIN(n/dimBlock, getMaxGrid());
+    int dimGrid = MIN(b.B*n/dimBlock, getMaxGrid());
     dimGrid = MAX(dimGrid, 1);
+    b.dimGrid  = dimGrid;
+    b.dimBlock = dimBlock;
+
+    // 2. Plans, they run one at a time and share one work area
+    cufftCreate(&b.planBank);
+    cufftSetAutoAllocation(b.planBank, 0);
+    cufftMakePlan2d(b.planBank, n0, n1, CUFFT_R2C, &workBank);
+    work = MAX(plan_batch(&b, n0, n1), workBank);
+
+    // 3. Alloc memory, one arena for the buffers and the work area
+    cudaGetLastError();
+    cudaMalloc(&b.arena, carve_batch(&b, NULL, n, m, work));
+
+    if (cudaPeekAtLastError() != cudaSuccess) {
+        __dispLastCudaError(stderr, "VSNR_2D_FIJI_GPU_BATCH");
+        b.arena = NULL;
+        free_batch(&b);
+        return -1;
+    }
 
-    // 1. Alloc memory
-    cudaMalloc((void**)&gu,   n*sizeof(float));
-    cudaMalloc((void**)&gpsi, n*sizeof(float));
-    cudaMalloc((void**)&gu0,  n*sizeof(float));
+    carve_batch(&b, (char*)b.arena, n, m, work);
+    cufftSetWorkArea(b.planBank, b.work);
+    cufftSetWorkArea(b.planR2C, b.work);
+    cufftSetWorkArea(b.planC2R, b.work);
+    create_events(&b);
 
-    cudaMemcpy(gu0, u0, n*sizeof(float), cudaMemcpyHostToDevice);
-    divide<<<dimGrid, dimBlock>>>(gu0, n, max);
+    // 4. Prepares filters, shared by all planes
+    CREATE_BANK(&b, psis, length, n0, n1, dimGrid, dimBlock);
 
-    // 2. Prepares filters
-    CREATE_FILTERS(psis, gu0, length, gpsi, n0, n1, dimGrid, dimBlock);
+    // 5. Denoises the planes by batches of B
+    for (int p = 0 ; p < nPlanes ; p += b.B) {
+
+        if (nPlanes - p < b.B) {
+            b.B = nPlanes - p;
+            plan_batch(&b, n0, n1);
+        }
 
-    // 3. Denoises the image
-    VSNR_ADMM_GPU(gu0, gpsi, n0, n1, nit, beta, gu, dimGrid, dimBlock);
+        cudaMemcpy(b.u0,  &u0[(size_t)p*n], b.B*n*sizeof(float), cudaMemcpyHostToDevice);
+        cudaMemcpy(b.max, &max[p],          b.B*sizeof(float),   cudaMemcpyHostToDevice);
+        divide_planes<<<dimGrid, dimBlock>>>(b.u0, b.max, n, b.B*n);
 
-    // 4. Copies the result to u
-    multiply<<<dimGrid, dimBlock>>>(gu, n, max);
-    cudaMemcpy(u, gu, n*sizeof(float), cudaMemcpyDeviceToHost);
+        // the filter of a plane scales with the square root of its l2 norm
+        scale_planes<<<MIN(b.B, getMaxGrid()), dimBlock>>>(b.u0, b.scale, n, b.B);
 
-    // 5. Frees memory
-    cudaFree(gu);
-    cudaFree(gu0);
-    cudaFree(gpsi);
+        w = VSNR_ADMM(&b, b.u0, nit, beta);
+
+        store_planes<<<dimGrid, dimBlock>>>(b.u0, w, b.max, b.u0, n, b.B*n);
+        cudaMemcpy(&u[(size_t)p*n], b.u0, b.B*n*sizeof(float), cudaMemcpyDeviceToHost);
+    }
+
+    // 6. Frees memory
+    free_batch(&b);
+
+    if (cudaPeekAtLastError() != cudaSuccess) {
+        __dispLastCudaError(stderr, "VSNR_2D_FIJI_GPU_BATCH");
+        return -1;
+    }
+    return 0;
+}
+
+// One plane, same as VSNR_2D_FIJI_GPU_BATCH with nPlanes = 1
+_export_ int VSNR_2D_FIJI_GPU(float* psis, int length, float* u0, int n0, int n1, int nit, float beta, float* u, int nBlocks, float max)
+{
+    // -
+    return VSNR_2D_FIJI_GPU_BATCH(psis, length, u0, n0, n1, 1, nit, beta, u, nBlocks, &max);
 }
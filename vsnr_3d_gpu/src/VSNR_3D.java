@@ -18,6 +18,8 @@ import java.lang.Math;
 import java.lang.ClassLoader;
 import java.nio.file.Paths;
 import java.nio.FloatBuffer;
+import java.nio.ShortBuffer;
+import java.nio.ByteBuffer;
 import java.awt.Font;
 import java.awt.AWTEvent;
 import java.awt.TextField;
@@ -27,8 +29,10 @@ import java.util.Arrays;
 import java.util.ArrayList;
 import java.util.Scanner;
 import java.util.Vector;
+import com.sun.jna.Callback;
 import com.sun.jna.Library;
 import com.sun.jna.Native;
+import com.sun.jna.Pointer;
 import ij.IJ;
 import ij.ImagePlus;
 import ij.ImageStack;
@@ -71,11 +75,23 @@ public class VSNR_3D implements PlugInFilter {
     private float beta   = 10;
     private int   nit    = 20;
     private int   nBlock;
+    private float tol    = 0;
+    private int   accel  = 0;
+    private boolean warm = false;
 
     private boolean bLog  = false;
 
     private VsnrDllLoader dll = null;
 
+    // progress bar inside a block, the callback is referenced here so that it is not collected while the context uses it
+    private double progressBase;
+    private double progressStep;
+    private VsnrProgress progress = new VsnrProgress() {
+        public void invoke(int iteration, int nit, float primal, float dual, Pointer user) {
+            IJ.showProgress(progressBase + progressStep * iteration / nit);
+        }
+    };
+
     // --------------------------------------------------------------------
 
     @Override
@@ -233,6 +249,43 @@ public class VSNR_3D implements PlugInFilter {
                             listFilters.add((float)thetaZ);
                         }
                         break;
+                    case 14 :
+                        tmp = scanLine.next();
+                        if (tmp.equals("gpu"))      dll.setBackend(0);
+                        else if (tmp.equals("cpu")) dll.setBackend(1);
+                        else                        dll.setBackend(-1);
+                        break;
+                    case 15 :
+                        tmp = scanLine.next();
+                        if (tmp.equals("stencil"))     dll.setSolver(1);
+                        else if (tmp.equals("lowmem")) dll.setSolver(2);
+                        else                           dll.setSolver(0);
+                        break;
+                    case 16 :
+                        tol = Float.parseFloat(scanLine.next());
+                        break;
+                    case 17 :
+                        tmp = scanLine.next();
+                        if (tmp.equals("relax"))         accel = 1;
+                        else if (tmp.equals("nesterov")) accel = 2;
+                        else if (tmp.equals("adaptive")) accel = 3;
+                        else                             accel = 0;
+                        break;
+                    case 18 :
+                        tmp = scanLine.next();
+                        if (tmp.equals("half"))      dll.setPrecision(1);
+                        else if (tmp.equals("bf16")) dll.setPrecision(2);
+                        else                         dll.setPrecision(0);
+                        break;
+                    case 19 :
+                        tmp = scanLine.next();
+                        if (tmp.equals("mirror"))        dll.setPadding(1);
+                        else if (tmp.equals("periodic")) dll.setPadding(2);
+                        else                             dll.setPadding(0);
+                        break;
+                    case 20 :
+                        warm = Boolean.parseBoolean(scanLine.next());
+                        break;
                     case 0 :
                     default :
                         break;
@@ -268,6 +321,13 @@ public class VSNR_3D implements PlugInFilter {
         else if (str.equals("thetaX:"))      return 11;
         else if (str.equals("thetaY:"))      return 12;
         else if (str.equals("thetaZ:"))      return 13;
+        else if (str.equals("Backend:"))     return 14;
+        else if (str.equals("Solver:"))      return 15;
+        else if (str.equals("Tolerance:"))   return 16;
+        else if (str.equals("Acceleration:")) return 17;
+        else if (str.equals("Precision:"))   return 18;
+        else if (str.equals("Padding:"))     return 19;
+        else if (str.equals("Warm_Start:"))  return 20;
         else if (str.equals("***"))          return 0;
         else return (-1);
     }
@@ -283,6 +343,13 @@ public class VSNR_3D implements PlugInFilter {
         else
             IJ.log("Num_Block: " + nBlock);
         IJ.log("Log: " + bLog);
+        IJ.log("Backend: " + (dll.getBackend() == 1 ? "cpu" : "gpu"));
+        IJ.log("Solver: " + (dll.getSolver() == 2 ? "lowmem" : dll.getSolver() == 1 ? "stencil" : "fft"));
+        IJ.log("Tolerance: " + tol);
+        IJ.log("Acceleration: " + (accel == 3 ? "adaptive" : accel == 2 ? "nesterov" : accel == 1 ? "relax" : "none"));
+        IJ.log("Precision: " + (dll.getPrecision() == 2 ? "bf16" : dll.getPrecision() == 1 ? "half" : "float"));
+        IJ.log("Padding: " + (dll.getPadding() == 2 ? "periodic" : dll.getPadding() == 1 ? "mirror" : "none"));
+        IJ.log("Warm_Start: " + warm);
         if (sBlock == slice) {
             IJ.log("sBlock: auto");
             IJ.log("dBlock: auto");
@@ -425,6 +492,11 @@ public class VSNR_3D implements PlugInFilter {
         float[] d = getDeltas(image);
         int length = listFilters.size();
 
+        // one native context per block depth, reused by every chan / frame. With a warm start, each colour component of
+        // an RGB image has its own context, so that it starts from the state of the same component in the previous frame
+        Pointer[] ctx = new Pointer[(warm && image.getBitDepth() == 24) ? 3 : 1];
+        int ctxDepth = 0;
+
         for (int k = 0 ; k < slice ; k += lStep) {
 
             lStep = (count++ < mod ? step + inc : step);
@@ -447,7 +519,42 @@ public class VSNR_3D implements PlugInFilter {
                     IJ.showStatus("Denoising slices "+(k+1)+"-"+(k+lStep)+"/"+slice+", chan "+(c+1)+"/"+chan+", frame "+(t+1)+"/"+frame);
 
                     input  = new Image3D(tmpImage, k-dLeft, lStep+dLeft+dRight, c, t, bLog);
-                    output = input.denoise(buff, length, nit, beta, nBlock, dll, d[0], d[1], d[2]);
+
+                    if (ctx[0] == null || ctxDepth != lStep+dLeft+dRight) {
+                        ctxDepth = lStep+dLeft+dRight;
+                        for (int i = 0 ; i < ctx.length ; i++) {
+                            if (ctx[i] != null) dll.VSNR_3D_DESTROY_CONTEXT(ctx[i]);
+                            ctx[i] = dll.VSNR_3D_CREATE_CONTEXT(image.getHeight(), image.getWidth(), ctxDepth, d[0], d[1], d[2], nBlock);
+                            if (ctx[i] == null) {
+                                long mb = ctx.length * dll.VSNR_3D_PEAK_MEMORY(image.getHeight(), image.getWidth(), ctxDepth, dll.getSolver()) >> 20;
+                                exitWindow("Error :\nNot enough memory on the GPU for this block size (" + mb + " MB) !\nTry a smaller sBlock or \"Solver: lowmem\".");
+                            }
+                            dll.VSNR_3D_SET_CONTEXT_TOLERANCE(ctx[i], tol, 10);
+                            dll.VSNR_3D_SET_CONTEXT_PROGRESS(ctx[i], progress, Math.max(nit / 20, 1), null);
+                            if (dll.VSNR_3D_SET_CONTEXT_ACCELERATION(ctx[i], accel, 1.6f) != 0)
+                                exitWindow("Error :\nNot enough memory on the GPU for \"Acceleration: nesterov\" !\nTry a smaller sBlock or another acceleration.");
+                        }
+                    }
+
+                    // the frames of a block and chan follow each other, each one starts from the state of the previous one
+                    for (Pointer p : ctx)
+                        dll.VSNR_3D_SET_CONTEXT_WARM_START(p, (warm && t > 0) ? 1 : 0);
+
+                    progressBase = (double)timer / (slice*chan*frame);
+                    progressStep = (double)lStep / (slice*chan*frame);
+                    output = input.denoise(buff, length, nit, beta, ctx, dll);
+                    if (output == null) {
+                        for (Pointer p : ctx) dll.VSNR_3D_DESTROY_CONTEXT(p);
+                        exitWindow("Error :\nThe denoising of slices "+(k+1)+"-"+(k+lStep)+" failed on the GPU (see the console) !");
+                    }
+
+                    if (tol > 0) {
+                        int[]   it     = new int[1];
+                        float[] primal = new float[1];
+                        float[] dual   = new float[1];
+                        dll.VSNR_3D_GET_CONTEXT_STATS(ctx[0], it, primal, dual);
+                        IJ.log("Slices "+(k+1)+"-"+(k+lStep)+" : "+it[0]+" iterations (primal "+primal[0]+", dual "+dual[0]+")");
+                    }
 
                     output.agregate(result, dLeft, dRight, bLog);
 
@@ -460,6 +567,14 @@ public class VSNR_3D implements PlugInFilter {
 
         }
 
+        if (ctx[0] != null) {
+            byte[] json = new byte[1024];
+            dll.VSNR_3D_GET_CONTEXT_PROFILE_JSON(ctx[0], json, json.length);
+            IJ.log("Profile (last block size) : " + Native.toString(json));
+        }
+        for (Pointer p : ctx)
+            if (p != null) dll.VSNR_3D_DESTROY_CONTEXT(p);
+
         input    = null;
         output   = null;
         tmpImage = null;
@@ -528,8 +643,11 @@ public class VSNR_3D implements PlugInFilter {
         private int start;
 
         private Boolean bColor;
+        private int bits; // 8 or 16 : the samples go to the library as they are (no log), 32 : as floats
 
         private float[][] arr;
+        private byte[]    arr8;
+        private short[]   arr16;
         private float[]   max;
 
         public Image3D(ImagePlus img, int start, int size, int channel, int frame, Boolean bLog)
@@ -541,11 +659,33 @@ public class VSNR_3D implements PlugInFilter {
             this.frame  = frame;
             this.start  = start;
             this.bColor = (img.getBitDepth() == 24);
+            this.bits   = ((img.getBitDepth() == 8 || img.getBitDepth() == 16) && !bLog ? img.getBitDepth() : 32);
 
             ImageProcessor ip;
             float tmp;
+            int plane = width*height;
 
-            if (bColor) {
+            if (bits != 32) {
+
+                // the library adds the +1 below (offset 1), the max includes it
+                this.allocate(1, plane*depth);
+
+                int top = 0;
+                for (int k = 0 ; k < size ; k++) {
+                    ip = getIP(img,k);
+                    if (bits == 8) {
+                        byte[] px = (byte[])ip.getPixels();
+                        System.arraycopy(px, 0, arr8, k*plane, plane);
+                        for (int i = 0 ; i < plane ; i++) top = Math.max(top, px[i] & 0xff);
+                    } else {
+                        short[] px = (short[])ip.getPixels();
+                        System.arraycopy(px, 0, arr16, k*plane, plane);
+                        for (int i = 0 ; i < plane ; i++) top = Math.max(top, px[i] & 0xffff);
+                    }
+                }
+                max[0] = top + 1.0f;
+
+            } else if (bColor) {
 
                 this.allocate(3, width*height*depth);
 
@@ -584,12 +724,13 @@ public class VSNR_3D implements PlugInFilter {
             }
         }
 
-        public Image3D(int width, int height, int depth, int chan, int frame, int start, Boolean bColor)
+        public Image3D(int width, int height, int depth, int chan, int frame, int start, Boolean bColor, int bits)
         {
             this.width  = width;
             this.height = height;
             this.depth  = depth;
             this.bColor = bColor;
+            this.bits   = bits;
             this.chan   = chan;
             this.frame  = frame;
             this.start  = start;
@@ -602,7 +743,9 @@ public class VSNR_3D implements PlugInFilter {
         private void allocate(int dim, int size)
         {
             try {
-                arr = new float[dim][size];
+                if (bits == 8)       arr8  = new byte[size];
+                else if (bits == 16) arr16 = new short[size];
+                else                 arr   = new float[dim][size];
                 max = new float[dim];
                 Arrays.fill(max, Float.NEGATIVE_INFINITY);
             } catch (Throwable e) {
@@ -619,16 +762,24 @@ public class VSNR_3D implements PlugInFilter {
             return img.getProcessor();
         }
 
-        public Image3D denoise(FloatBuffer buffPsis, int length, int nit, float beta, int nBlock, VsnrDllLoader dll, float dx, float dy, float dz)
+        // ctx holds one context, or one per colour component (see denoiseCuda3D), null if a run failed
+        public Image3D denoise(FloatBuffer buffPsis, int length, int nit, float beta, Pointer[] ctx, VsnrDllLoader dll)
         {
-            Image3D output = new Image3D(width, height, depth, chan, frame, start, bColor);
+            Image3D output = new Image3D(width, height, depth, chan, frame, start, bColor, bits);
 
             int dim = (bColor ? 3 : 1);
+            int status = 0;
+
+            if (bits == 8)
+                status = dll.VSNR_3D_RUN_CONTEXT_U8(ctx[0], buffPsis, length, ByteBuffer.wrap(arr8), nit, beta, ByteBuffer.wrap(output.arr8), max[0], 1.0f);
+            else if (bits == 16)
+                status = dll.VSNR_3D_RUN_CONTEXT_U16(ctx[0], buffPsis, length, ShortBuffer.wrap(arr16), nit, beta, ShortBuffer.wrap(output.arr16), max[0], 1.0f);
+            else {
+                for (int i = 0 ; i < dim ; i++)
+                    status |= dll.VSNR_3D_RUN_CONTEXT(ctx[Math.min(i, ctx.length-1)], buffPsis, length, getBuffer(i), nit, beta, output.getBuffer(i), max[i]);
+            }
 
-            for (int i = 0 ; i < dim ; i++)
-                dll.VSNR_3D_FIJI_GPU(buffPsis, length, getBuffer(i), height, width, depth, nit, beta, output.getBuffer(i), nBlock, max[i], dx, dy, dz);
-
-            return output;
+            return (status == 0 ? output : null);
         }
 
         public FloatBuffer getBuffer(int k)
@@ -641,8 +792,18 @@ public class VSNR_3D implements PlugInFilter {
         {
             ImageProcessor ip;
             float tmp;
+            int plane = width*height;
 
-            if (bColor) {
+            if (bits != 32) {
+
+                // rounded and clamped by the library
+                for (int k = dLeft ; k < depth-dRight ; k++) {
+                    ip = getIP(result,k);
+                    if (bits == 8) System.arraycopy(arr8,  k*plane, (byte[])ip.getPixels(),  0, plane);
+                    else           System.arraycopy(arr16, k*plane, (short[])ip.getPixels(), 0, plane);
+                }
+
+            } else if (bColor) {
 
                 int[] pixel = new int[3];
                 for (int k = dLeft ; k < depth-dRight ; k++) {
@@ -729,11 +890,47 @@ public class VSNR_3D implements PlugInFilter {
 
     }
 
+    // progress of a run, see VSNR_3D_SET_CONTEXT_PROGRESS
+    public interface VsnrProgress extends Callback {
+        void invoke(int iteration, int nit, float primal, float dual, Pointer user);
+    }
+
     // dll interface
     private interface VsnrDllLoader extends Library {
 
         // CUDA denoise function
-        public void VSNR_3D_FIJI_GPU(FloatBuffer psis, int length, FloatBuffer u0, int n0, int n1, int n2, int nit, float beta, FloatBuffer u, int nBlock, float max, float dx, float dy, float dz);
+        public int VSNR_3D_FIJI_GPU(FloatBuffer psis, int length, FloatBuffer u0, int n0, int n1, int n2, int nit, float beta, FloatBuffer u, int nBlock, float max, float dx, float dy, float dz);
+
+        // persistent context (plans, buffers, operators) for one volume geometry
+        public Pointer VSNR_3D_CREATE_CONTEXT(int n0, int n1, int n2, float dx, float dy, float dz, int nBlock);
+
+        // same as VSNR_3D_FIJI_GPU on a volume of the context geometry (returns -1 if the run failed)
+        public int VSNR_3D_RUN_CONTEXT(Pointer ctx, FloatBuffer psis, int length, FloatBuffer u0, int nit, float beta, FloatBuffer u, float max);
+
+        // same on unsigned 8 / 16 bits samples (the pixels of ImageJ) : u0+offset is denoised, u = result-offset rounded to the nearest and clamped to the type range
+        public int VSNR_3D_RUN_CONTEXT_U8(Pointer ctx, FloatBuffer psis, int length, ByteBuffer u0, int nit, float beta, ByteBuffer u, float max, float offset);
+        public int VSNR_3D_RUN_CONTEXT_U16(Pointer ctx, FloatBuffer psis, int length, ShortBuffer u0, int nit, float beta, ShortBuffer u, float max, float offset);
+
+        // stop when the relative primal and dual residuals are below tol, checked every "every" iterations (tol = 0 : nit iterations)
+        public void VSNR_3D_SET_CONTEXT_TOLERANCE(Pointer ctx, float tol, int every);
+
+        // iterations and residuals of the last run
+        public void VSNR_3D_GET_CONTEXT_STATS(Pointer ctx, int[] iterations, float[] primal, float[] dual);
+
+        // progress.invoke every "every" iterations of the next runs (null : none)
+        public void VSNR_3D_SET_CONTEXT_PROGRESS(Pointer ctx, VsnrProgress progress, int every, Pointer user);
+
+        // FFT, kernel, allocation and transfer counts and times of the context (null : last destroyed context) as JSON
+        public int VSNR_3D_GET_CONTEXT_PROFILE_JSON(Pointer ctx, byte[] json, int size);
+
+        // 0 : plain ADMM, 1 : over-relaxation by alpha, 2 : fast ADMM with restart, 3 : adaptive beta (returns -1 if out of memory)
+        public int VSNR_3D_SET_CONTEXT_ACCELERATION(Pointer ctx, int accel, float alpha);
+
+        // 1 : the next runs start from the state of the previous run, 0 : from 0
+        public void VSNR_3D_SET_CONTEXT_WARM_START(Pointer ctx, int warm);
+
+        // -
+        public void VSNR_3D_DESTROY_CONTEXT(Pointer ctx);
 
         // return dimBlocks max
         public int getMaxBlocks();
@@ -741,6 +938,33 @@ public class VSNR_3D implements PlugInFilter {
         // return dimGrid max
         public int getMaxGrid();
 
+        // 0 : GPU, 1 : CPU, -1 : auto
+        public void setBackend(int backend);
+
+        // backend used by VSNR_3D_FIJI_GPU
+        public int getBackend();
+
+        // 0 : FFT (3+3 FFTs per iteration), 1 : stencil (1+1 FFTs per iteration), 2 : stencil, low memory
+        public void setSolver(int solver);
+
+        // solver of the contexts created afterwards
+        public int getSolver();
+
+        // bytes needed by a context of this geometry and solver
+        public long VSNR_3D_PEAK_MEMORY(int n0, int n1, int n2, int solver);
+
+        // 0 : float, 1 : half, 2 : bfloat16 storage of y, lambda and Du0 in the GPU contexts created afterwards
+        public void setPrecision(int precision);
+
+        // precision of the contexts created afterwards
+        public int getPrecision();
+
+        // 0 : none, 1 : mirror, 2 : periodic extension of each axis to the next 7-smooth size in the contexts created afterwards
+        public void setPadding(int padding);
+
+        // padding of the contexts created afterwards
+        public int getPadding();
+
     }
 
 }
@@ -21,484 +21,221 @@
 
 #include <math.h>
 #include <stdio.h>
-#include "cuda.h"
-#include "cuda_runtime.h"
-#include "cufft.h"
-#include <cuda_runtime.h>
-#include <cublas_v2.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <atomic>
+#include <condition_variable>
+#include "vsnr_engine.cuh"
+#include "vsnr3d.h"
 
-#define PI (3.141592653589793)
-
-#define SQ(a) ((a)*(a))
 #define CB(a) ((a)*(a)*(a))
-#define MAX(a, b) ((a) > (b) ? (a) : (b))
-#define MIN(a, b) ((a) < (b) ? (a) : (b))
 
-typedef cufftComplex CuC; // struct { float x, y }
-typedef cufftReal    CuR; // float
+// vsnr3d_cpu.cpp
+void* VSNR_3D_CPU_CREATE_CONTEXT(int n0, int n1, int n2, float dx, float dy, float dz, int solver);
+void  VSNR_3D_CPU_RUN_CONTEXT(void* ctx, float* psis, int length, const void* u0, int in, int nit, float beta, void* u, int out, float max, float offset);
+void  VSNR_3D_CPU_SET_CONTEXT_RMS(void* ctx, float rms);
+void  VSNR_3D_CPU_SET_CONTEXT_TOLERANCE(void* ctx, float tol, int every);
+void  VSNR_3D_CPU_SET_CONTEXT_WARM_START(void* ctx, int warm);
+void  VSNR_3D_CPU_GET_CONTEXT_STATS(void* ctx, int* iterations, float* primal, float* dual);
+int   VSNR_3D_CPU_SET_CONTEXT_ACCELERATION(void* ctx, int accel, float alpha);
+void  VSNR_3D_CPU_SET_CONTEXT_PADDING(void* ctx, int pad, int v0, int v1, int v2);
+void  VSNR_3D_CPU_GET_CONTEXT_TIMES(void* ctx, float* times);
+void  VSNR_3D_CPU_GET_CONTEXT_PROFILE(void* ctx, VSNR_PROFILE* profile);
+void  VSNR_3D_CPU_SET_CONTEXT_PROGRESS(void* ctx, VSNR_PROGRESS progress, int every, void* user);
+void  VSNR_3D_CPU_DESTROY_CONTEXT(void* ctx);
 
 
-// DEBUG
 // -------------------------------------------------------------------------
 
 
-// Disp lastCudaError in file
-void __dispLastCudaError(FILE* file, const char* string)
-{
-    // -
-    fprintf(file,"~ %s: %s\n", string, cudaGetErrorString(cudaGetLastError()));
-}
-
-// Disp a string relative to err from a cufft function in file
-void __dispCufftError(FILE* file, const char* string, int err)
-{
-    switch (err) {
-        case 0 :
-            fprintf(file, "# %s: CUFFT_SUCCESS\n", string);
-            break;
-        case 1 :
-            fprintf(file, "# %s: CUFFT_INVALID_PLAN\n", string);
-            break;
-        case 2 :
-            fprintf(file, "# %s: CUFFT_ALLOC_FAILED\n", string);
-            break;
-        case 3 :
-            fprintf(file, "# %s: CUFFT_INVALID_TYPE\n", string);
-            break;
-        case 4 :
-            fprintf(file, "# %s: CUFFT_INVALID_VALUE\n", string);
-            break;
-        case 5 :
-            fprintf(file, "# %s: CUFFT_INTERNAL_ERROR\n", string);
-            break;
-        case 6 :
-            fprintf(file, "# %s: CUFFT_EXEC_FAILED\n", string);
-            break;
-        case 7 :
-            fprintf(file, "# %s: CUFFT_SETUP_FAILED\n", string);
-            break;
-        case 8 :
-            fprintf(file, "# %s: CUFFT_INVALID_SIZE\n", string);
-            break;
-        case 9 :
-            fprintf(file, "# %s: CUFFT_UNALIGNED_DATA\n", string);
-            break;
-        case 10 :
-            fprintf(file, "# %s: CUFFT_INCOMPLETE_PARAMETER_LIST\n", string);
-            break;
-        case 11 :
-            fprintf(file, "# %s: CUFFT_INVALID_DEVICE\n", string);
-            break;
-        case 12 :
-            fprintf(file, "# %s: CUFFT_PARSE_ERROR\n", string);
-            break;
-        case 13 :
-            fprintf(file, "# %s: CUFFT_NO_WORKSPACE\n", string);
-            break;
-        case 14 :
-            fprintf(file, "# %s: CUFFT_NOT_IMPLEMENTED\n", string);
-            break;
-        case 15 :
-            fprintf(file, "# %s: CUFFT_LICENSE_ERROR\n", string);
-            break;
-        case 16 :
-            fprintf(file, "# %s: CUFFT_NOT_SUPPORTED\n", string);
-            break;
-        default :
-            fprintf(file, "# %s: UNKNOWN_ERROR\n", string);
-    }
-}
+// Persistent solver state for one geometry (n0, n1, n2, dx, dy, dz)
+// Plans and work buffers are allocated once by VSNR_3D_CREATE_CONTEXT and
+// reused by every VSNR_3D_RUN_CONTEXT. The ADMM state and settings are
+// in VSNR_ENGINE (grid : n0, n1, n2 and dx, dy, dz), run by VSNR_ADMM.
+struct VSNR_CONTEXT : VSNR_ENGINE<3> {
+    int backend;
+    void* cpu;  // vsnr3d_cpu.cpp context when backend == VSNR_BACKEND_CPU
 
+    int n0, n1, n2;
+    float dx, dy, dz;
 
-// -------------------------------------------------------------------------
+    int pad;         // VSNR_PAD_*, see setPadding
+    int v0, v1, v2;  // volume of u0 and u, n0, n1, n2 is the padded grid (same if pad == VSNR_PAD_NONE)
+    int v;
 
+    cublasHandle_t handle;
+    cudaStream_t copies; // uploads of u0 and downloads of u, overlapping the solve of another run
 
-// Computes out = u1.*u2
-__global__ void product_carray(CuC* u1, CuC* u2, CuC* out, int n)
-{
-    int i    = blockIdx.x * blockDim.x + threadIdx.x;
-    int step = blockDim.x * gridDim.x;
-
-    for ( ; i < n ; i += step) {
-        out[i].x = (u1[i].x * u2[i].x) - (u1[i].y * u2[i].y);
-        out[i].y = (u1[i].y * u2[i].x) + (u1[i].x * u2[i].y);
-    }
-}
+    void* arena;     // one allocation holding the buffers (but yp, lp), the FFT plans share the work area at its end, see carve
 
-// Normalize an array
-__global__ void normalize(CuR* u, int n)
-{
-    int i    = blockIdx.x * blockDim.x + threadIdx.x;
-    int step = blockDim.x * gridDim.x;
+    void *vin, *vout; // device, u0 and u in their sample type (float at most), see VSNR_3D_UPLOAD_CONTEXT
+    CuR *gu0;         // real, u0 padded and scaled by load_volume
 
-    for ( ; i < n ; i += step)
-        u[i] = u[i] / (float)n;
-}
+    std::mutex steps;                 // orders the steps of consecutive runs, see wait_step
+    std::condition_variable stepped;
+    long long uploads, solves, stores, downloads; // steps issued so far, a solve reads vin then writes vout
+    cudaEvent_t copyMarks[4];         // start and end of the last upload and download, on copies
+    float copyMs[2];                  // ms of the last upload and download, the download is added to times by VSNR_3D_GET_CONTEXT_TIMES
+    long long copyCount, copyBytes;   // uploads and downloads, added to the profile
+    double copyTime;
+    const void* hin;  // u0 of the last upload (CPU backend)
+    void* hout;       // host, u of the last solve (CPU backend, allocated by its first solve)
 
-// u = u*val;
-__global__ void multiply(CuR* u, int n, float val)
-{
-    int i    = blockIdx.x * blockDim.x + threadIdx.x;
-    int step = blockDim.x * gridDim.x;
+    float* bank;     // filter list fbank was built for (host copy), NULL if none
+    int bankLength;
+    float* fbank;    // real m-sized spectrum, sum_i eta_i |PSI_i|^2 / mmax_i, see CREATE_BANK
+    float rms;       // rms of u0 used to scale the filters (0 : ||u0|| of each run), see VSNR_3D_SET_CONTEXT_RMS
 
-    for ( ; i < n ; i += step)
-        u[i] = u[i] * val;
-}
+    float times[VSNR_STAGE_COUNT]; // ms per stage of the last solve (and its upload), guarded by steps
+};
 
-// u = u/val;
-__global__ void divide(CuR* u, int n, float val)
+// Waits until *count (a step counter of the context, see VSNR_3D_UPLOAD_CONTEXT) reaches target
+void wait_step(VSNR_CONTEXT* ctx, long long* count, long long target)
 {
-    int i    = blockIdx.x * blockDim.x + threadIdx.x;
-    int step = blockDim.x * gridDim.x;
-
-    for ( ; i < n ; i += step)
-        u[i] = u[i] / val;
+    std::unique_lock<std::mutex> guard(ctx->steps);
+    ctx->stepped.wait(guard, [&]{ return *count >= target; });
 }
 
-// adds two vectors w = u + v
-__global__ void add(CuR* u, CuR* v, CuR* w, int n)
+// Counts a step issued, for the steps of the other threads waiting on it
+void end_step(VSNR_CONTEXT* ctx, long long* count)
 {
-    int i    = blockIdx.x * blockDim.x + threadIdx.x;
-    int step = blockDim.x * gridDim.x;
-
-    for ( ; i < n ; i += step)
-        w[i] = u[i] + v[i];
+    std::lock_guard<std::mutex> guard(ctx->steps);
+    (*count)++;
+    ctx->stepped.notify_all();
 }
 
-// substracts two vectors w = u - v
-__global__ void substract(CuR* u, CuR* v, CuR* w, int n)
+// Times and counts the copy k (0 upload, 1 download) that just ended on the copy stream
+void count_copy(VSNR_CONTEXT* ctx, int k, size_t bytes)
 {
-    int i    = blockIdx.x * blockDim.x + threadIdx.x;
-    int step = blockDim.x * gridDim.x;
+    float t;
+
+    cudaEventSynchronize(ctx->copyMarks[2*k+1]);
+    cudaEventElapsedTime(&t, ctx->copyMarks[2*k], ctx->copyMarks[2*k+1]);
 
-    for ( ; i < n ; i += step)
-        w[i] = u[i] - v[i];
+    std::lock_guard<std::mutex> guard(ctx->steps);
+    ctx->copyMs[k] = t;
+    ctx->copyCount++;
+    ctx->copyBytes += bytes;
+    ctx->copyTime  += t;
 }
 
-// Sets finite difference 1
-__global__ void setd1(CuR* d1, int n, int n0, int n1, float dx)
+// Returns 0 if the CUDA calls of a step went through, -1 after printing the error (which clears it) otherwise
+int step_status(const char* step)
 {
-    int i     = blockIdx.x * blockDim.x + threadIdx.x ;
-    int step  = blockDim.x * gridDim.x;
-    int id[2] = {0, n1-1};
+    if (cudaPeekAtLastError() == cudaSuccess) return 0;
 
-    for ( ; i < n ; i += step) {
-        if      (i == id[0]) d1[i] =  1.0 / dx;
-        else if (i == id[1]) d1[i] = -1.0 / dx;
-        else                 d1[i] =  0.0;
-    }
+    __dispLastCudaError(stderr, step);
+    return -1;
 }
 
-// Sets finite difference 2
-__global__ void setd2(CuR* d2, int n, int n0, int n1, float dy)
+// Adds bytes (or removes them if negative) to the memory held by the context
+void account(VSNR_CONTEXT* ctx, long long bytes)
 {
-    int i     = blockIdx.x * blockDim.x + threadIdx.x ;
-    int step  = blockDim.x * gridDim.x;
-    int id[2] = {0, n1*(n0-1)};
-
-    for ( ; i < n ; i += step) {
-        if      (i == id[0]) d2[i] =  1.0 / dy;
-        else if (i == id[1]) d2[i] = -1.0 / dy;
-        else                 d2[i] =  0.0;
-    }
+    ctx->prof.bytes += bytes;
+    ctx->prof.peakBytes = MAX(ctx->prof.peakBytes, ctx->prof.bytes);
 }
 
-// Sets finite difference 3
-__global__ void setd3(CuR* d3, int n, int n0, int n1, float dz)
+// Milliseconds elapsed since t0 on the host
+double elapsed(std::chrono::steady_clock::time_point t0)
 {
-    int i     = blockIdx.x * blockDim.x + threadIdx.x ;
-    int step  = blockDim.x * gridDim.x;
-    int id[2] = {0, n-(n1*n0)};
-
-    for ( ; i < n ; i += step) {
-        if      (i == id[0]) d3[i] =  1.0 / dz;
-        else if (i == id[1]) d3[i] = -1.0 / dz;
-        else                 d3[i] =  0.0;
-    }
+    // -
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
 }
 
-// Compute Phi
-__global__ void compute_phi(CuC* fphi1, CuC* fphi2, CuC* fphi3, CuC* fphi, float beta, int n)
+// cudaMalloc, counted and timed, *p is NULL if it fails
+void alloc(VSNR_CONTEXT* ctx, void** p, size_t bytes)
 {
-    int i    = blockIdx.x * blockDim.x + threadIdx.x;
-    int step = blockDim.x * gridDim.x;
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
 
-    for ( ; i < n ; i += step) {
-        fphi[i].x = 1 + beta*(SQ(fphi1[i].x) + SQ(fphi1[i].y) + SQ(fphi2[i].x) + SQ(fphi2[i].y) + SQ(fphi3[i].x) + SQ(fphi3[i].y));
-        fphi[i].y = 0.0;
-    }
+    if (cudaMalloc(p, bytes) == cudaSuccess) account(ctx, bytes);
+    else *p = NULL;
+    ctx->prof.allocMs += elapsed(t0);
+    ctx->prof.allocs++;
 }
 
-// Computes tmpi = -lambdai + beta * yi
-__global__ void betay_m_lambda(CuR* l1, CuR* l2, CuR* l3, CuR* y1, CuR* y2, CuR* y3, CuR* tmp1, CuR* tmp2, CuR* tmp3, float beta, int n)
+// Fills times (VSNR_STAGE_*) from the marks of the solve that just ended, timed is the time of the FFTs
+// and transfers of the profile before the solve and up the ms of its upload. The download of the run may
+// end before or after, it only sets copyMs[1].
+void stage_times(VSNR_CONTEXT* ctx, double timed, float up)
 {
-    int i    = blockIdx.x * blockDim.x + threadIdx.x;
-    int step = blockDim.x * gridDim.x;
+    float t[VSNR_MARK_COUNT-1];
+    double total = 0;
 
-    for ( ; i < n ; i += step) {
-        tmp1[i] = (beta * y1[i]) - l1[i];
-        tmp2[i] = (beta * y2[i]) - l2[i];
-        tmp3[i] = (beta * y3[i]) - l3[i];
+    cudaEventSynchronize(ctx->marks[VSNR_MARK_COUNT-1]);
+    for (int k = 0 ; k < VSNR_MARK_COUNT-1 ; ++k) {
+        cudaEventElapsedTime(&t[k], ctx->marks[k], ctx->marks[k+1]);
+        total += t[k];
     }
-}
 
-// Computes w = conj(u) * v
-__global__ void conju_x_v(CuC* u, CuC* v, CuC* w, int n)
-{
-    int i    = blockIdx.x * blockDim.x + threadIdx.x;
-    int step = blockDim.x * gridDim.x;
-    float a1, a2, b1, b2;
-
-    for ( ; i < n ; i += step) {
-        a1 = u[i].x;
-        b1 = u[i].y;
-        a2 = v[i].x;
-        b2 = v[i].y;
-        w[i].x = (a1 * a2) + (b1 * b2);
-        w[i].y = (b2 * a1) - (b1 * a2);
+    {
+        std::lock_guard<std::mutex> guard(ctx->steps);
+        ctx->times[VSNR_STAGE_TRANSFER]   = up + t[0];
+        ctx->times[VSNR_STAGE_FILTERS]    = t[1];
+        ctx->times[VSNR_STAGE_SETUP]      = t[2];
+        ctx->times[VSNR_STAGE_ITERATIONS] = t[3];
+        ctx->times[VSNR_STAGE_FINAL]      = t[4];
     }
+
+    harvest(ctx);
+    ctx->prof.kernelMs += total - (ctx->prof.fftMs + ctx->prof.transferMs - timed);
+    ctx->prof.runs++;
 }
 
-// fx = (ftmp1 + ftmp2 + ftmp3) / fphi;
-__global__ void update_fx(CuC* ftmp1, CuC* ftmp2, CuC* ftmp3, CuC* fphi, CuC* fx, int n)
+// Index in [0, v) of the index i of the padded axis, v being the size of the volume on this axis
+__device__ inline int pad_index(int i, int v, int pad)
 {
-    int i    = blockIdx.x * blockDim.x + threadIdx.x;
-    int step = blockDim.x * gridDim.x;
+    if (pad == VSNR_PAD_PERIODIC) return i % v;
 
-    for ( ; i < n ; i += step) {
-        fx[i].x = (ftmp1[i].x + ftmp2[i].x + ftmp3[i].x) / fphi[i].x;
-        fx[i].y = (ftmp1[i].y + ftmp2[i].y + ftmp3[i].y) / fphi[i].x;
-    }
+    i = i % (2*v); // mirror : v-1 is repeated, period 2v
+    return (i < v ? i : 2*v-1-i);
 }
 
-// -
-__global__ void update_y(CuR* d1u0, CuR* d2u0, CuR* d3u0, CuR* tmp1, CuR* tmp2, CuR* tmp3, CuR* l1, CuR* l2, CuR* l3, CuR* y1, CuR* y2, CuR* y3, float beta, int n)
-{
-    int i    = blockIdx.x * blockDim.x + threadIdx.x;
-    int step = blockDim.x * gridDim.x;
-    float ng, t1, t2, t3;
-
-    for ( ; i < n ; i += step) {
-        t1 = d1u0[i] - (tmp1[i] + (l1[i] / beta));
-        t2 = d2u0[i] - (tmp2[i] + (l2[i] / beta));
-        t3 = d3u0[i] - (tmp3[i] + (l3[i] / beta));
-        ng = sqrtf(SQ(t1) + SQ(t2) + SQ(t3));
-
-        if (ng > 1.0 / beta) {
-            y1[i] = d1u0[i] - t1 * (1.0 - (1.0 / (beta * ng)));
-            y2[i] = d2u0[i] - t2 * (1.0 - (1.0 / (beta * ng)));
-            y3[i] = d3u0[i] - t3 * (1.0 - (1.0 / (beta * ng)));
-        } else {
-            y1[i] = d1u0[i];
-            y2[i] = d2u0[i];
-            y3[i] = d3u0[i];
-        }
-    }
-}
+// Sample of an output volume, integers rounded to the nearest and clamped to their range
+__device__ inline void store_sample(float* u, int c, float v)          { u[c] = v; }
+__device__ inline void store_sample(unsigned char* u, int c, float v)  { u[c] = (unsigned char)fminf(fmaxf(rintf(v), 0.0f), 255.0f); }
+__device__ inline void store_sample(unsigned short* u, int c, float v) { u[c] = (unsigned short)fminf(fmaxf(rintf(v), 0.0f), 65535.0f); }
 
-// -
-__global__ void update_lambda(CuR* lambda, CuR* tmp, CuR* y, float beta, int n)
+// up = (u + offset)/max, the v0 x v1 x v2 volume u being extended to the n0 x n1 x n2 grid of up (VSNR_PAD_MIRROR
+// or VSNR_PAD_PERIODIC, the same grid with VSNR_PAD_NONE)
+template<typename T>
+__global__ void pad_volume(const T* u, int v0, int v1, int v2, CuR* up, int n0, int n1, int n2, int pad, float max, float offset)
 {
-    int i    = blockIdx.x * blockDim.x + threadIdx.x ;
+    int n = n0*n1*n2;
+    int c = blockIdx.x * blockDim.x + threadIdx.x;
     int step = blockDim.x * gridDim.x;
+    int i, j, k;
 
-    for ( ; i < n ; i += step)
-        lambda[i] = lambda[i] + (beta * (tmp[i] - y[i]));
+    for ( ; c < n ; c += step) {
+        if (pad == VSNR_PAD_NONE) {
+            up[c] = ((float)u[c] + offset) / max;
+            continue;
+        }
+        j = c % n1;
+        i = (c / n1) % n0;
+        k = c / (n0*n1);
+        up[c] = ((float)u[(pad_index(k, v2, pad)*v0 + pad_index(i, v0, pad))*v1 + pad_index(j, v1, pad)] + offset) / max;
+    }
 }
 
-// Main function
-void VSNR_ADMM_GPU(float *u0, float *psi, int n0, int n1, int n2, int nit, float beta, float *u, int dimGrid, int dimBlock, float dx, float dy, float dz)
+// u = (u0 - w/n)*max - offset on the v0 x v1 x v2 corner of the n0 x n1 x n2 grids u0 and w, i.e. the last
+// step of the ADMM (w = n (psi * x)) fused with the crop and the conversion to T
+template<typename T>
+__global__ void crop_volume(const CuR* u0, const CuR* w, int n0, int n1, int n2, T* u, int v0, int v1, int v2, float max, float offset)
 {
-    cufftHandle planR2C, planC2R;
-
-    CuC *fpsi, *fu0, *fphi, *fx; // complex
-
-    CuC *fphi1, *fphi2, *fphi3; // complex
-    CuC *ftmp1, *ftmp2, *ftmp3; // complex
-    CuR  *tmp1,  *tmp2,  *tmp3; // real
-    CuR  *d1u0,  *d2u0,  *d3u0; // real
-    CuC   *fd1,   *fd2,   *fd3; // complex
-    CuR    *d1,    *d2,    *d3; // real
-    CuR    *y1,    *y2,    *y3; // real
-    CuR    *l1,    *l2,    *l3; // real
-
     int n = n0*n1*n2;
-    int m = n0*n2*(n1/2+1);
-
-    cudaMalloc((void**)&fpsi, m*sizeof(CuC));
-    cudaMalloc((void**)&fu0,  m*sizeof(CuC));
-
-    cudaMalloc((void**)&d1u0, n*sizeof(CuR));
-    cudaMalloc((void**)&d2u0, n*sizeof(CuR));
-    cudaMalloc((void**)&d3u0, n*sizeof(CuR));
-
-    cudaMalloc((void**)&tmp1, n*sizeof(CuR));
-    cudaMalloc((void**)&tmp2, n*sizeof(CuR));
-    cudaMalloc((void**)&tmp3, n*sizeof(CuR));
-
-    cudaMalloc((void**)&ftmp1, m*sizeof(CuC));
-    cudaMalloc((void**)&ftmp2, m*sizeof(CuC));
-    cudaMalloc((void**)&ftmp3, m*sizeof(CuC));
-
-    cufftPlan3d(&planR2C, n2, n0, n1, CUFFT_R2C);
-    cufftPlan3d(&planC2R, n2, n0, n1, CUFFT_C2R);
-
-    cufftExecR2C(planR2C,  u0,  fu0); // fu0  = fftn(u0);
-    cufftExecR2C(planR2C, psi, fpsi); // fpsi = fftn(psi);
-
-    // Computes d1u0 & fphi1
-    cudaMalloc((void**)&d1,    n*sizeof(CuR));
-    cudaMalloc((void**)&fd1,   m*sizeof(CuC));
-    cudaMalloc((void**)&fphi1, m*sizeof(CuC));
-
-    setd1<<<dimGrid,dimBlock>>>(d1, n, n0, n1, dx); // d1[0] = 1; d1[n1-1] = -1;
-    cufftExecR2C(planR2C, d1, fd1); // fd1 = fft(d1);
-    cudaFree(d1);
-
-    product_carray<<<dimGrid,dimBlock>>>(fd1, fu0, ftmp1, m);
-    cufftExecC2R(planC2R, ftmp1, d1u0); // d1u0 = ifftn(fd1.*fu0);
-    normalize<<<dimGrid,dimBlock>>>(d1u0, n);
-
-    product_carray<<<dimGrid,dimBlock>>>(fd1, fpsi, fphi1, m); // fphi1 = fpsi.*fd1;
-    cudaFree(fd1);
-
-    // Computes d2u0 & fphi2
-    cudaMalloc((void**)&d2,    n*sizeof(CuR));
-    cudaMalloc((void**)&fd2,   m*sizeof(CuC));
-    cudaMalloc((void**)&fphi2, m*sizeof(CuC));
-
-    setd2<<<dimGrid,dimBlock>>>(d2, n, n0, n1, dy); // d2[0] = 1; d2[n0n1-n1] = -1;
-    cufftExecR2C(planR2C, d2, fd2); // fd2 = fft(d2);
-    cudaFree(d2);
-
-    product_carray<<<dimGrid,dimBlock>>>(fd2, fu0, ftmp2, m);
-    cufftExecC2R(planC2R, ftmp2, d2u0); // d2u0 = ifftn(fd2.*fu0);
-    normalize<<<dimGrid,dimBlock>>>(d2u0, n);
-
-
-    product_carray<<<dimGrid,dimBlock>>>(fd2, fpsi, fphi2, m); // fphi2 = fpsi.*fd2;
-    cudaFree(fd2);
-
-    // Computes d3u0 & fphi3
-    cudaMalloc((void**)&d3,    n*sizeof(CuR));
-    cudaMalloc((void**)&fd3,   m*sizeof(CuC));
-    cudaMalloc((void**)&fphi3, m*sizeof(CuC));
-
-    setd3<<<dimGrid,dimBlock>>>(d3, n, n0, n1, dz); // d3[0] = 1; d3[n-n0n1] = -1;
-    cufftExecR2C(planR2C, d3, fd3); // fd3 = fft(d3);
-    cudaFree(d3);
-
-    product_carray<<<dimGrid,dimBlock>>>(fd3, fu0, ftmp3, m);
-    cufftExecC2R(planC2R, ftmp3, d3u0); // d3u0 = ifftn(fd3.*fu0);
-    normalize<<<dimGrid,dimBlock>>>(d3u0, n);
-
-    product_carray<<<dimGrid,dimBlock>>>(fd3, fpsi, fphi3, m); // fphi3 = fpsi.*fd3;
-    cudaFree(fd3);
-
-    // unused till end
-    cudaFree(fu0);
-
-    // Computes fphi
-    cudaMalloc((void**)&fphi, m*sizeof(CuC));
-    compute_phi<<<dimGrid,dimBlock>>>(fphi1, fphi2, fphi3, fphi, beta, m);
-
-    // Initialization
-    cudaMalloc((void**)&y1, n*sizeof(CuR));
-    cudaMalloc((void**)&y2, n*sizeof(CuR));
-    cudaMalloc((void**)&y3, n*sizeof(CuR));
-
-    cudaMalloc((void**)&l1, n*sizeof(CuR));
-    cudaMalloc((void**)&l2, n*sizeof(CuR));
-    cudaMalloc((void**)&l3, n*sizeof(CuR));
-
-    cudaMalloc((void**)&fx, m*sizeof(CuC));
-
-    cudaMemset(y1, 0, n*sizeof(CuR));
-    cudaMemset(y2, 0, n*sizeof(CuR));
-    cudaMemset(y3, 0, n*sizeof(CuR));
-
-    cudaMemset(l1, 0, n*sizeof(CuR));
-    cudaMemset(l2, 0, n*sizeof(CuR));
-    cudaMemset(l3, 0, n*sizeof(CuR));
-
-    // Main algorithm
-    for (int k = 0 ; k < nit ; ++k) {
-
-        // -------------------------------------------------------------
-        // First step, x update : (I+beta ATA)x = AT (-lambda+beta*ATy)
-        // -------------------------------------------------------------
-        // ftmp1 = conj(fphi1).*(fftn(-lambda1+beta*y1));
-        // ftmp2 = conj(fphi2).*(fftn(-lambda2+beta*y2));
-        // ftmp3 = conj(fphi3).*(fftn(-lambda3+beta*y3));
-        betay_m_lambda<<<dimGrid,dimBlock>>>(l1, l2, l3, y1, y2, y3, tmp1, tmp2, tmp3, beta, n);
-        cufftExecR2C(planR2C, tmp1, ftmp1);
-        cufftExecR2C(planR2C, tmp2, ftmp2);
-        cufftExecR2C(planR2C, tmp3, ftmp3);
-        conju_x_v<<<dimGrid,dimBlock>>>(fphi1, ftmp1, ftmp1, m);
-        conju_x_v<<<dimGrid,dimBlock>>>(fphi2, ftmp2, ftmp2, m);
-        conju_x_v<<<dimGrid,dimBlock>>>(fphi3, ftmp3, ftmp3, m);
-        update_fx<<<dimGrid,dimBlock>>>(ftmp1, ftmp2, ftmp3, fphi, fx, m);
-
-        // --------------------------------------------------------
-        // Second step y update : y = prox_{f1/beta}(Ax+lambda/beta)
-        // --------------------------------------------------------
-        product_carray<<<dimGrid,dimBlock>>>(fphi1, fx, ftmp1, m);
-        product_carray<<<dimGrid,dimBlock>>>(fphi2, fx, ftmp2, m);
-        product_carray<<<dimGrid,dimBlock>>>(fphi3, fx, ftmp3, m);
-        cufftExecC2R(planC2R, ftmp1, tmp1); // tmp1 = Ax1
-        cufftExecC2R(planC2R, ftmp2, tmp2); // tmp2 = Ax2
-        cufftExecC2R(planC2R, ftmp3, tmp3); // tmp2 = Ax2
-        normalize<<<dimGrid,dimBlock>>>(tmp1, n);
-        normalize<<<dimGrid,dimBlock>>>(tmp2, n);
-        normalize<<<dimGrid,dimBlock>>>(tmp3, n);
-        update_y<<<dimGrid,dimBlock>>>(d1u0, d2u0, d3u0, tmp1, tmp2, tmp3, l1, l2, l3, y1, y2, y3, beta, n);
-
-        // --------------------------
-        // Third step lambda update
-        // --------------------------
-        update_lambda<<<dimGrid,dimBlock>>>(l1, tmp1, y1, beta, n);
-        update_lambda<<<dimGrid,dimBlock>>>(l2, tmp2, y2, beta, n);
-        update_lambda<<<dimGrid,dimBlock>>>(l3, tmp3, y3, beta, n);
-
-    }
-
-    // Last but not the least : u = u0 - (psi * x)
-    product_carray<<<dimGrid,dimBlock>>>(fx, fpsi, ftmp1, m);
-    cufftExecC2R(planC2R, ftmp1, u);
-    normalize<<<dimGrid,dimBlock>>>(u, n);
-    substract<<<dimGrid,dimBlock>>>(u0, u, u, n);
-
-    // Free memory
-    cudaFree(fpsi);
-    cudaFree(fphi);
-    cudaFree(fx);
-
-    cudaFree(fphi1);
-    cudaFree(fphi2);
-    cudaFree(fphi3);
-
-    cudaFree(ftmp1);
-    cudaFree(ftmp2);
-    cudaFree(ftmp3);
-
-    cudaFree(d1u0);
-    cudaFree(d2u0);
-    cudaFree(d3u0);
-
-    cudaFree(y1);
-    cudaFree(y2);
-    cudaFree(y3);
-
-    cudaFree(l1);
-    cudaFree(l2);
-    cudaFree(l3);
-
-    cudaFree(tmp1);
-    cudaFree(tmp2);
-    cudaFree(tmp3);
-
-    cufftDestroy(planR2C);
-    cufftDestroy(planC2R);
+    int v = v0*v1*v2;
+    int c = blockIdx.x * blockDim.x + threadIdx.x;
+    int step = blockDim.x * gridDim.x;
+    int i, j, k, p;
+
+    for ( ; c < v ; c += step) {
+        j = c % v1;
+        i = (c / v1) % v0;
+        k = c / (v0*v1);
+        p = (k*n0 + i)*n1 + j;
+        store_sample(u, c, (u0[p] - w[p] / (float)n) * max - offset);
+    }
 }
 
 // Sets Gabor
@@ -555,242 +292,963 @@ __global__ void create_gabor(CuR* psi, int n0, int n1, int n2, float level, floa
     }
 }
 
-// Sets dirac
-__global__ void create_dirac(CuR* psi, float val, int n)
+// Sets fsum = sqrtf(val * fbank)
+__global__ void compute_sqrtf(float* fbank, float* fsum, float val, int m)
 {
     int i    = blockIdx.x * blockDim.x + threadIdx.x;
     int step = blockDim.x * gridDim.x;
 
-    for ( ; i < n ; i += step) {
-        if (i == 0) psi[i] = val;
-        else        psi[i] = 0.0;
-    }
+    for ( ; i < m ; i += step)
+        fsum[i] = sqrtf(val * fbank[i]);
 }
 
-// Sets Psi = |Psi|^2
-__global__ void compute_squared_norm(CuC* fpsi, int m)
+// Gabor of create_gabor (level 1, phase and lambda 0), p = sigmaX, sigmaY, sigmaZ, thetaX, thetaY, thetaZ
+VSNR_GABOR gabor(VSNR_CONTEXT* ctx, float* p)
 {
-    int i    = blockIdx.x * blockDim.x + threadIdx.x;
-    int step = blockDim.x * gridDim.x;
+    VSNR_GABOR gb;
+
+    float cx = cosf(p[3] * PI / 180.0), sx = sinf(p[3] * PI / 180.0);
+    float cy = cosf(p[4] * PI / 180.0), sy = sinf(p[4] * PI / 180.0);
+    float cz = cosf(p[5] * PI / 180.0), sz = sinf(p[5] * PI / 180.0);
+
+    float R[9] = {cy*cz,                 -(sz*cy),              sy,
+                  (sy*sx*cz)+(sz*cx),    (cx*cz)-(sz*sy*sx),    -(sx*cy),
+                  (sz*sx)-(sy*cx*cz),    (sx*cz)+(sy*sz*cx),    cy*cx};
 
-    for ( ; i < m ; i += step) {
-        fpsi[i].x = SQ(fpsi[i].x) + SQ(fpsi[i].y);
-        fpsi[i].y = 0.0;
+    for (int k = 0 ; k < 9 ; ++k)
+        gb.R[k] = R[k];
+    for (int k = 0 ; k < 3 ; ++k) {
+        gb.sigma[k] = p[k];
+        gb.frac[k]  = 0; // n/2 + 1
     }
+    gb.amp = sqrtf(p[0]*p[1]*p[2]) / PI;
+    gb.r   = gabor_aliases<3>(gb, ctx->grid);
+    return gb;
 }
 
-// Sets Psi = sqrtf(|Psi|^2)
-__global__ void compute_norm(CuC* fpsi, int m)
+// Builds fbank = sum_i eta_i |PSI_i|^2 / mmax_i from a Java list of filters
+// alpha_i (defined in the paper) only depends on u0 through ||u0||, so fbank
+// is kept in the context and CREATE_FILTERS rescales it for each stack.
+// |PSI_i|^2 is set in closed form, only the Gabor filters too wide for the grid
+// are sampled and transformed. fpsi (set afterwards by CREATE_FILTERS) and the
+// work buffers of the ADMM (not yet in use) hold the intermediate spectra, and
+// mmax_i stays on the device : the whole bank is queued without a host sync.
+void CREATE_BANK(VSNR_CONTEXT* ctx, float* psis, int length)
 {
-    int i    = blockIdx.x * blockDim.x + threadIdx.x;
-    int step = blockDim.x * gridDim.x;
+    int i = 0;
+    int m = ctx->m;
+    int dimBlock = ctx->dimBlock;
+
+    float eta;
+    VSNR_GABOR gb;
+
+    float *psitemp  = ctx->tmp.c[0];
+    float *mmax     = ctx->fphi; // device, 1 float
+    float *fpsitemp = ctx->fpsi;
+    CuC *fgabor     = ctx->ftmp.c[0];
+
+    cudaMemsetAsync(ctx->fbank, 0, m*sizeof(float), ctx->stream);
+
+    while (i < length) {
+
+        if (psis[i] == 0.0) {
+            create_dirac_spectrum<<<launch(ctx),dimBlock,0,ctx->stream>>>(fpsitemp, 1, m); // fpsitemp = |fftn(dirac)|^2;
+            eta = psis[i+1];
+            i += 2;
+        } else if (psis[i] == 1.0) {
+            // 1 : amplitude, 
+            // 2 : sigmaX, 3 : sigmaY, 4 : sigmaZ,
+            // 5 : thetaX, 6 : thetaY, 7 : thetaZ,
+            gb = gabor(ctx, &psis[i+2]);
+            if (gb.r >= 0) {
+                create_gabor_spectrum<3><<<launch(ctx),dimBlock,0,ctx->stream>>>(fpsitemp, gb, ctx->grid); // fpsitemp = |fftn(gabor)|^2;
+            } else {
+                create_gabor<<<launch(ctx),dimBlock,0,ctx->stream>>>(psitemp, ctx->n0, ctx->n1, ctx->n2, 1.0, psis[i+2], psis[i+3], psis[i+4], psis[i+5], psis[i+6], psis[i+7], 0.0, 0.0);
+                fft_r2c(ctx, psitemp, fgabor);
+                compute_squared_norm<<<launch(ctx),dimBlock,0,ctx->stream>>>(fgabor, fpsitemp, m); // fpsitemp = |fgabor|^2;
+            }
+            eta = psis[i+1];
+            i += 8;
+        }
+
+        cudaMemsetAsync(mmax, 0, sizeof(float), ctx->stream);
+        fd_product_max<3><<<launch(ctx),dimBlock,0,ctx->stream>>>(fpsitemp, ctx->grid, mmax); // mmax = max_k |fdk|*|fpsitemp|;
+
+        update_psi<<<launch(ctx),dimBlock,0,ctx->stream>>>(fpsitemp, ctx->fbank, mmax, eta, m); // fbank += |fpsitemp|^2 * eta_i / mmax_i;
 
-    for ( ; i < m ; i += step) {
-        fpsi[i].x = sqrtf(SQ(fpsi[i].x) + SQ(fpsi[i].y));
-        fpsi[i].y = 0.0;
     }
+
+    free(ctx->bank);
+    ctx->bank = (float*)malloc(length*sizeof(float));
+    ctx->bankLength = length;
+    memcpy(ctx->bank, psis, length*sizeof(float));
 }
 
-// Sets fsum = sqrtf(fsum)
-__global__ void compute_sqrtf(CuC* fsum, int m)
+// This function creates the filters from a Java list of filters
+// PSI = sqrtf(sum_i |PSI_i|^2/alpha_i) with alpha_i = sqrt(n) n^2 mmax_i / (||u0|| eta_i), the filter psi is
+// ifftn(PSI) and its spectrum fpsi = fftn(psi) = n PSI is set directly, without the round trip.
+void CREATE_FILTERS(VSNR_CONTEXT* ctx, float* psis, float* gu0, int length, float max)
 {
-    int i    = blockIdx.x * blockDim.x + threadIdx.x;
-    int step = blockDim.x * gridDim.x;
-
-    for ( ; i < m ; i += step) {
-        fsum[i].x = sqrtf(fsum[i].x);
-        fsum[i].y = 0.0;
+    int n = ctx->n;
+    float norm;
+
+    if (!ctx->bank || ctx->bankLength != length || memcmp(ctx->bank, psis, length*sizeof(float)))
+        CREATE_BANK(ctx, psis, length);
+
+    // Computes the l2 norm of u0 on GPU, or takes it from the rms of the whole volume (tiles)
+    if (ctx->rms > 0)
+        norm = ctx->rms / max * sqrtf((float)n);
+    else {
+        cublasSnrm2(ctx->handle, n, gu0, 1, &norm);
+        ctx->prof.kernels++;
     }
+
+    compute_sqrtf<<<launch(ctx),ctx->dimBlock,0,ctx->stream>>>(ctx->fbank, ctx->fpsi, norm / sqrtf((float)n), ctx->m); // fpsi = n sqrtf(sum_i |fpsi_i|^2 / alpha_i);
 }
 
-// Sets ftmp = fpsi * fd
-__global__ void compute_product(CuC* fpsi, CuC* fd, float* ftmp, int m)
+// Backend requested by setBackend, VSNR_BACKEND_AUTO until resolved by getBackend.
+// The settings below are read once by VSNR_3D_CREATE_CONTEXT, the contexts do not depend on them afterwards.
+static std::atomic<int> backend(VSNR_BACKEND_AUTO);
+
+// Selects the backend used by VSNR_3D_FIJI_GPU (VSNR_BACKEND_AUTO to detect it again)
+_export_ void setBackend(int b)
 {
-    int i    = blockIdx.x * blockDim.x + threadIdx.x;
-    int step = blockDim.x * gridDim.x;
+    // -
+    backend = b;
+}
 
-    for ( ; i < m ; i += step) {
-        ftmp[i] = fpsi[i].x * fd[i].x;
+// Returns the backend used by VSNR_3D_FIJI_GPU
+// Auto : the VSNR_BACKEND environment variable ("gpu" or "cpu") if set,
+//        otherwise the GPU when a CUDA device is visible, the CPU otherwise.
+_export_ int getBackend()
+{
+    int b = backend;
+
+    // threads resolving it at the same time find the same value
+    if (b == VSNR_BACKEND_AUTO) {
+        const char* env = getenv("VSNR_BACKEND");
+        int count = 0;
+
+        if (env && strcmp(env, "cpu") == 0)
+            b = VSNR_BACKEND_CPU;
+        else if (env && strcmp(env, "gpu") == 0)
+            b = VSNR_BACKEND_GPU;
+        else if (cudaGetDeviceCount(&count) == cudaSuccess && count > 0)
+            b = VSNR_BACKEND_GPU;
+        else
+            b = VSNR_BACKEND_CPU;
+        backend = b;
     }
+    return b;
 }
 
-// Sets fsum += fpsitemp / alpha
-__global__ void update_psi(CuC* fpsitemp, CuC* fsum, float alpha, int m)
-{
-    int i    = blockIdx.x * blockDim.x + threadIdx.x;
-    int step = blockDim.x * gridDim.x;
+// Solver requested by setSolver
+static std::atomic<int> solver(VSNR_SOLVER_FFT);
 
-    for ( ; i < m ; i += step) {
-        fsum[i].x += fpsitemp[i].x / alpha;
-    }
+// Selects the ADMM formulation of the contexts created afterwards (VSNR_SOLVER_*)
+// All solve the same problem, VSNR_SOLVER_STENCIL does a third of the FFTs and
+// VSNR_SOLVER_LOWMEM also trades a few flops for less than half of the memory.
+_export_ void setSolver(int s)
+{
+    // -
+    solver = s;
 }
 
-// This function creates the filters from a Java list of filters
-void CREATE_FILTERS(float* psis, float* gu0, int length, float* gpsi, int n0, int n1, int n2, int dimGrid, int dimBlock, float dx, float dy, float dz)
+// Returns the solver of the contexts created afterwards
+_export_ int getSolver()
 {
-    int i = 0;
-    int n = n0*n1*n2;
-    int m = n0*n2*(n1/2+1);
+    // -
+    return solver;
+}
 
-    cufftHandle planR2C, planC2R;
-    cublasHandle_t handle;
+// Precision requested by setPrecision
+static std::atomic<int> precision(VSNR_PRECISION_FLOAT);
 
-    float eta, alpha, mmax, norm;
-    float *psitemp, *ftmp;
-    CuC *fpsitemp, *fsum;
-    CuC *fd1, *fd2, *fd3;
-    CuR  *d1,  *d2,  *d3;
-    float max1, max2, max3;
-    int imax;
-
-    cudaMalloc((void**)&psitemp,  n*sizeof(float));
-    cudaMalloc((void**)&ftmp, 	  m*sizeof(float));
-    cudaMalloc((void**)&fpsitemp, m*sizeof(CuC));
-    cudaMalloc((void**)&fsum, 	  m*sizeof(CuC));
-    cudaMalloc((void**)&fd1,	  m*sizeof(CuC));
-    cudaMalloc((void**)&fd2,      m*sizeof(CuC));
-    cudaMalloc((void**)&fd3,	  m*sizeof(CuC));
-    cudaMalloc((void**)&d1,       n*sizeof(CuR));
-    cudaMalloc((void**)&d2,       n*sizeof(CuR));
-    cudaMalloc((void**)&d3,       n*sizeof(CuR));
-
-    cudaMemset(fsum, 0, m*sizeof(CuC));
-
-    cublasCreate(&handle);
-
-    cufftPlan3d(&planR2C, n2, n0, n1, CUFFT_R2C);
-    cufftPlan3d(&planC2R, n2, n0, n1, CUFFT_C2R);
-
-    // Computes the l2 norm of u0 on GPU
-    cublasSnrm2(handle, n, gu0, 1, &norm);
-
-    // Computes d1 and fd1
-    setd1<<<dimGrid,dimBlock>>>(d1, n, n0, n1, dx);
-    cufftExecR2C(planR2C, d1, fd1);
-    compute_norm<<<dimGrid,dimBlock>>>(fd1, m);
-    cudaFree(d1);
-
-    // Computes d2 and fd2
-    setd2<<<dimGrid,dimBlock>>>(d2, n, n0, n1, dy);
-    cufftExecR2C(planR2C, d2, fd2);
-    compute_norm<<<dimGrid,dimBlock>>>(fd2, m);
-    cudaFree(d2);
-
-    // Computes d3 and fd3
-    setd3<<<dimGrid,dimBlock>>>(d3, n, n0, n1, dz);
-    cufftExecR2C(planR2C, d3, fd3);
-    compute_norm<<<dimGrid,dimBlock>>>(fd3, m);
-    cudaFree(d3);
-
-    // Computes PSI = sum_{i=1}^m |PSI_i|^2/alpha_i, where alpha_i is defined in the paper.
-    while (i < length) {
+// Selects the storage of y, lambda and Du0 in the GPU contexts created afterwards (VSNR_PRECISION_*)
+// HALF and BF16 halve the traffic of the pointwise kernels and the memory of these 9 buffers,
+// all the computations and the FFTs stay in float. The CPU backend always uses float.
+_export_ void setPrecision(int p)
+{
+    // -
+    precision = p;
+}
 
-        if (psis[i] == 0.0) {
-            create_dirac<<<dimGrid,dimBlock>>>(psitemp, 1, n);
-            eta = psis[i+1];
-            i += 2;
-        } else if (psis[i] == 1.0) {
-            // 1 : amplitude, 
-            // 2 : sigmaX, 3 : sigmaY, 4 : sigmaZ,
-            // 5 : thetaX, 6 : thetaY, 7 : thetaZ,
-            create_gabor<<<dimGrid,dimBlock>>>(psitemp, n0, n1, n2, 1.0, psis[i+2], psis[i+3], psis[i+4], psis[i+5], psis[i+6], psis[i+7], 0.0, 0.0);
-            eta = psis[i+1];
-            i += 8;
-        }
+// Returns the precision of the contexts created afterwards
+_export_ int getPrecision()
+{
+    // -
+    return precision;
+}
 
-        cufftExecR2C(planR2C, psitemp, fpsitemp);
+// Padding requested by setPadding
+static std::atomic<int> padding(VSNR_PAD_NONE);
 
-        compute_squared_norm<<<dimGrid,dimBlock>>>(fpsitemp, m); // fpsitemp = |fpsitemp|^2;
+// Selects the padding of the contexts created afterwards (VSNR_PAD_*)
+// VSNR_PAD_MIRROR and VSNR_PAD_PERIODIC run the FFTs on the next 7-smooth size of each axis
+// (see fft_size), the volume is extended to it and the result cropped back, so that a 397
+// slices stack is solved on 400 slices instead of a prime length.
+_export_ void setPadding(int p)
+{
+    // -
+    padding = p;
+}
 
-        compute_product<<<dimGrid,dimBlock>>>(fpsitemp, fd1, ftmp, m); // ftmp = |fd1|*|fpsitemp|;
-        cublasIsamax(handle, m, ftmp, 1, &imax);
-        cudaMemcpy(&max1, &ftmp[imax-1], sizeof(float), cudaMemcpyDeviceToHost); // max1 = ftmp[imax];
+// Returns the padding of the contexts created afterwards
+_export_ int getPadding()
+{
+    // -
+    return padding;
+}
 
-        compute_product<<<dimGrid,dimBlock>>>(fpsitemp, fd2, ftmp, m); // ftmp = |fd2|*|fpsitemp|;
-        cublasIsamax(handle, m, ftmp, 1, &imax);
-        cudaMemcpy(&max2, &ftmp[imax-1], sizeof(float), cudaMemcpyDeviceToHost); // max2 = ftmp[imax];
+// Smallest 2^a 3^b 5^c 7^d >= n, the sizes cuFFT and FFTW transform fastest
+static int fft_size(int n)
+{
+    for ( ; ; ++n) {
+        int r = n;
+        while (r % 2 == 0) r /= 2;
+        while (r % 3 == 0) r /= 3;
+        while (r % 5 == 0) r /= 5;
+        while (r % 7 == 0) r /= 7;
+        if (r == 1) return n;
+    }
+}
 
-        compute_product<<<dimGrid,dimBlock>>>(fpsitemp, fd3, ftmp, m); // ftmp = |fd3|*|fpsitemp|;
-        cublasIsamax(handle, m, ftmp, 1, &imax);
-        cudaMemcpy(&max3, &ftmp[imax-1], sizeof(float), cudaMemcpyDeviceToHost); // max3 = ftmp[imax];
+// Bytes of one value of the state buffers
+static size_t state_size(int p)
+{
+    // -
+    return (p == VSNR_PRECISION_FLOAT ? sizeof(float) : sizeof(__half));
+}
 
-        mmax = MAX(max1, max2);
-        mmax = MAX(mmax, max3);
+// Number of n-sized real, n-sized state (see setPrecision), m-sized complex and m-sized real buffers of a context
+static void context_buffers(int s, int* nReal, int* nState, int* nComplex, int* nSpectra)
+{
+    // gu0, tmp1 (also gu), y1..y3, l1..l3, fx, ftmp1 and fpsi, fphi, fbank
+    *nReal    = 2;
+    *nState   = 6;
+    *nComplex = 2;
+    *nSpectra = 3;
+
+    // d1u0..d3u0
+    if (s != VSNR_SOLVER_LOWMEM)
+        *nState += 3;
+
+    // tmp2, tmp3 and ftmp2, ftmp3, fphi1..fphi3
+    if (s == VSNR_SOLVER_FFT) {
+        *nReal    += 2;
+        *nComplex += 5;
+    }
+}
 
-        alpha = sqrtf((float)n) * SQ((float)n) * mmax / (norm * eta);
+// Bytes of the arena of a context : its buffers (see context_buffers) with state values
+// of "state" bytes, and "extra" bytes (residuals, vin, vout and FFT work area on the GPU backend)
+static size_t arena_bytes(int s, size_t n, size_t m, size_t state, size_t extra)
+{
+    int nReal, nState, nComplex, nSpectra;
 
-        update_psi<<<dimGrid,dimBlock>>>(fpsitemp, fsum, alpha, m); // fsum += |fpsitemp|^2 / alpha_i;
+    context_buffers(s, &nReal, &nState, &nComplex, &nSpectra);
+    return nReal*aligned(n*sizeof(CuR)) + nState*aligned(n*state) + nComplex*aligned(m*sizeof(CuC)) + nSpectra*aligned(m*sizeof(float)) + extra;
+}
 
-    }
+// Returns the peak memory in bytes of a context for a n0 x n1 x n2 volume and a solver
+// Device memory (buffers, input and output volumes and cuFFT work areas) on the GPU
+// backend, host memory on the CPU backend, the volumes of the caller are not counted.
+// The state buffers follow getPrecision and the grid getPadding.
+_export_ long long VSNR_3D_PEAK_MEMORY(int n0, int n1, int n2, int s)
+{
+    size_t v = (size_t)n0*n1*n2;
 
-    compute_sqrtf<<<dimGrid,dimBlock>>>(fsum, m); // fsum = sqrtf(fsum);
-    cufftExecC2R(planC2R, fsum, gpsi);
+    if (getPadding() != VSNR_PAD_NONE) {
+        n0 = fft_size(n0);
+        n1 = fft_size(n1);
+        n2 = fft_size(n2);
+    }
 
-    cudaFree(psitemp);
-    cudaFree(fpsitemp);
-    cudaFree(ftmp);
-    cudaFree(fsum);
+    size_t n = (size_t)n0*n1*n2;
+    size_t m = (size_t)n0*n2*(n1/2+1);
+    size_t workR2C = 0, workC2R = 0;
 
-    cudaFree(fd1);
-    cudaFree(fd2);
-    cudaFree(fd3);
+    // the CPU backend has neither a residual buffer nor work areas, FFTW keeps its own
+    if (getBackend() == VSNR_BACKEND_CPU) return arena_bytes(s, n, m, sizeof(float), 0);
 
-    cufftDestroy(planR2C);
-    cufftDestroy(planC2R);
-    cublasDestroy(handle);
+    cufftEstimate3d(n2, n0, n1, CUFFT_R2C, &workR2C);
+    cufftEstimate3d(n2, n0, n1, CUFFT_C2R, &workC2R);
+    return arena_bytes(s, n, m, state_size(getPrecision()), aligned((VSNR_RES_SIZE + VSNR_FAST_SIZE)*sizeof(float)) + 2*aligned(v*sizeof(float)) + MAX(workR2C, workC2R));
 }
 
 // -
 _export_ int getMaxGrid()
 {
-    struct cudaDeviceProp properties;
-    int device;
-    cudaGetDevice(&device);
-    cudaGetDeviceProperties(&properties, device);
-    return properties.maxGridSize[1];
+    int grid, blocks;
+
+    // no device to query, the CPU backend ignores the launch parameters
+    if (getBackend() == VSNR_BACKEND_CPU) return 65535;
+
+    device_limits(&grid, &blocks);
+    return grid;
 }
 
 // -
 _export_ int getMaxBlocks()
 {
-    struct cudaDeviceProp properties;
-    int device;
-    cudaGetDevice(&device);
-    cudaGetDeviceProperties(&properties, device);
-    return properties.maxThreadsDim[0];
+    int grid, blocks;
+
+    // no device to query, the CPU backend ignores the launch parameters
+    if (getBackend() == VSNR_BACKEND_CPU) return 1024;
+
+    device_limits(&grid, &blocks);
+    return blocks;
 }
 
-// -
-_export_ void VSNR_3D_FIJI_GPU(float* psis, int length, float* u0, int n0, int n1, int n2, int nit, float beta, float* u, int nBlocks, float max, float dx, float dy, float dz)
+// Creates the context of VSNR_3D_CREATE_CONTEXT with the given precision instead of getPrecision
+static void* create_context(int n0, int n1, int n2, float dx, float dy, float dz, int nBlocks, int precision)
 {
+    VSNR_CONTEXT* ctx = new VSNR_CONTEXT(); // zeroed
+    int dimGrid, dimBlock;
+
+    ctx->backend   = getBackend();
+    ctx->solver    = getSolver();
+    ctx->precision = (ctx->backend == VSNR_BACKEND_GPU ? precision : VSNR_PRECISION_FLOAT);
+    ctx->pad = getPadding();
+    ctx->v0  = n0;
+    ctx->v1  = n1;
+    ctx->v2  = n2;
+
+    // the solver runs on the padded grid
+    if (ctx->pad != VSNR_PAD_NONE) {
+        n0 = fft_size(n0);
+        n1 = fft_size(n1);
+        n2 = fft_size(n2);
+    }
+
+    // the sizes are int, as the indices of the kernels (the padded grid holds the volume)
+    if ((size_t)n0*n1*n2 > VSNR_MAX_SAMPLES || (size_t)n0*n2*(n1/2+1) > VSNR_MAX_SAMPLES) {
+        delete ctx;
+        return NULL;
+    }
+
     int n = n0*n1*n2;
-    float *gu, *gu0, *gpsi;
+    int m = n0*n2*(n1/2+1);
+    ctx->v  = ctx->v0*ctx->v1*ctx->v2;
+    ctx->n0 = n0;
+    ctx->n1 = n1;
+    ctx->n2 = n2;
+    ctx->n  = n;
+    ctx->m  = m;
+    ctx->dx = dx;
+    ctx->dy = dy;
+    ctx->dz = dz;
+    ctx->grid.n0 = n0;
+    ctx->grid.n1 = n1;
+    ctx->grid.n2 = n2;
+    ctx->grid.h[0] = dx;
+    ctx->grid.h[1] = dy;
+    ctx->grid.h[2] = dz;
+    ctx->every = 10;
+    ctx->alpha = 1;
+
+    if (ctx->backend == VSNR_BACKEND_CPU) {
+        ctx->cpu = VSNR_3D_CPU_CREATE_CONTEXT(n0, n1, n2, dx, dy, dz, ctx->solver);
+        if (!ctx->cpu) {
+            delete ctx;
+            return NULL;
+        }
+        VSNR_3D_CPU_SET_CONTEXT_PADDING(ctx->cpu, ctx->pad, ctx->v0, ctx->v1, ctx->v2);
+        return ctx;
+    }
 
-    int dimBlock = MIN(nBlocks, getMaxBlocks());
+    dimBlock = MIN(nBlocks, getMaxBlocks());
     dimBlock = MAX(dimBlock, 1);
-    int dimGrid = MIN(n/dimBlock, getMaxGrid());
-    dimGrid = MAX(dimGrid, 1);
+    dimGrid  = MIN(n/dimBlock, getMaxGrid());
+    dimGrid  = MAX(dimGrid, 1);
+
+    ctx->dimGrid  = dimGrid;
+    ctx->dimBlock = dimBlock;
+
+    // 1. Plans, without their own work area : they run one at a time on the stream and share one in the arena
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    size_t workR2C = 0, workC2R = 0, state = n*state_size(ctx->precision); // bytes of a state buffer
+    char* p;
+
+    cudaGetLastError();
+    cublasCreate(&ctx->handle);
+    cufftCreate(&ctx->planR2C);
+    cufftCreate(&ctx->planC2R);
+    cufftSetAutoAllocation(ctx->planR2C, 0);
+    cufftSetAutoAllocation(ctx->planC2R, 0);
+    cufftMakePlan3d(ctx->planR2C, n2, n0, n1, CUFFT_R2C, &workR2C);
+    cufftMakePlan3d(ctx->planC2R, n2, n0, n1, CUFFT_C2R, &workC2R);
+
+    // own stream, so that the contexts of several host threads run concurrently, and one for the copies of the other runs
+    cudaStreamCreateWithFlags(&ctx->stream, cudaStreamNonBlocking);
+    cudaStreamCreateWithFlags(&ctx->copies, cudaStreamNonBlocking);
+    cublasSetStream(ctx->handle, ctx->stream);
+    cufftSetStream(ctx->planR2C, ctx->stream);
+    cufftSetStream(ctx->planC2R, ctx->stream);
+    ctx->prof.allocMs += elapsed(t0);
+
+    // 2. Alloc memory, one arena for the buffers of context_buffers, the volumes and the work area, reused by every run
+    alloc(ctx, &ctx->arena, arena_bytes(ctx->solver, n, m, state_size(ctx->precision), aligned((VSNR_RES_SIZE + VSNR_FAST_SIZE)*sizeof(float)) + 2*aligned(ctx->v*sizeof(float)) + MAX(workR2C, workC2R)));
+    if (!ctx->arena || cudaGetLastError() != cudaSuccess) {
+        VSNR_3D_DESTROY_CONTEXT(ctx);
+        return NULL;
+    }
+    p = (char*)ctx->arena;
+
+    ctx->gu0  = (CuR*)carve(&p, n*sizeof(CuR));
+
+    ctx->fpsi = (float*)carve(&p, m*sizeof(float));
+    ctx->fphi = (float*)carve(&p, m*sizeof(float));
+    ctx->fx   = (CuC*)carve(&p, m*sizeof(CuC));
+
+    ctx->fbank = (float*)carve(&p, m*sizeof(float));
+
+    ctx->ftmp.c[0] = (CuC*)carve(&p, m*sizeof(CuC));
+    ctx->tmp.c[0]  = (CuR*)carve(&p, n*sizeof(CuR));
+
+    for (int k = 0 ; k < 3 ; ++k) {
+        ctx->y.c[k] = carve(&p, state);
+        ctx->l.c[k] = carve(&p, state);
+    }
+
+    ctx->res  = (float*)carve(&p, (VSNR_RES_SIZE + VSNR_FAST_SIZE)*sizeof(float));
+    ctx->fast = ctx->res + VSNR_RES_SIZE;
+
+    if (ctx->solver != VSNR_SOLVER_LOWMEM) {
+        for (int k = 0 ; k < 3 ; ++k)
+            ctx->du0.c[k] = carve(&p, state);
+    }
+
+    if (ctx->solver == VSNR_SOLVER_FFT) {
+        for (int k = 0 ; k < 3 ; ++k)
+            ctx->fphik.c[k] = (CuC*)carve(&p, m*sizeof(CuC));
+
+        for (int k = 1 ; k < 3 ; ++k) {
+            ctx->ftmp.c[k] = (CuC*)carve(&p, m*sizeof(CuC));
+            ctx->tmp.c[k]  = (CuR*)carve(&p, n*sizeof(CuR));
+        }
+    }
+
+    ctx->vin  = carve(&p, ctx->v*sizeof(float));
+    ctx->vout = carve(&p, ctx->v*sizeof(float));
+
+    cufftSetWorkArea(ctx->planR2C, p);
+    cufftSetWorkArea(ctx->planC2R, p);
+
+    create_events(ctx);
+    for (int k = 0 ; k < 4 ; ++k)
+        cudaEventCreate(&ctx->copyMarks[k]);
+
+    return ctx;
+}
+
+// Creates the solver context of a n0 x n1 x n2 volume with spacing (dx, dy, dz), with the current
+// backend, solver, precision and padding. Contexts are independent : each one may be run by its own
+// host thread, concurrently with the others (one thread at a time per context).
+// Returns NULL if the allocations fail, or if the padded grid or its spectrum exceed VSNR_MAX_SAMPLES values.
+_export_ void* VSNR_3D_CREATE_CONTEXT(int n0, int n1, int n2, float dx, float dy, float dz, int nBlocks)
+{
+    // -
+    return create_context(n0, n1, n2, dx, dy, dz, nBlocks, getPrecision());
+}
+
+// Bytes of a sample of type (VSNR_TYPE_*)
+size_t sample_size(int type)
+{
+    // -
+    return (type == VSNR_TYPE_UINT8 ? 1 : type == VSNR_TYPE_UINT16 ? 2 : sizeof(float));
+}
+
+// gu0 = (u + offset)/max on the grid of the context, u being the volume of samples of type (VSNR_TYPE_*) on the device
+void load_volume(VSNR_CONTEXT* ctx, const void* u, int type, float max, float offset)
+{
+    if (type == VSNR_TYPE_UINT8)
+        pad_volume<<<launch(ctx), ctx->dimBlock, 0, ctx->stream>>>((const unsigned char*)u, ctx->v0, ctx->v1, ctx->v2, ctx->gu0, ctx->n0, ctx->n1, ctx->n2, ctx->pad, max, offset);
+    else if (type == VSNR_TYPE_UINT16)
+        pad_volume<<<launch(ctx), ctx->dimBlock, 0, ctx->stream>>>((const unsigned short*)u, ctx->v0, ctx->v1, ctx->v2, ctx->gu0, ctx->n0, ctx->n1, ctx->n2, ctx->pad, max, offset);
+    else
+        pad_volume<<<launch(ctx), ctx->dimBlock, 0, ctx->stream>>>((const float*)u, ctx->v0, ctx->v1, ctx->v2, ctx->gu0, ctx->n0, ctx->n1, ctx->n2, ctx->pad, max, offset);
+}
+
+// u = (gu0 - w/n)*max - offset on the volume of the context, as samples of type (VSNR_TYPE_*) on the device,
+// w being returned by the ADMM
+void store_volume(VSNR_CONTEXT* ctx, const CuR* w, void* u, int type, float max, float offset)
+{
+    if (type == VSNR_TYPE_UINT8)
+        crop_volume<<<launch(ctx), ctx->dimBlock, 0, ctx->stream>>>(ctx->gu0, w, ctx->n0, ctx->n1, ctx->n2, (unsigned char*)u, ctx->v0, ctx->v1, ctx->v2, max, offset);
+    else if (type == VSNR_TYPE_UINT16)
+        crop_volume<<<launch(ctx), ctx->dimBlock, 0, ctx->stream>>>(ctx->gu0, w, ctx->n0, ctx->n1, ctx->n2, (unsigned short*)u, ctx->v0, ctx->v1, ctx->v2, max, offset);
+    else
+        crop_volume<<<launch(ctx), ctx->dimBlock, 0, ctx->stream>>>(ctx->gu0, w, ctx->n0, ctx->n1, ctx->n2, (float*)u, ctx->v0, ctx->v1, ctx->v2, max, offset);
+}
+
+// Step 1 of a run split in three (see VSNR_3D_RUN_CONTEXT_TYPED), copies u0 (samples of type in, VSNR_TYPE_*) to
+// the device on the copy stream of the context, and returns once u0 is read. It waits for the solve of the previous
+// run to load its own u0, so that a thread can upload run k+1 while run k is solved and run k-1 downloaded (the
+// copies overlap the solve when u0 and u are pinned, see VSNR_3D_ALLOC_PINNED). The three steps of each run are
+// called once and in this order, by at most one thread per step at a time, even when one of them fails. On the CPU
+// backend u0 is only recorded and is read by the solve. Each step returns 0, or -1 if a CUDA call failed.
+_export_ int VSNR_3D_UPLOAD_CONTEXT(void* context, const void* u0, int in)
+{
+    VSNR_CONTEXT* ctx = (VSNR_CONTEXT*)context;
+    size_t bytes = ctx->v*sample_size(in);
+    int status = 0;
+
+    // vin is free once the previous solve has loaded it
+    wait_step(ctx, &ctx->solves, ctx->uploads);
+
+    if (ctx->backend == VSNR_BACKEND_CPU) {
+        ctx->hin = u0;
+    } else {
+        cudaStreamWaitEvent(ctx->copies, ctx->marks[1], 0);
+        cudaEventRecord(ctx->copyMarks[0], ctx->copies);
+        cudaMemcpyAsync(ctx->vin, u0, bytes, cudaMemcpyHostToDevice, ctx->copies);
+        cudaEventRecord(ctx->copyMarks[1], ctx->copies);
+        count_copy(ctx, 0, bytes);
+        status = step_status("VSNR_3D_UPLOAD_CONTEXT");
+    }
+
+    end_step(ctx, &ctx->uploads);
+    return status;
+}
+
+// Step 2 of a run, denoises the uploaded u0 into a device copy of u (samples of type out) with the same arguments as
+// VSNR_3D_RUN_CONTEXT_TYPED, see VSNR_3D_UPLOAD_CONTEXT. Waits for the upload of its run and, before writing u, for
+// the download of the previous run.
+_export_ int VSNR_3D_SOLVE_CONTEXT(void* context, float* psis, int length, int in, int nit, float beta, int out, float max, float offset)
+{
+    VSNR_CONTEXT* ctx = (VSNR_CONTEXT*)context;
+    CuR* w;
+
+    wait_step(ctx, &ctx->uploads, ctx->solves + 1);
+
+    if (ctx->backend == VSNR_BACKEND_CPU) {
+        const void* u0 = ctx->hin;
+
+        end_step(ctx, &ctx->solves);
+        if (!ctx->hout) ctx->hout = malloc(ctx->v*sizeof(float));
+
+        wait_step(ctx, &ctx->downloads, ctx->stores);
+        if (ctx->hout)
+            VSNR_3D_CPU_RUN_CONTEXT(ctx->cpu, psis, length, u0, in, nit, beta, ctx->hout, out, max, offset);
+        end_step(ctx, &ctx->stores);
+        return (ctx->hout ? 0 : -1);
+    }
 
-    // 1. Alloc memory    
-    cudaMalloc((void**)&gu,   n*sizeof(float));
-    cudaMalloc((void**)&gpsi, n*sizeof(float));
-    cudaMalloc((void**)&gu0,  n*sizeof(float));
+    double timed = ctx->prof.fftMs + ctx->prof.transferMs;
+    float up = ctx->copyMs[0];
 
-    cudaMemcpy(gu0, u0, n*sizeof(float), cudaMemcpyHostToDevice);
-    divide<<<dimGrid, dimBlock>>>(gu0, n, max);
+    // 1. Widens, pads and scales vin into gu0 once the upload is done, then hands vin to the next upload
+    cudaStreamWaitEvent(ctx->stream, ctx->copyMarks[1], 0);
+    mark(ctx, 0);
+    load_volume(ctx, ctx->vin, in, max, offset);
+    mark(ctx, 1);
+    end_step(ctx, &ctx->solves);
 
     // 2. Prepares filters
-    CREATE_FILTERS(psis, gu0, length, gpsi, n0, n1, n2, dimGrid, dimBlock, dx, dy, dz);
+    CREATE_FILTERS(ctx, psis, ctx->gu0, length, max);
+    mark(ctx, 2);
 
     // 3. Denoises the image
-    VSNR_ADMM_GPU(gu0, gpsi, n0, n1, n2, nit, beta, gu, dimGrid, dimBlock, dx, dy, dz);
+    w = VSNR_ADMM(ctx, ctx->gu0, nit, beta);
+
+    // 4. u = u0 - w/n, cropped, scaled and converted into vout once the previous download has read it
+    wait_step(ctx, &ctx->downloads, ctx->stores);
+    cudaStreamWaitEvent(ctx->stream, ctx->copyMarks[3], 0);
+    store_volume(ctx, w, ctx->vout, out, max, offset);
+    mark(ctx, 5);
+    end_step(ctx, &ctx->stores);
+
+    stage_times(ctx, timed, up);
+    return step_status("VSNR_3D_SOLVE_CONTEXT");
+}
+
+// Step 3 of a run, copies u (samples of type out) to the host on the copy stream once it is solved, and returns
+// once u is written, see VSNR_3D_UPLOAD_CONTEXT
+_export_ int VSNR_3D_DOWNLOAD_CONTEXT(void* context, void* u, int out)
+{
+    VSNR_CONTEXT* ctx = (VSNR_CONTEXT*)context;
+    size_t bytes = ctx->v*sample_size(out);
+    int status = 0;
+
+    wait_step(ctx, &ctx->stores, ctx->downloads + 1);
+
+    if (ctx->backend == VSNR_BACKEND_CPU) {
+        if (ctx->hout) memcpy(u, ctx->hout, bytes);
+        else           status = -1;
+    } else {
+        cudaStreamWaitEvent(ctx->copies, ctx->marks[5], 0);
+        cudaEventRecord(ctx->copyMarks[2], ctx->copies);
+        cudaMemcpyAsync(u, ctx->vout, bytes, cudaMemcpyDeviceToHost, ctx->copies);
+        cudaEventRecord(ctx->copyMarks[3], ctx->copies);
+        count_copy(ctx, 1, bytes);
+        status = step_status("VSNR_3D_DOWNLOAD_CONTEXT");
+    }
+
+    end_step(ctx, &ctx->downloads);
+    return status;
+}
+
+// Denoises u0 into u with a context created for the same geometry, u0 holding samples of type in and u of
+// type out (VSNR_TYPE_*). The samples only cross the bus in their own type : u0 + offset is widened, padded and
+// divided by max in one kernel, and the last step of the ADMM writes u = max*result - offset cropped, rounded
+// and clamped (integers) in one kernel. offset = 1 keeps the log of the plugin defined on 0 samples.
+// Returns 0, or -1 if a CUDA call failed (u is then not set).
+_export_ int VSNR_3D_RUN_CONTEXT_TYPED(void* context, float* psis, int length, const void* u0, int in, int nit, float beta, void* u, int out, float max, float offset)
+{
+    VSNR_CONTEXT* ctx = (VSNR_CONTEXT*)context;
+    int up, solve, down;
+
+    // no copy to split on the CPU backend
+    if (ctx->backend == VSNR_BACKEND_CPU) {
+        VSNR_3D_CPU_RUN_CONTEXT(ctx->cpu, psis, length, u0, in, nit, beta, u, out, max, offset);
+        return 0;
+    }
+
+    // the three steps are taken whatever happens, so that the next runs of the context stay in order
+    up    = VSNR_3D_UPLOAD_CONTEXT(ctx, u0, in);
+    solve = VSNR_3D_SOLVE_CONTEXT(ctx, psis, length, in, nit, beta, out, max, offset);
+    down  = VSNR_3D_DOWNLOAD_CONTEXT(ctx, u, out);
+    return (up || solve || down ? -1 : 0);
+}
+
+// Denoises u0 into u with a context created for the same geometry, returns 0 or -1 (see VSNR_3D_RUN_CONTEXT_TYPED)
+_export_ int VSNR_3D_RUN_CONTEXT(void* context, float* psis, int length, float* u0, int nit, float beta, float* u, float max)
+{
+    // -
+    return VSNR_3D_RUN_CONTEXT_TYPED(context, psis, length, u0, VSNR_TYPE_FLOAT32, nit, beta, u, VSNR_TYPE_FLOAT32, max, 0);
+}
+
+// Same as VSNR_3D_RUN_CONTEXT on 8 bits volumes, u0 + offset is denoised and u = round(max * result - offset)
+// clamped to [0, 255], see VSNR_3D_RUN_CONTEXT_TYPED
+_export_ int VSNR_3D_RUN_CONTEXT_U8(void* context, float* psis, int length, unsigned char* u0, int nit, float beta, unsigned char* u, float max, float offset)
+{
+    // -
+    return VSNR_3D_RUN_CONTEXT_TYPED(context, psis, length, u0, VSNR_TYPE_UINT8, nit, beta, u, VSNR_TYPE_UINT8, max, offset);
+}
+
+// Same as VSNR_3D_RUN_CONTEXT_U8 on 16 bits volumes, u clamped to [0, 65535]
+_export_ int VSNR_3D_RUN_CONTEXT_U16(void* context, float* psis, int length, unsigned short* u0, int nit, float beta, unsigned short* u, float max, float offset)
+{
+    // -
+    return VSNR_3D_RUN_CONTEXT_TYPED(context, psis, length, u0, VSNR_TYPE_UINT16, nit, beta, u, VSNR_TYPE_UINT16, max, offset);
+}
+
+// Scales the filters of the next runs by rms (in units of u0) instead of the norm of each u0,
+// so that the bricks of a volume share the same filters. 0 restores the default.
+_export_ void VSNR_3D_SET_CONTEXT_RMS(void* context, float rms)
+{
+    VSNR_CONTEXT* ctx = (VSNR_CONTEXT*)context;
+
+    ctx->rms = rms;
+    if (ctx->backend == VSNR_BACKEND_CPU)
+        VSNR_3D_CPU_SET_CONTEXT_RMS(ctx->cpu, rms);
+}
+
+// Stops the next runs once both relative residuals are below tol, checked every "every" iterations
+// (default 10). tol = 0 runs all the iterations. nit stays the maximum number of iterations.
+_export_ void VSNR_3D_SET_CONTEXT_TOLERANCE(void* context, float tol, int every)
+{
+    VSNR_CONTEXT* ctx = (VSNR_CONTEXT*)context;
+
+    ctx->tol   = tol;
+    ctx->every = (every > 0 ? every : 10);
+    if (ctx->backend == VSNR_BACKEND_CPU)
+        VSNR_3D_CPU_SET_CONTEXT_TOLERANCE(ctx->cpu, ctx->tol, ctx->every);
+}
+
+// warm = 1 starts the next runs from y and lambda where the previous run of the context left them (from 0 for
+// the first run), e.g. for the frames of a time-lapse, so that "tolerance" stops them after a few iterations.
+// fx needs no seed, the first x update computes it from y and lambda. 0 (the default) starts each run from 0.
+_export_ void VSNR_3D_SET_CONTEXT_WARM_START(void* context, int warm)
+{
+    VSNR_CONTEXT* ctx = (VSNR_CONTEXT*)context;
+
+    ctx->warm = warm;
+    if (ctx->backend == VSNR_BACKEND_CPU)
+        VSNR_3D_CPU_SET_CONTEXT_WARM_START(ctx->cpu, warm);
+}
+
+// Iterations and relative residuals (see check_residuals) of the last run
+_export_ void VSNR_3D_GET_CONTEXT_STATS(void* context, int* iterations, float* primal, float* dual)
+{
+    VSNR_CONTEXT* ctx = (VSNR_CONTEXT*)context;
+
+    if (ctx->backend == VSNR_BACKEND_CPU) {
+        VSNR_3D_CPU_GET_CONTEXT_STATS(ctx->cpu, iterations, primal, dual);
+        return;
+    }
+
+    *iterations = ctx->iterations;
+    *primal     = ctx->primal;
+    *dual       = ctx->dual;
+}
+
+// Milliseconds spent in each stage (VSNR_STAGE_*) of the last run, times has VSNR_STAGE_COUNT entries.
+// Divide times[VSNR_STAGE_ITERATIONS] by the iterations of VSNR_3D_GET_CONTEXT_STATS for one iteration.
+// The transfer is the upload and the load of the last solve plus the last download.
+_export_ void VSNR_3D_GET_CONTEXT_TIMES(void* context, float* times)
+{
+    VSNR_CONTEXT* ctx = (VSNR_CONTEXT*)context;
+
+    if (ctx->backend == VSNR_BACKEND_CPU) {
+        VSNR_3D_CPU_GET_CONTEXT_TIMES(ctx->cpu, times);
+        return;
+    }
+
+    std::lock_guard<std::mutex> guard(ctx->steps);
+    memcpy(times, ctx->times, VSNR_STAGE_COUNT*sizeof(float));
+    times[VSNR_STAGE_TRANSFER] += ctx->copyMs[1];
+}
+
+// Profile and stage times of the last destroyed context, see VSNR_3D_GET_CONTEXT_PROFILE
+static VSNR_PROFILE lastProfile;
+static float lastTimes[VSNR_STAGE_COUNT];
+static std::mutex lastLock;
+
+// Copies the instrumentation of a context (cumulative over its runs) to profile.
+// NULL gives the profile of the last destroyed context, e.g. of the last VSNR_3D_FIJI_GPU.
+_export_ void VSNR_3D_GET_CONTEXT_PROFILE(void* context, VSNR_PROFILE* profile)
+{
+    VSNR_CONTEXT* ctx = (VSNR_CONTEXT*)context;
+
+    if (!ctx) {
+        std::lock_guard<std::mutex> guard(lastLock);
+        *profile = lastProfile;
+    } else if (ctx->backend == VSNR_BACKEND_CPU) {
+        VSNR_3D_CPU_GET_CONTEXT_PROFILE(ctx->cpu, profile);
+    } else {
+        harvest(ctx);
+        *profile = ctx->prof;
+
+        std::lock_guard<std::mutex> guard(ctx->steps);
+        profile->transfers     += ctx->copyCount;
+        profile->transferBytes += ctx->copyBytes;
+        profile->transferMs    += ctx->copyTime;
+    }
+}
+
+// Same as VSNR_3D_GET_CONTEXT_PROFILE and VSNR_3D_GET_CONTEXT_TIMES as a JSON object written to json (size bytes
+// at most, NUL included). Returns the length of the whole object, json is truncated if it is not below size.
+_export_ int VSNR_3D_GET_CONTEXT_PROFILE_JSON(void* context, char* json, int size)
+{
+    VSNR_PROFILE p;
+    float t[VSNR_STAGE_COUNT];
+
+    if (context) {
+        VSNR_3D_GET_CONTEXT_PROFILE(context, &p);
+        VSNR_3D_GET_CONTEXT_TIMES(context, t);
+    } else {
+        std::lock_guard<std::mutex> guard(lastLock);
+        p = lastProfile;
+        memcpy(t, lastTimes, sizeof(t));
+    }
+
+    return snprintf(json, size,
+        "{\"runs\":%d,\"ffts\":%lld,\"fft_ms\":%.3f,\"kernels\":%lld,\"kernel_ms\":%.3f,"
+        "\"allocs\":%lld,\"alloc_ms\":%.3f,\"transfers\":%lld,\"transfer_bytes\":%lld,\"transfer_ms\":%.3f,"
+        "\"bytes\":%lld,\"peak_bytes\":%lld,\"last_run_ms\":{\"transfer\":%.3f,\"filters\":%.3f,"
+        "\"setup\":%.3f,\"iterations\":%.3f,\"final\":%.3f}}",
+        p.runs, p.ffts, p.fftMs, p.kernels, p.kernelMs,
+        p.allocs, p.allocMs, p.transfers, p.transferBytes, p.transferMs,
+        p.bytes, p.peakBytes, t[VSNR_STAGE_TRANSFER], t[VSNR_STAGE_FILTERS],
+        t[VSNR_STAGE_SETUP], t[VSNR_STAGE_ITERATIONS], t[VSNR_STAGE_FINAL]);
+}
+
+// Calls progress(iteration, nit, primal, dual, user) every "every" iterations of the next runs and on
+// their last iteration, with the relative residuals of VSNR_3D_GET_CONTEXT_STATS. NULL removes it.
+// The residuals are summed on these iterations, which costs a few kernels and a copy of 20 bytes.
+_export_ void VSNR_3D_SET_CONTEXT_PROGRESS(void* context, VSNR_PROGRESS progress, int every, void* user)
+{
+    VSNR_CONTEXT* ctx = (VSNR_CONTEXT*)context;
+
+    ctx->progress      = progress;
+    ctx->progressEvery = (every > 0 ? every : 1);
+    ctx->progressUser  = user;
+    if (ctx->backend == VSNR_BACKEND_CPU)
+        VSNR_3D_CPU_SET_CONTEXT_PROGRESS(ctx->cpu, progress, ctx->progressEvery, user);
+}
+
+// Selects the ADMM variant of the next runs (VSNR_ACCEL_*), alpha is the over-relaxation factor of
+// VSNR_ACCEL_RELAX (in ]0, 2[, 1.5 to 1.8 usually). VSNR_ACCEL_NESTEROV needs 6 more state buffers
+// (previous y and lambda) on top of VSNR_3D_PEAK_MEMORY, allocated here.
+// Returns 0, or -1 if these allocations fail (the context is left unchanged).
+_export_ int VSNR_3D_SET_CONTEXT_ACCELERATION(void* context, int accel, float alpha)
+{
+    VSNR_CONTEXT* ctx = (VSNR_CONTEXT*)context;
+    int n = ctx->n;
+
+    if (ctx->backend == VSNR_BACKEND_CPU) {
+        if (VSNR_3D_CPU_SET_CONTEXT_ACCELERATION(ctx->cpu, accel, alpha) != 0) return -1;
+    } else if (accel == VSNR_ACCEL_NESTEROV && !ctx->yp.c[0]) {
+        cudaGetLastError();
+        for (int k = 0 ; k < 3 ; ++k) {
+            alloc(ctx, (void**)&ctx->yp.c[k], n*state_size(ctx->precision));
+            alloc(ctx, (void**)&ctx->lp.c[k], n*state_size(ctx->precision));
+        }
+
+        if (cudaGetLastError() != cudaSuccess) {
+            for (int k = 0 ; k < 3 ; ++k) {
+                if (ctx->yp.c[k]) account(ctx, -(long long)(n*state_size(ctx->precision)));
+                if (ctx->lp.c[k]) account(ctx, -(long long)(n*state_size(ctx->precision)));
+                cudaFree(ctx->yp.c[k]);
+                cudaFree(ctx->lp.c[k]);
+                ctx->yp.c[k] = ctx->lp.c[k] = NULL;
+            }
+            return -1;
+        }
+    }
+
+    ctx->accel = accel;
+    ctx->alpha = (accel == VSNR_ACCEL_RELAX ? alpha : 1);
+    return 0;
+}
+
+// Frees a context (NULL is ignored)
+_export_ void VSNR_3D_DESTROY_CONTEXT(void* context)
+{
+    VSNR_CONTEXT* ctx = (VSNR_CONTEXT*)context;
+
+    if (!ctx) return;
+
+    if (ctx->cpu || ctx->marks[0]) {
+        VSNR_PROFILE p;
+        float t[VSNR_STAGE_COUNT];
+
+        VSNR_3D_GET_CONTEXT_PROFILE(ctx, &p);
+        VSNR_3D_GET_CONTEXT_TIMES(ctx, t);
+
+        std::lock_guard<std::mutex> guard(lastLock);
+        lastProfile = p;
+        memcpy(lastTimes, t, sizeof(t));
+    }
+
+    free(ctx->hout);
+
+    if (ctx->backend == VSNR_BACKEND_CPU) {
+        VSNR_3D_CPU_DESTROY_CONTEXT(ctx->cpu);
+        delete ctx;
+        return;
+    }
+
+    cudaFree(ctx->arena);
+    free(ctx->bank);
+
+    for (int k = 0 ; k < 3 ; ++k) {
+        cudaFree(ctx->yp.c[k]);
+        cudaFree(ctx->lp.c[k]);
+    }
+
+    if (ctx->planR2C) cufftDestroy(ctx->planR2C);
+    if (ctx->planC2R) cufftDestroy(ctx->planC2R);
+    if (ctx->handle)  cublasDestroy(ctx->handle);
+    if (ctx->stream)  cudaStreamDestroy(ctx->stream);
+    if (ctx->copies)  cudaStreamDestroy(ctx->copies);
+
+    destroy_events(ctx);
+    for (int k = 0 ; k < 4 ; ++k)
+        if (ctx->copyMarks[k]) cudaEventDestroy(ctx->copyMarks[k]);
+
+    delete ctx;
+}
+
+// Page-locked host buffer of "bytes" for the volumes given to the GPU contexts (faster copies),
+// NULL on the CPU backend or when it cannot be pinned. Freed by VSNR_3D_FREE_PINNED.
+_export_ void* VSNR_3D_ALLOC_PINNED(long long bytes)
+{
+    void* p = NULL;
+
+    if (getBackend() != VSNR_BACKEND_GPU) return NULL;
+    if (cudaHostAlloc(&p, bytes, cudaHostAllocDefault) != cudaSuccess) return NULL;
+    return p;
+}
+
+_export_ void VSNR_3D_FREE_PINNED(void* p)
+{
+    if (p) cudaFreeHost(p);
+}
+
+// One shot denoising of samples of type (VSNR_TYPE_*), same as create / run / destroy
+int fiji_gpu(float* psis, int length, const void* u0, int n0, int n1, int n2, int nit, float beta, void* u, int nBlocks, float max, float dx, float dy, float dz, int type, float offset)
+{
+    void* ctx = VSNR_3D_CREATE_CONTEXT(n0, n1, n2, dx, dy, dz, nBlocks);
+    int status;
+
+    if (!ctx) {
+        __dispLastCudaError(stderr, "VSNR_3D_FIJI_GPU");
+        return -1;
+    }
+
+    status = VSNR_3D_RUN_CONTEXT_TYPED(ctx, psis, length, u0, type, nit, beta, u, type, max, offset);
+    VSNR_3D_DESTROY_CONTEXT(ctx);
+    return status;
+}
+
+// One shot denoising, same as create / run / destroy. Returns 0, or -1 if the context cannot be created or the run fails.
+_export_ int VSNR_3D_FIJI_GPU(float* psis, int length, float* u0, int n0, int n1, int n2, int nit, float beta, float* u, int nBlocks, float max, float dx, float dy, float dz)
+{
+    // -
+    return fiji_gpu(psis, length, u0, n0, n1, n2, nit, beta, u, nBlocks, max, dx, dy, dz, VSNR_TYPE_FLOAT32, 0);
+}
+
+// Same as VSNR_3D_FIJI_GPU on 8 bits volumes, see VSNR_3D_RUN_CONTEXT_U8
+_export_ int VSNR_3D_FIJI_GPU_U8(float* psis, int length, unsigned char* u0, int n0, int n1, int n2, int nit, float beta, unsigned char* u, int nBlocks, float max, float dx, float dy, float dz, float offset)
+{
+    // -
+    return fiji_gpu(psis, length, u0, n0, n1, n2, nit, beta, u, nBlocks, max, dx, dy, dz, VSNR_TYPE_UINT8, offset);
+}
+
+// Same as VSNR_3D_FIJI_GPU on 16 bits volumes, see VSNR_3D_RUN_CONTEXT_U16
+_export_ int VSNR_3D_FIJI_GPU_U16(float* psis, int length, unsigned short* u0, int n0, int n1, int n2, int nit, float beta, unsigned short* u, int nBlocks, float max, float dx, float dy, float dz, float offset)
+{
+    // -
+    return fiji_gpu(psis, length, u0, n0, n1, n2, nit, beta, u, nBlocks, max, dx, dy, dz, VSNR_TYPE_UINT16, offset);
+}
+
+// Accuracy of a reduced precision p (VSNR_PRECISION_*) on u0 : denoises u0 with float and with p state
+// buffers (same solver and backend) and returns in report the relative l2 error of u, its largest absolute
+// error and the PSNR of the float result against the reduced one (in units of max).
+// Returns 0, or -1 if a context cannot be created or a run fails.
+_export_ int VSNR_3D_PRECISION_REPORT(float* psis, int length, float* u0, int n0, int n1, int n2, int nit, float beta, int nBlocks, float max, float dx, float dy, float dz, int p, float* report)
+{
+    long long n = (long long)n0*n1*n2;
+    float* ref = (float*)malloc(n*sizeof(float));
+    float* u   = (float*)malloc(n*sizeof(float));
+    double e2 = 0.0, r2 = 0.0, emax = 0.0;
+    void* ctx;
+    int failed = 0;
+
+    ctx = create_context(n0, n1, n2, dx, dy, dz, nBlocks, VSNR_PRECISION_FLOAT);
+    if (ctx) {
+        failed = VSNR_3D_RUN_CONTEXT(ctx, psis, length, u0, nit, beta, ref, max);
+        VSNR_3D_DESTROY_CONTEXT(ctx);
+
+        ctx = create_context(n0, n1, n2, dx, dy, dz, nBlocks, p);
+    }
+
+    if (ctx) {
+        failed |= VSNR_3D_RUN_CONTEXT(ctx, psis, length, u0, nit, beta, u, max);
+        VSNR_3D_DESTROY_CONTEXT(ctx);
+    }
+
+    if (!ctx || failed) {
+        free(ref);
+        free(u);
+        return -1;
+    }
+
+    for (long long i = 0 ; i < n ; ++i) {
+        double d = (double)u[i] - ref[i];
+        e2  += d * d;
+        r2  += (double)ref[i] * ref[i];
+        emax = MAX(emax, fabs(d));
+    }
 
-    // 4. Copies the result to u
-    multiply<<<dimGrid, dimBlock>>>(gu, n, max);
-    cudaMemcpy(u, gu, n*sizeof(float), cudaMemcpyDeviceToHost);
+    report[0] = (float)(sqrt(e2) / MAX(sqrt(r2), 1e-30));
+    report[1] = (float)emax;
+    report[2] = (float)(10.0 * log10(SQ((double)max) / MAX(e2 / n, 1e-30)));
 
-    // 5. Frees memory
-    cudaFree(gu);
-    cudaFree(gu0);
-    cudaFree(gpsi);
+    free(ref);
+    free(u);
+    return 0;
 }
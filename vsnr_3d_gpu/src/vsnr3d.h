@@ -0,0 +1,120 @@
+
+
+// ---------------------------------------------------- //
+//                                                      //
+//              VSNR 3D LIBRARY INTERFACE               //
+//                                                      //
+// ---------------------------------------------------- //
+// Original Algorithm :                                 //
+//   Pierre WEISS, Jerome FEHRENBACH                    //
+// Developers :                                         //
+//   Pierre WEISS, Mogan GAUTHIER, Jean EYMERIE         //
+// ---------------------------------------------------- //
+
+/////////////////////////////////////////////////////////
+//  Exported functions and settings of libvsnr3d, for  //
+//  its own sources and for the programs that link it  //
+//  (vsnr3d_cli, vsnr3d_bench, vsnr3d_quality). Build  //
+//  them with -I ../../vsnr_common.                    //
+/////////////////////////////////////////////////////////
+
+#ifndef VSNR3D_H
+#define VSNR3D_H
+
+
+// the sources of the library define it first, with __declspec(dllexport) on Windows
+#ifndef _export_
+#define _export_ extern "C"
+#endif
+
+#include "vsnr_admm.h"
+
+#define VSNR_BACKEND_AUTO (-1)
+#define VSNR_BACKEND_GPU  (0)
+#define VSNR_BACKEND_CPU  (1)
+
+#define VSNR_PAD_NONE     (0) // FFTs on the volume size
+#define VSNR_PAD_MIRROR   (1) // FFTs on the next 7-smooth size, volume extended by symmetry
+#define VSNR_PAD_PERIODIC (2) // FFTs on the next 7-smooth size, volume extended by repetition
+
+#define VSNR_TYPE_FLOAT32 (0) // samples of u0 and u, see VSNR_3D_RUN_CONTEXT_TYPED
+#define VSNR_TYPE_UINT8   (1) // integer outputs are rounded to the nearest and clamped to their range
+#define VSNR_TYPE_UINT16  (2)
+
+#define VSNR_STAGE_TRANSFER   (0) // copies of u0 and u between host and device (and conversion, scaling by max)
+#define VSNR_STAGE_FILTERS    (1) // CREATE_FILTERS, the filter bank is only built by the first run
+#define VSNR_STAGE_SETUP      (2) // Du0, fphi and initial state of the ADMM
+#define VSNR_STAGE_ITERATIONS (3) // all the ADMM iterations, see VSNR_3D_GET_CONTEXT_STATS for their number
+#define VSNR_STAGE_FINAL      (4) // u = u0 - psi * x
+#define VSNR_STAGE_COUNT      (5) // see VSNR_3D_GET_CONTEXT_TIMES
+
+// Job status, returned by VSNR_3D_POLL / VSNR_3D_WAIT (-1 for an unknown job)
+#define VSNR_JOB_OPEN      (0)  // staging volume handed out, u0 being written by the caller
+#define VSNR_JOB_QUEUED    (1)  // waiting for the upload
+#define VSNR_JOB_LOADING   (2)  // u0 being copied to the device
+#define VSNR_JOB_LOADED    (3)  // waiting for the solver
+#define VSNR_JOB_RUNNING   (4)
+#define VSNR_JOB_WRITING   (5)  // solved, waiting for or being copied back to its staging volume
+#define VSNR_JOB_DONE      (6)  // u in its staging volume, see VSNR_3D_RESULT
+#define VSNR_JOB_CANCELLED (7)
+#define VSNR_JOB_RELEASED  (8)  // staging volume given back
+#define VSNR_JOB_FAILED    (9)  // a step of the run failed, the staging volume is to release
+
+
+// vsnr3d.cu, settings of the contexts created afterwards
+_export_ void  setBackend(int b);
+_export_ int   getBackend();
+_export_ void  setSolver(int s);
+_export_ int   getSolver();
+_export_ void  setPrecision(int p);
+_export_ int   getPrecision();
+_export_ void  setPadding(int p);
+_export_ int   getPadding();
+_export_ int   getMaxGrid();
+_export_ int   getMaxBlocks();
+_export_ long long VSNR_3D_PEAK_MEMORY(int n0, int n1, int n2, int s);
+
+// vsnr3d.cu, contexts
+_export_ void* VSNR_3D_CREATE_CONTEXT(int n0, int n1, int n2, float dx, float dy, float dz, int nBlocks);
+_export_ int   VSNR_3D_UPLOAD_CONTEXT(void* context, const void* u0, int in);
+_export_ int   VSNR_3D_SOLVE_CONTEXT(void* context, float* psis, int length, int in, int nit, float beta, int out, float max, float offset);
+_export_ int   VSNR_3D_DOWNLOAD_CONTEXT(void* context, void* u, int out);
+_export_ int   VSNR_3D_RUN_CONTEXT_TYPED(void* context, float* psis, int length, const void* u0, int in, int nit, float beta, void* u, int out, float max, float offset);
+_export_ int   VSNR_3D_RUN_CONTEXT(void* context, float* psis, int length, float* u0, int nit, float beta, float* u, float max);
+_export_ int   VSNR_3D_RUN_CONTEXT_U8(void* context, float* psis, int length, unsigned char* u0, int nit, float beta, unsigned char* u, float max, float offset);
+_export_ int   VSNR_3D_RUN_CONTEXT_U16(void* context, float* psis, int length, unsigned short* u0, int nit, float beta, unsigned short* u, float max, float offset);
+_export_ void  VSNR_3D_SET_CONTEXT_RMS(void* context, float rms);
+_export_ void  VSNR_3D_SET_CONTEXT_TOLERANCE(void* context, float tol, int every);
+_export_ void  VSNR_3D_SET_CONTEXT_WARM_START(void* context, int warm);
+_export_ int   VSNR_3D_SET_CONTEXT_ACCELERATION(void* context, int accel, float alpha);
+_export_ void  VSNR_3D_SET_CONTEXT_PROGRESS(void* context, VSNR_PROGRESS progress, int every, void* user);
+_export_ void  VSNR_3D_GET_CONTEXT_STATS(void* context, int* iterations, float* primal, float* dual);
+_export_ void  VSNR_3D_GET_CONTEXT_TIMES(void* context, float* times);
+_export_ void  VSNR_3D_GET_CONTEXT_PROFILE(void* context, VSNR_PROFILE* profile);
+_export_ int   VSNR_3D_GET_CONTEXT_PROFILE_JSON(void* context, char* json, int size);
+_export_ void  VSNR_3D_DESTROY_CONTEXT(void* context);
+_export_ void* VSNR_3D_ALLOC_PINNED(long long bytes);
+_export_ void  VSNR_3D_FREE_PINNED(void* p);
+
+// vsnr3d.cu, one shot
+_export_ int   VSNR_3D_FIJI_GPU(float* psis, int length, float* u0, int n0, int n1, int n2, int nit, float beta, float* u, int nBlocks, float max, float dx, float dy, float dz);
+_export_ int   VSNR_3D_FIJI_GPU_U8(float* psis, int length, unsigned char* u0, int n0, int n1, int n2, int nit, float beta, unsigned char* u, int nBlocks, float max, float dx, float dy, float dz, float offset);
+_export_ int   VSNR_3D_FIJI_GPU_U16(float* psis, int length, unsigned short* u0, int n0, int n1, int n2, int nit, float beta, unsigned short* u, int nBlocks, float max, float dx, float dy, float dz, float offset);
+_export_ int   VSNR_3D_PRECISION_REPORT(float* psis, int length, float* u0, int n0, int n1, int n2, int nit, float beta, int nBlocks, float max, float dx, float dy, float dz, int p, float* report);
+
+// vsnr3d_tiled.cpp
+_export_ int   VSNR_3D_TILED(const char* input, const char* output, float* psis, int length, int n0, int n1, int n2, int nit, float beta, int nBlocks, float max, float dx, float dy, float dz, int b0, int b1, int b2, int overlap, int depth);
+
+// vsnr3d_async.cpp
+_export_ void* VSNR_3D_CREATE_QUEUE(int n0, int n1, int n2, float dx, float dy, float dz, int nBlocks, int depth);
+_export_ void* VSNR_3D_QUEUE_CONTEXT(void* queue);
+_export_ int   VSNR_3D_ACQUIRE(void* queue, float** u0);
+_export_ int   VSNR_3D_SUBMIT(void* queue, int job, float* psis, int length, int nit, float beta, float max);
+_export_ float* VSNR_3D_RESULT(void* queue, int job);
+_export_ int   VSNR_3D_RELEASE(void* queue, int job);
+_export_ int   VSNR_3D_POLL(void* queue, int job);
+_export_ int   VSNR_3D_WAIT(void* queue, int job);
+_export_ int   VSNR_3D_CANCEL(void* queue, int job);
+_export_ void  VSNR_3D_DESTROY_QUEUE(void* queue);
+
+#endif
@@ -0,0 +1,318 @@
+// ---------------------------------------------------- //
+//                                                      //
+//             VSNR 3D ASYNCHRONOUS QUEUE               //
+//                                                      //
+// ---------------------------------------------------- //
+// Original Algorithm :                                 //
+//   Pierre WEISS, Jerome FEHRENBACH                    //
+// Developers :                                         //
+//   Pierre WEISS, Mogan GAUTHIER, Jean EYMERIE         //
+// ---------------------------------------------------- //
+
+/////////////////////////////////////////////////////////
+//  Denoises a stream of volumes of the same size      //
+//  (channels, frames of a time-lapse) with one        //
+//  context. Each job is handed a pinned staging       //
+//  volume, written by the caller, uploaded, solved    //
+//  and downloaded back into it by a 3 stage pipeline  //
+//  on the split run of the context: the upload of job //
+//  k+1 and the download of job k-1 run on the copy    //
+//  stream while job k is solved.                      //
+/////////////////////////////////////////////////////////
+
+
+#ifdef __linux
+#define _export_ extern "C"
+#elif _WIN32
+#define _export_ extern "C" __declspec(dllexport)
+#endif
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "vsnr3d.h"
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+
+// QUEUE
+// -------------------------------------------------------------------------
+
+typedef struct {
+    int id;
+    std::vector<float> psis;
+    int nit;
+    float beta, max;
+    int slot;
+    int status;
+    bool failed;                                  // a step returned -1 (the next ones are still taken)
+} JOB;
+
+// Jobs go open (acquired) -> pending (submitted) -> loaded (loader) -> solved (solver) -> done (writer),
+// each one holding a staging volume from "free" between VSNR_3D_ACQUIRE and VSNR_3D_RELEASE
+typedef struct {
+    void* ctx;
+    long long n;
+    int depth;
+
+    std::vector<float*> staging;
+    std::vector<bool> pinned;
+
+    std::mutex lock;
+    std::condition_variable changed;
+    std::deque<JOB> jobs;                         // indexed by job id, never shrinks
+    std::deque<int> pending, loaded, solved;      // job ids
+    std::deque<int> free;                         // staging volumes
+    int active;                                   // jobs submitted and neither done nor cancelled
+    bool closing;
+
+    std::thread loader, solver, writer;
+} VSNR_QUEUE;
+
+// Takes the next job of "from" and sets its status, NULL when the queue is closed
+static JOB* take(VSNR_QUEUE* q, std::deque<int>& from, int status)
+{
+    std::unique_lock<std::mutex> guard(q->lock);
+    JOB* j;
+
+    q->changed.wait(guard, [&]{ return q->closing || !from.empty(); });
+    if (q->closing) return NULL;
+
+    j = &q->jobs[from.front()];
+    from.pop_front();
+    j->status = status;
+    return j;
+}
+
+// Hands a job to the next stage, to == NULL when it is done
+static void give(VSNR_QUEUE* q, std::deque<int>* to, JOB* j, int status)
+{
+    std::lock_guard<std::mutex> guard(q->lock);
+
+    if (to) to->push_back(j->id);
+    else    q->active--;
+    j->status = status;
+    q->changed.notify_all();
+}
+
+
+// MAIN FUNCTIONS
+// -------------------------------------------------------------------------
+
+// Queue of volumes of n0 x n1 x n2 voxels denoised by one context (current backend, solver, precision
+// and padding). depth (>= 1) staging volumes are allocated, 3 or more overlap the copies with the solve.
+// Returns NULL if the context or the staging volumes cannot be allocated.
+_export_ void* VSNR_3D_CREATE_QUEUE(int n0, int n1, int n2, float dx, float dy, float dz, int nBlocks, int depth)
+{
+    VSNR_QUEUE* q = new VSNR_QUEUE;
+
+    q->n       = (long long)n0*n1*n2;
+    q->depth   = MAX(depth, 1);
+    q->active  = 0;
+    q->closing = false;
+
+    q->ctx = VSNR_3D_CREATE_CONTEXT(n0, n1, n2, dx, dy, dz, nBlocks);
+    if (!q->ctx) {
+        delete q;
+        return NULL;
+    }
+
+    // pinned when the backend allows it, so that the copies of the context overlap its solves
+    for (int s = 0 ; s < q->depth ; ++s) {
+        float* p = (float*)VSNR_3D_ALLOC_PINNED(q->n*sizeof(float));
+
+        q->pinned.push_back(p != NULL);
+        if (!p) p = (float*)malloc(q->n*sizeof(float));
+        q->staging.push_back(p);
+        q->free.push_back(s);
+
+        if (!p) {
+            VSNR_3D_DESTROY_CONTEXT(q->ctx);
+            for (int k = 0 ; k < s ; ++k) {
+                if (q->pinned[k]) VSNR_3D_FREE_PINNED(q->staging[k]);
+                else              free(q->staging[k]);
+            }
+            delete q;
+            return NULL;
+        }
+    }
+
+    q->loader = std::thread([q]{
+        for (JOB* j ; (j = take(q, q->pending, VSNR_JOB_LOADING)) ; ) {
+            j->failed = (VSNR_3D_UPLOAD_CONTEXT(q->ctx, q->staging[j->slot], VSNR_TYPE_FLOAT32) != 0);
+            give(q, &q->loaded, j, VSNR_JOB_LOADED);
+        }
+    });
+
+    q->solver = std::thread([q]{
+        for (JOB* j ; (j = take(q, q->loaded, VSNR_JOB_RUNNING)) ; ) {
+            if (VSNR_3D_SOLVE_CONTEXT(q->ctx, j->psis.data(), (int)j->psis.size(), VSNR_TYPE_FLOAT32, j->nit, j->beta, VSNR_TYPE_FLOAT32, j->max, 0) != 0) j->failed = true;
+            give(q, &q->solved, j, VSNR_JOB_WRITING);
+        }
+    });
+
+    q->writer = std::thread([q]{
+        for (JOB* j ; (j = take(q, q->solved, VSNR_JOB_WRITING)) ; ) {
+            if (VSNR_3D_DOWNLOAD_CONTEXT(q->ctx, q->staging[j->slot], VSNR_TYPE_FLOAT32) != 0) j->failed = true;
+            give(q, NULL, j, j->failed ? VSNR_JOB_FAILED : VSNR_JOB_DONE);
+        }
+    });
+
+    return q;
+}
+
+// Context of the queue, to set its tolerance, acceleration, warm start, rms or progress before the first job
+_export_ void* VSNR_3D_QUEUE_CONTEXT(void* queue)
+{
+    return ((VSNR_QUEUE*)queue)->ctx;
+}
+
+// Opens a job and returns its id, *u0 being its staging volume (n0 x n1 x n2 floats, pinned when the backend allows
+// it) for the caller to write u0 into before VSNR_3D_SUBMIT. Blocks while the "depth" volumes are held by jobs
+// not released yet.
+_export_ int VSNR_3D_ACQUIRE(void* queue, float** u0)
+{
+    VSNR_QUEUE* q = (VSNR_QUEUE*)queue;
+    std::unique_lock<std::mutex> guard(q->lock);
+    int job;
+
+    q->changed.wait(guard, [&]{ return !q->free.empty(); });
+    job = (int)q->jobs.size();
+
+    q->jobs.push_back(JOB());
+    JOB& j = q->jobs.back();
+    j.id     = job;
+    j.slot   = q->free.front();
+    j.status = VSNR_JOB_OPEN;
+    q->free.pop_front();
+
+    *u0 = q->staging[j.slot];
+    return job;
+}
+
+// Queues the denoising of an open job in its staging volume (same arguments as VSNR_3D_RUN_CONTEXT), psis is
+// copied. Returns 0, or -1 if job is not open.
+_export_ int VSNR_3D_SUBMIT(void* queue, int job, float* psis, int length, int nit, float beta, float max)
+{
+    VSNR_QUEUE* q = (VSNR_QUEUE*)queue;
+    std::lock_guard<std::mutex> guard(q->lock);
+
+    if (job < 0 || job >= (int)q->jobs.size() || q->jobs[job].status != VSNR_JOB_OPEN) return -1;
+
+    JOB& j = q->jobs[job];
+    j.psis.assign(psis, psis + length);
+    j.nit    = nit;
+    j.beta   = beta;
+    j.max    = max;
+    j.status = VSNR_JOB_QUEUED;
+
+    q->active++;
+    q->pending.push_back(job);
+    q->changed.notify_all();
+    return 0;
+}
+
+// Staging volume of a done job, holding u until the job is released, NULL if the job is not done
+_export_ float* VSNR_3D_RESULT(void* queue, int job)
+{
+    VSNR_QUEUE* q = (VSNR_QUEUE*)queue;
+    std::lock_guard<std::mutex> guard(q->lock);
+
+    if (job < 0 || job >= (int)q->jobs.size() || q->jobs[job].status != VSNR_JOB_DONE) return NULL;
+    return q->staging[q->jobs[job].slot];
+}
+
+// Gives the staging volume of a job back to the queue, once it is done, failed or cancelled (an open job is
+// cancelled). Every acquired job is released once. Returns 0, or -1 if the job is still queued or running.
+_export_ int VSNR_3D_RELEASE(void* queue, int job)
+{
+    VSNR_QUEUE* q = (VSNR_QUEUE*)queue;
+    std::lock_guard<std::mutex> guard(q->lock);
+
+    if (job < 0 || job >= (int)q->jobs.size()) return -1;
+
+    JOB& j = q->jobs[job];
+    if (j.status != VSNR_JOB_OPEN && j.status != VSNR_JOB_DONE && j.status != VSNR_JOB_CANCELLED && j.status != VSNR_JOB_FAILED) return -1;
+
+    q->free.push_back(j.slot);
+    j.status = VSNR_JOB_RELEASED;
+    q->changed.notify_all();
+    return 0;
+}
+
+// Status of a job (VSNR_JOB_*), -1 if job is not a job of the queue
+_export_ int VSNR_3D_POLL(void* queue, int job)
+{
+    VSNR_QUEUE* q = (VSNR_QUEUE*)queue;
+    std::lock_guard<std::mutex> guard(q->lock);
+
+    if (job < 0 || job >= (int)q->jobs.size()) return -1;
+    return q->jobs[job].status;
+}
+
+// Waits for a submitted job to be done, failed or cancelled and returns its status
+_export_ int VSNR_3D_WAIT(void* queue, int job)
+{
+    VSNR_QUEUE* q = (VSNR_QUEUE*)queue;
+    std::unique_lock<std::mutex> guard(q->lock);
+
+    if (job < 0 || job >= (int)q->jobs.size()) return -1;
+    q->changed.wait(guard, [&]{ return q->jobs[job].status == VSNR_JOB_OPEN || q->jobs[job].status >= VSNR_JOB_DONE; });
+    return q->jobs[job].status;
+}
+
+// Cancels a job that is not uploaded yet (its staging volume is left untouched, to release). Returns 0, or -1 if
+// it is already uploading, running or finished.
+_export_ int VSNR_3D_CANCEL(void* queue, int job)
+{
+    VSNR_QUEUE* q = (VSNR_QUEUE*)queue;
+    std::lock_guard<std::mutex> guard(q->lock);
+    std::deque<int>::iterator it;
+
+    if (job < 0 || job >= (int)q->jobs.size()) return -1;
+
+    JOB& j = q->jobs[job];
+    if (j.status == VSNR_JOB_QUEUED) {
+        for (it = q->pending.begin() ; it != q->pending.end() && *it != job ; ++it) ;
+        q->pending.erase(it);
+        q->active--;
+    } else if (j.status != VSNR_JOB_OPEN) {
+        return -1;
+    }
+
+    j.status = VSNR_JOB_CANCELLED;
+    q->changed.notify_all();
+    return 0;
+}
+
+// Waits for the submitted jobs (cancel them first to drop them) and frees the queue with its staging
+// volumes, released or not (NULL is ignored)
+_export_ void VSNR_3D_DESTROY_QUEUE(void* queue)
+{
+    VSNR_QUEUE* q = (VSNR_QUEUE*)queue;
+
+    if (!q) return;
+
+    {
+        std::unique_lock<std::mutex> guard(q->lock);
+        q->changed.wait(guard, [&]{ return q->active == 0; });
+        q->closing = true;
+        q->changed.notify_all();
+    }
+
+    q->loader.join();
+    q->solver.join();
+    q->writer.join();
+
+    VSNR_3D_DESTROY_CONTEXT(q->ctx);
+    for (int s = 0 ; s < q->depth ; ++s) {
+        if (q->pinned[s]) VSNR_3D_FREE_PINNED(q->staging[s]);
+        else              free(q->staging[s]);
+    }
+    delete q;
+}
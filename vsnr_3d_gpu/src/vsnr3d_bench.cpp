@@ -0,0 +1,217 @@
+
+
+// ---------------------------------------------------- //
+//                                                      //
+//             VSNR 3D BENCHMARK                        //
+//                                                      //
+// ---------------------------------------------------- //
+// Original Algorithm :                                 //
+//   Pierre WEISS, Jerome FEHRENBACH                    //
+// Developers :                                         //
+//   Pierre WEISS, Mogan GAUTHIER, Jean EYMERIE         //
+// ---------------------------------------------------- //
+
+/////////////////////////////////////////////////////////
+//  Times the stages of VSNR_3D_FIJI_GPU (context,     //
+//  transfers, filter bank, setup of the operators,    //
+//  ADMM iterations, final reconstruction) on a matrix //
+//  of volume sizes, filter counts and solvers. One    //
+//  row per stage, as CSV or JSON lines, see usage.    //
+/////////////////////////////////////////////////////////
+
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "vsnr3d_tools.h"
+
+// Reported stages, the first and the last ones are timed here, the others by the library
+static const char* stageNames[] = {"context", "transfer", "filters", "setup", "iteration", "final", "total"};
+#define BENCH_STAGES (7)
+
+// Deterministic test volume : smooth background, a few bright spheres and vertical stripes
+static void phantom(float* u0, int n0, int n1, int n2)
+{
+    for (int k = 0; k < n2; k++)
+    for (int i = 0; i < n0; i++)
+    for (int j = 0; j < n1; j++) {
+        float x = (float)j / n1, y = (float)i / n0, z = (float)k / n2;
+        float v = 0.3f + 0.2f * x * y;
+        float d = (x - 0.5f)*(x - 0.5f) + (y - 0.5f)*(y - 0.5f) + (z - 0.5f)*(z - 0.5f);
+        if (d < 0.04f) v += 0.4f;
+        v += 0.1f * ((j * 7 + (j * j) % 13) % 5 == 0); // stripes along y and z
+        u0[((size_t)k*n0 + i)*n1 + j] = v;
+    }
+}
+
+// Filter list of VSNR_3D_FIJI_GPU : a dirac followed by count-1 gabors of growing orientation
+static std::vector<float> filters(int count)
+{
+    std::vector<float> psis = {0.0f, 1.0f};
+
+    for (int i = 1; i < count; i++) {
+        float p[8] = {1.0f, 1.0f, 1.0f, 40.0f, 1.0f, 0.0f, 15.0f * (i - 1), 0.0f};
+        psis.insert(psis.end(), p, p + 8);
+    }
+    return psis;
+}
+
+static void usage()
+{
+    fprintf(stderr,
+        "usage: vsnr3d_bench [options]\n"
+        "  --sizes WxHxD,...        n1 x n0 x n2 volumes (default 128x128x97,256x256x211,512x512x128,2048x2048x397)\n"
+        "  --filters a,b,...        number of filters, one dirac and gabors (default 1,2,4)\n"
+        "  --solvers fft,stencil    any of fft, stencil, lowmem (default fft,stencil,lowmem)\n"
+        "  --nit N                  ADMM iterations (default 50)\n"
+        "  --beta B                 ADMM penalty (default 10)\n"
+        "  --repeat R               runs per configuration, the fastest is reported (default 3)\n"
+        "  --precision P            float, half or bf16 (default float)\n"
+        "  --backend B              gpu, cpu or auto (default auto)\n"
+        "  --padding P              none, mirror or periodic (default none)\n"
+        "  --json                   JSON lines instead of CSV\n"
+        "\n"
+        "One row per configuration and stage. voxels_per_s is voxels / stage time (per iteration for\n"
+        "the iteration stage), gb_per_s is the working set of the context (VSNR_3D_PEAK_MEMORY) over\n"
+        "the stage time, except for transfer which counts the input and the output volumes.\n");
+}
+
+// One output row
+static void row(bool json, int n0, int n1, int n2, int nFilters, int s, int it, int nit, const char* stage, double ms, double bytes, const char* skip)
+{
+    double n = (double)n0*n1*n2;
+    double vps = (ms > 0 ? n / (ms * 1e-3) : 0.0);
+    double gbs = (ms > 0 ? bytes / (ms * 1e-3) / 1e9 : 0.0);
+    const char* p = precisionNames[getPrecision()];
+    const char* b = backendNames[getBackend()];
+    const char* d = paddingNames[getPadding()];
+
+    if (json)
+        printf("{\"n1\":%d,\"n0\":%d,\"n2\":%d,\"voxels\":%.0f,\"filters\":%d,\"solver\":\"%s\",\"precision\":\"%s\",\"backend\":\"%s\",\"padding\":\"%s\","
+               "\"nit\":%d,\"iterations\":%d,\"stage\":\"%s\",\"ms\":%.4f,\"voxels_per_s\":%.6g,\"gb_per_s\":%.6g%s%s%s}\n",
+               n1, n0, n2, n, nFilters, solverNames[s], p, b, d, nit, it, stage, ms, vps, gbs,
+               skip ? ",\"skipped\":\"" : "", skip ? skip : "", skip ? "\"" : "");
+    else
+        printf("%d,%d,%d,%.0f,%d,%s,%s,%s,%s,%d,%d,%s,%.4f,%.6g,%.6g,%s\n",
+               n1, n0, n2, n, nFilters, solverNames[s], p, b, d, nit, it, stage, ms, vps, gbs, skip ? skip : "");
+    fflush(stdout);
+}
+
+int main(int argc, char** argv)
+{
+    TOOL_OPTIONS opt;
+    std::vector<int> nFilters = {1, 2, 4};
+    int nit = 50, repeat = 3;
+
+    opt.sizes   = "128x128x97,256x256x211,512x512x128,2048x2048x397";
+    opt.solvers = {VSNR_SOLVER_FFT, VSNR_SOLVER_STENCIL, VSNR_SOLVER_LOWMEM};
+    opt.beta    = 10.0f;
+    opt.json    = false;
+
+    for (int a = 1; a < argc; a++) {
+        int t = tool_option(argc, argv, &a, &opt);
+        if (t < 0) { usage(); return 1; }
+        if (t > 0) continue;
+
+        const char* o = argv[a];
+        const char* v = (a + 1 < argc ? argv[++a] : NULL);
+        if (!v) { usage(); return 1; }
+
+        if      (strcmp(o, "--filters") == 0) nFilters = ints(v);
+        else if (strcmp(o, "--nit") == 0)     nit = atoi(v);
+        else if (strcmp(o, "--repeat") == 0)  repeat = atoi(v);
+        else if (strcmp(o, "--precision") == 0) {
+            int p = lookup(v, precisionNames, 3);
+            if (p < 0) { usage(); return 1; }
+            setPrecision(p);
+        } else if (strcmp(o, "--padding") == 0) {
+            int p = lookup(v, paddingNames, 3);
+            if (p < 0) { usage(); return 1; }
+            setPadding(p);
+        } else { usage(); return 1; }
+    }
+    if (repeat < 1) repeat = 1;
+
+    if (!opt.json)
+        printf("n1,n0,n2,voxels,filters,solver,precision,backend,padding,nit,iterations,stage,ms,voxels_per_s,gb_per_s,skipped\n");
+
+    for (const char* p = opt.sizes; *p; ) {
+        int n1, n0, n2;
+        if (!next_size(&p, &n0, &n1, &n2)) return 1;
+
+        size_t n = (size_t)n0*n1*n2;
+        float* u0 = (float*)malloc(n*sizeof(float));
+        float* u  = (float*)malloc(n*sizeof(float));
+
+        if (!u0 || !u) {
+            for (int f : nFilters)
+                for (int s : opt.solvers)
+                    row(opt.json, n0, n1, n2, f, s, 0, nit, "total", 0.0, 0.0, "host allocation failed");
+            free(u0);
+            free(u);
+            continue;
+        }
+        phantom(u0, n0, n1, n2);
+
+        for (int f : nFilters) {
+            std::vector<float> psis = filters(f);
+
+            for (int s : opt.solvers) {
+                double best[BENCH_STAGES];
+                int it = 0;
+                const char* skip = NULL;
+
+                setSolver(s);
+                for (int i = 0; i < BENCH_STAGES; i++) best[i] = HUGE_VAL;
+
+                for (int r = 0; r < repeat && !skip; r++) {
+                    double t[BENCH_STAGES];
+                    float times[VSNR_STAGE_COUNT];
+                    float primal, dual;
+
+                    t[0] = now();
+                    void* ctx = VSNR_3D_CREATE_CONTEXT(n0, n1, n2, 1.0f, 1.0f, 1.0f, getMaxBlocks());
+                    t[0] = now() - t[0];
+                    if (!ctx) { skip = "context allocation failed"; break; }
+
+                    t[6] = now();
+                    if (VSNR_3D_RUN_CONTEXT(ctx, psis.data(), (int)psis.size(), u0, nit, opt.beta, u, 1.0f) != 0) {
+                        VSNR_3D_DESTROY_CONTEXT(ctx);
+                        skip = "run failed";
+                        break;
+                    }
+                    t[6] = now() - t[6] + t[0];
+
+                    VSNR_3D_GET_CONTEXT_STATS(ctx, &it, &primal, &dual);
+                    VSNR_3D_GET_CONTEXT_TIMES(ctx, times);
+                    VSNR_3D_DESTROY_CONTEXT(ctx);
+
+                    t[1] = times[VSNR_STAGE_TRANSFER];
+                    t[2] = times[VSNR_STAGE_FILTERS];
+                    t[3] = times[VSNR_STAGE_SETUP];
+                    t[4] = times[VSNR_STAGE_ITERATIONS] / (it > 0 ? it : 1);
+                    t[5] = times[VSNR_STAGE_FINAL];
+
+                    for (int i = 0; i < BENCH_STAGES; i++)
+                        if (t[i] < best[i]) best[i] = t[i];
+                }
+
+                if (skip) {
+                    row(opt.json, n0, n1, n2, f, s, 0, nit, "total", 0.0, 0.0, skip);
+                    continue;
+                }
+
+                double bytes = (double)VSNR_3D_PEAK_MEMORY(n0, n1, n2, s);
+                for (int i = 0; i < BENCH_STAGES; i++)
+                    row(opt.json, n0, n1, n2, f, s, it, nit, stageNames[i], best[i], (i == 1 ? 2.0*n*sizeof(float) : bytes), NULL);
+            }
+        }
+
+        free(u0);
+        free(u);
+    }
+
+    return 0;
+}
@@ -0,0 +1,631 @@
+// ---------------------------------------------------- //
+//                                                      //
+//             VSNR 3D COMMAND LINE                     //
+//                                                      //
+// ---------------------------------------------------- //
+// Original Algorithm :                                 //
+//   Pierre WEISS, Jerome FEHRENBACH                    //
+// Developers :                                         //
+//   Pierre WEISS, Mogan GAUTHIER, Jean EYMERIE         //
+// ---------------------------------------------------- //
+
+/////////////////////////////////////////////////////////
+//  Denoises a raw or uncompressed TIFF stack without  //
+//  Fiji, with the text file of the plugin. Input and  //
+//  output files are memory-mapped : a float32 input   //
+//  is handed to the solver as it lies in the file and //
+//  the result is written in place in the output, so   //
+//  no extra copy of the volume is made on the host.   //
+/////////////////////////////////////////////////////////
+
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <chrono>
+#include "vsnr3d.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+
+// PARAMETERS
+// -------------------------------------------------------------------------
+
+// Settings of the text file, see readFile in VSNR_3D.java
+typedef struct {
+    int nit;
+    int nBlocks;   // 0 : getMaxBlocks
+    bool log;
+    float tol;
+    int accel;     // VSNR_ACCEL_*
+    std::vector<float> psis;
+} PARAMS;
+
+// Reads the text file of the plugin (same keys, one per line, unknown keys are ignored).
+// Backend, Solver, Precision and Padding are applied at once. Returns false if it cannot be read.
+static bool read_params(const char* path, PARAMS* p)
+{
+    FILE* f = fopen(path, "r");
+    char line[512], key[128], value[128];
+    char type[128] = "";
+    float level = 0, sigmaX = 0, sigmaY = 0, sigmaZ = 0, thetaX = 0, thetaY = 0;
+
+    if (!f) return false;
+
+    while (fgets(line, sizeof(line), f)) {
+        value[0] = 0;
+        if (sscanf(line, "%127s %127s", key, value) < 1) continue;
+
+        if      (!strcmp(key, "Iteration_Number:")) p->nit = atoi(value);
+        else if (!strcmp(key, "Num_Block:"))        p->nBlocks = (!strcmp(value, "auto") ? 0 : atoi(value));
+        else if (!strcmp(key, "Log:"))              p->log = !strcmp(value, "true");
+        else if (!strcmp(key, "Filter_Type:")) {
+            strcpy(type, value);
+            if (strcmp(type, "Dirac") && strcmp(type, "Gabor")) {
+                fclose(f);
+                return false;
+            }
+        }
+        else if (!strcmp(key, "Noise_Level:")) {
+            level = (float)atof(value);
+            if (!strcmp(type, "Dirac")) {
+                p->psis.push_back(0.0f);
+                p->psis.push_back(level);
+            }
+        }
+        else if (!strcmp(key, "sigmaX:")) sigmaX = (float)atof(value);
+        else if (!strcmp(key, "sigmaY:")) sigmaY = (float)atof(value);
+        else if (!strcmp(key, "sigmaZ:")) sigmaZ = (float)atof(value);
+        else if (!strcmp(key, "thetaX:")) thetaX = (float)atof(value);
+        else if (!strcmp(key, "thetaY:")) thetaY = (float)atof(value);
+        else if (!strcmp(key, "thetaZ:")) {
+            // the last key of a gabor
+            if (!strcmp(type, "Gabor")) {
+                float g[8] = {1.0f, level, sigmaX, sigmaY, sigmaZ, thetaX, thetaY, (float)atof(value)};
+                p->psis.insert(p->psis.end(), g, g + 8);
+            }
+        }
+        else if (!strcmp(key, "Backend:"))
+            setBackend(!strcmp(value, "gpu") ? VSNR_BACKEND_GPU : !strcmp(value, "cpu") ? VSNR_BACKEND_CPU : VSNR_BACKEND_AUTO);
+        else if (!strcmp(key, "Solver:"))
+            setSolver(!strcmp(value, "stencil") ? VSNR_SOLVER_STENCIL : !strcmp(value, "lowmem") ? VSNR_SOLVER_LOWMEM : VSNR_SOLVER_FFT);
+        else if (!strcmp(key, "Tolerance:"))
+            p->tol = (float)atof(value);
+        else if (!strcmp(key, "Acceleration:"))
+            p->accel = (!strcmp(value, "relax") ? VSNR_ACCEL_RELAX : !strcmp(value, "nesterov") ? VSNR_ACCEL_NESTEROV :
+                        !strcmp(value, "adaptive") ? VSNR_ACCEL_ADAPTIVE : VSNR_ACCEL_NONE);
+        else if (!strcmp(key, "Precision:"))
+            setPrecision(!strcmp(value, "half") ? VSNR_PRECISION_HALF : !strcmp(value, "bf16") ? VSNR_PRECISION_BF16 : VSNR_PRECISION_FLOAT);
+        else if (!strcmp(key, "Padding:"))
+            setPadding(!strcmp(value, "mirror") ? VSNR_PAD_MIRROR : !strcmp(value, "periodic") ? VSNR_PAD_PERIODIC : VSNR_PAD_NONE);
+    }
+
+    fclose(f);
+    return true;
+}
+
+
+// MAPPED FILES
+// -------------------------------------------------------------------------
+
+typedef struct {
+    uint8_t* data;
+    uint64_t size;
+#ifdef _WIN32
+    HANDLE file, map;
+#else
+    int file;
+#endif
+} MAPPING;
+
+// Maps a whole file for reading, or creates it with size bytes for writing. Returns false on failure.
+static bool map_file(const char* path, bool write, uint64_t size, MAPPING* m)
+{
+    memset(m, 0, sizeof(MAPPING));
+
+#ifdef _WIN32
+    LARGE_INTEGER s;
+
+    m->file = CreateFileA(path, write ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ, FILE_SHARE_READ, NULL,
+                          write ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (m->file == INVALID_HANDLE_VALUE) return false;
+
+    if (!write) {
+        if (!GetFileSizeEx(m->file, &s)) return false;
+        size = (uint64_t)s.QuadPart;
+    }
+    if (size == 0) return false;
+
+    // the mapping extends a new file to size
+    m->map = CreateFileMappingA(m->file, NULL, write ? PAGE_READWRITE : PAGE_READONLY, (DWORD)(size >> 32), (DWORD)size, NULL);
+    if (!m->map) return false;
+
+    m->data = (uint8_t*)MapViewOfFile(m->map, write ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, (SIZE_T)size);
+#else
+    struct stat s;
+    void* p;
+
+    m->file = open(path, write ? O_RDWR | O_CREAT | O_TRUNC : O_RDONLY, 0644);
+    if (m->file < 0) return false;
+
+    if (!write) {
+        if (fstat(m->file, &s) != 0) return false;
+        size = (uint64_t)s.st_size;
+    } else if (ftruncate(m->file, (off_t)size) != 0) {
+        return false;
+    }
+    if (size == 0) return false;
+
+    p = mmap(NULL, (size_t)size, write ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, m->file, 0);
+    if (p == MAP_FAILED) return false;
+    m->data = (uint8_t*)p;
+#endif
+
+    m->size = size;
+    return m->data != NULL;
+}
+
+// Unmaps a file (flushing it if it was written), a failed map_file is cleaned up as well
+static void unmap_file(MAPPING* m)
+{
+#ifdef _WIN32
+    if (m->data) UnmapViewOfFile(m->data);
+    if (m->map)  CloseHandle(m->map);
+    if (m->file && m->file != INVALID_HANDLE_VALUE) CloseHandle(m->file);
+#else
+    if (m->data) munmap(m->data, (size_t)m->size);
+    if (m->file > 0) close(m->file);
+#endif
+    memset(m, 0, sizeof(MAPPING));
+}
+
+
+// TIFF
+// -------------------------------------------------------------------------
+
+// Uncompressed grayscale stack : pixels of plane k, row-major, are made of the strips
+// strips[k] (offset, bytes) of the file. swap if the byte order is not the one of the host.
+typedef struct {
+    int width, height, depth;
+    int type;   // VSNR_TYPE_* of the input, the output is always float32
+    bool swap;
+    std::vector< std::vector< std::pair<uint64_t, uint64_t> > > strips;
+} STACK;
+
+static bool little_endian()
+{
+    uint16_t one = 1;
+    return *(uint8_t*)&one == 1;
+}
+
+// Reads an unsigned integer of bytes bytes at p, in the byte order of the file (big if be)
+static uint64_t get(const uint8_t* p, int bytes, bool be)
+{
+    uint64_t v = 0;
+
+    for (int i = 0 ; i < bytes ; ++i)
+        v |= (uint64_t)p[be ? bytes-1-i : i] << (8*i);
+    return v;
+}
+
+// Values of an IFD entry (SHORT, LONG or LONG8) at e, inline or at the offset it holds
+static bool entry_values(const MAPPING* m, const uint8_t* e, bool be, bool big, std::vector<uint64_t>& v)
+{
+    int type = (int)get(e + 2, 2, be);
+    int size = (type == 3 ? 2 : type == 4 ? 4 : type == 16 ? 8 : 0);
+    uint64_t count = get(e + 4, big ? 8 : 4, be);
+    const uint8_t* p = e + (big ? 12 : 8);
+
+    if (!size) return false;
+
+    if (count * size > (uint64_t)(big ? 8 : 4)) {
+        uint64_t o = get(p, big ? 8 : 4, be);
+        if (o + count * size > m->size) return false;
+        p = m->data + o;
+    }
+
+    v.resize((size_t)count);
+    for (uint64_t i = 0 ; i < count ; ++i)
+        v[i] = get(p + i*size, size, be);
+    return true;
+}
+
+// Parses the IFDs of a classic or BigTIFF file. ImageJ stacks above 4 GB only have the IFD of the
+// first plane and "images=N" in their description, their planes are contiguous.
+static bool read_tiff(const MAPPING* m, STACK* s)
+{
+    const uint8_t* d = m->data;
+    bool be, big;
+    uint64_t ifd;
+    int images = 0;
+
+    if (m->size < 16 || !(d[0] == d[1] && (d[0] == 'I' || d[0] == 'M'))) return false;
+    be  = (d[0] == 'M');
+    big = (get(d + 2, 2, be) == 43);
+    ifd = (big ? get(d + 8, 8, be) : get(d + 4, 4, be));
+
+    s->depth = 0;
+    s->swap  = (be == little_endian());
+
+    while (ifd) {
+        uint64_t count = (ifd + 8 <= m->size ? get(d + ifd, big ? 8 : 2, be) : 0);
+        int entry = (big ? 20 : 12);
+        const uint8_t* e = d + ifd + (big ? 8 : 2);
+        int width = 0, height = 0, bits = 0, format = 1, compression = 1, spp = 1;
+        std::vector<uint64_t> offsets, bytes, v;
+
+        if (!count || ifd + (big ? 16 : 6) + count*entry > m->size) return false;
+
+        for (uint64_t i = 0 ; i < count ; ++i, e += entry) {
+            int tag = (int)get(e, 2, be);
+
+            if (tag == 270 && s->depth == 0) {
+                // ImageDescription (ASCII), only the images= of ImageJ is used
+                uint64_t n = get(e + 4, big ? 8 : 4, be);
+                uint64_t o = (n > (uint64_t)(big ? 8 : 4) ? get(e + (big ? 12 : 8), big ? 8 : 4, be) : (uint64_t)(e + (big ? 12 : 8) - d));
+                std::string text((const char*)d + MIN(o, m->size), (size_t)MIN(n, m->size - MIN(o, m->size)));
+                size_t at = text.find("images=");
+                if (text.compare(0, 7, "ImageJ=") == 0 && at != std::string::npos) images = atoi(text.c_str() + at + 7);
+                continue;
+            }
+            if (tag != 256 && tag != 257 && tag != 258 && tag != 259 && tag != 273 && tag != 277 && tag != 279 && tag != 339) continue;
+            if (!entry_values(m, e, be, big, v) || v.empty()) return false;
+
+            if      (tag == 256) width       = (int)v[0];
+            else if (tag == 257) height      = (int)v[0];
+            else if (tag == 258) bits        = (int)v[0];
+            else if (tag == 259) compression = (int)v[0];
+            else if (tag == 273) offsets     = v;
+            else if (tag == 277) spp         = (int)v[0];
+            else if (tag == 279) bytes       = v;
+            else if (tag == 339) format      = (int)v[0];
+        }
+
+        if (compression != 1 || spp != 1 || offsets.empty() || offsets.size() != bytes.size()) return false;
+
+        int type = (bits == 32 && format == 3 ? VSNR_TYPE_FLOAT32 : bits == 16 && format == 1 ? VSNR_TYPE_UINT16 : bits == 8 && format == 1 ? VSNR_TYPE_UINT8 : -1);
+        if (type < 0) return false;
+
+        if (s->depth == 0) {
+            s->width  = width;
+            s->height = height;
+            s->type   = type;
+        } else if (width != s->width || height != s->height || type != s->type) {
+            return false;
+        }
+
+        s->strips.push_back(std::vector< std::pair<uint64_t, uint64_t> >());
+        for (size_t i = 0 ; i < offsets.size() ; ++i) {
+            if (offsets[i] + bytes[i] > m->size) return false;
+            s->strips.back().push_back(std::make_pair(offsets[i], bytes[i]));
+        }
+        s->depth++;
+
+        ifd = get(e, big ? 8 : 4, be);
+    }
+
+    // contiguous planes of an ImageJ stack written with a single IFD
+    if (s->depth == 1 && images > 1 && s->strips[0].size() == 1) {
+        uint64_t plane = (uint64_t)s->width * s->height * (s->type == VSNR_TYPE_FLOAT32 ? 4 : s->type == VSNR_TYPE_UINT16 ? 2 : 1);
+        uint64_t o = s->strips[0][0].first;
+
+        if (o + images*plane > m->size) return false;
+        for (int k = 1 ; k < images ; ++k)
+            s->strips.push_back(std::vector< std::pair<uint64_t, uint64_t> >(1, std::make_pair(o + k*plane, plane)));
+        s->depth = images;
+    }
+
+    return s->depth > 0 && s->width > 0 && s->height > 0;
+}
+
+// True if the planes follow each other in the file, the whole volume then starts at *offset (0 included)
+static bool contiguous(const STACK* s, uint64_t plane, uint64_t* offset)
+{
+    uint64_t o = s->strips[0][0].first;
+
+    for (int k = 0 ; k < s->depth ; ++k) {
+        uint64_t next = o + k*plane;
+        for (size_t i = 0 ; i < s->strips[k].size() ; ++i) {
+            if (s->strips[k][i].first != next) return false;
+            next += s->strips[k][i].second;
+        }
+        if (next != o + (k+1)*plane) return false;
+    }
+
+    *offset = o;
+    return true;
+}
+
+// Little-endian (host) float32 TIFF of width x height x depth, one strip per plane : header, pixels at
+// the returned offset, then the IFDs. BigTIFF when it does not fit in 4 GB. Returns the file size.
+static uint64_t tiff_layout(int width, int height, int depth, bool* big, uint64_t* pixels)
+{
+    uint64_t plane = (uint64_t)width*height*sizeof(float);
+    uint64_t classic = 8 + depth*plane + (uint64_t)depth*(2 + 10*12 + 4);
+
+    *big    = (classic > 0xFFFFFFFFull);
+    *pixels = (*big ? 16 : 8);
+    return *pixels + depth*plane + (uint64_t)depth*(*big ? 8 + 10*20 + 8 : 2 + 10*12 + 4);
+}
+
+static void put(uint8_t* p, uint64_t v, int bytes)
+{
+    for (int i = 0 ; i < bytes ; ++i)
+        p[i] = (uint8_t)(v >> (8*i));
+}
+
+// Writes the header and the IFDs of tiff_layout in the mapped output
+static void write_tiff(MAPPING* m, int width, int height, int depth, bool big, uint64_t pixels)
+{
+    uint64_t plane = (uint64_t)width*height*sizeof(float);
+    uint64_t ifd = pixels + depth*plane;
+    int o = (big ? 8 : 4), entry = (big ? 20 : 12);
+    uint8_t* d = m->data;
+
+    d[0] = d[1] = 'I';
+    put(d + 2, big ? 43 : 42, 2);
+    if (big) {
+        put(d + 4, 8, 2);
+        put(d + 6, 0, 2);
+    }
+    put(d + o, ifd, o);
+
+    for (int k = 0 ; k < depth ; ++k) {
+        // tag, type (3 SHORT, 4 LONG, 16 LONG8), value
+        uint64_t tags[10][3] = {
+            {256, 4, (uint64_t)width}, {257, 4, (uint64_t)height}, {258, 3, 32}, {259, 3, 1}, {262, 3, 1},
+            {273, (uint64_t)(big ? 16 : 4), pixels + k*plane}, {277, 3, 1}, {278, 4, (uint64_t)height},
+            {279, (uint64_t)(big ? 16 : 4), plane}, {339, 3, 3}};
+        uint8_t* e = d + ifd + (big ? 8 : 2);
+        uint64_t next = ifd + (big ? 8 + 10*20 + 8 : 2 + 10*12 + 4);
+
+        put(d + ifd, 10, big ? 8 : 2);
+        for (int i = 0 ; i < 10 ; ++i, e += entry) {
+            memset(e, 0, entry);
+            put(e, tags[i][0], 2);
+            put(e + 2, tags[i][1], 2);
+            put(e + 4, 1, o);
+            put(e + 4 + o, tags[i][2], tags[i][1] == 3 ? 2 : tags[i][1] == 4 ? 4 : 8);
+        }
+        put(e, k == depth-1 ? 0 : next, o);
+        ifd = next;
+    }
+}
+
+
+// SAMPLES
+// -------------------------------------------------------------------------
+
+// Converts count samples of type at src to float at dst (log(1 + v) if log)
+static void convert(const uint8_t* src, float* dst, uint64_t count, int type, bool swap, bool log)
+{
+    for (uint64_t i = 0 ; i < count ; ++i) {
+        float v;
+
+        if (type == VSNR_TYPE_UINT8) {
+            v = src[i];
+        } else if (type == VSNR_TYPE_UINT16) {
+            uint16_t s;
+            memcpy(&s, src + 2*i, 2);
+            if (swap) s = (uint16_t)((s >> 8) | (s << 8));
+            v = s;
+        } else {
+            uint32_t s;
+            memcpy(&s, src + 4*i, 4);
+            if (swap) s = (s >> 24) | ((s >> 8) & 0xFF00) | ((s << 8) & 0xFF0000) | (s << 24);
+            memcpy(&v, &s, 4);
+        }
+        dst[i] = (log ? logf(1.0f + v) : v);
+    }
+}
+
+static int sample_size(int type)
+{
+    // -
+    return (type == VSNR_TYPE_FLOAT32 ? 4 : type == VSNR_TYPE_UINT16 ? 2 : 1);
+}
+
+static bool is_tiff(const char* path)
+{
+    size_t n = strlen(path);
+    return (n > 4 && !strcmp(path + n - 4, ".tif")) || (n > 5 && !strcmp(path + n - 5, ".tiff"));
+}
+
+// Parses "a,b,c" into 3 floats
+static bool floats3(const char* s, float* v)
+{
+    // -
+    return sscanf(s, "%f,%f,%f", &v[0], &v[1], &v[2]) == 3;
+}
+
+static void usage()
+{
+    fprintf(stderr,
+        "usage: vsnr3d_cli -p params.txt -i input -o output [options]\n"
+        "  -p FILE             parameters, same text file as the plugin (filters, Iteration_Number, Log, Backend,\n"
+        "                      Solver, Tolerance, Acceleration, Precision, Padding; sBlock and dBlock are ignored)\n"
+        "  -i FILE             uncompressed grayscale TIFF stack (.tif, .tiff: 8, 16 bits or float) or raw volume\n"
+        "  -o FILE             float32 TIFF stack (.tif, .tiff) or raw float32 volume\n"
+        "  --size WxHxD        size of a raw input, W fastest (required for raw)\n"
+        "  --type T            samples of a raw input: float32 (default), uint16 or uint8, host byte order\n"
+        "  --offset B          bytes to skip at the start of a raw input (default 0)\n"
+        "  --spacing X,Y,Z     voxel size, only the ratios matter (default 1,1,1)\n"
+        "  --beta B            ADMM penalty (default 10)\n"
+        "\n"
+        "Values are denoised as they are (\"Log: true\" works on log(1 + v) like the plugin). An input in the host\n"
+        "byte order with its planes contiguous is read straight from the mapped file, 8 and 16 bits samples are\n"
+        "widened to float by the library.\n");
+}
+
+int main(int argc, char** argv)
+{
+    const char *paramsPath = NULL, *input = NULL, *output = NULL;
+    int width = 0, height = 0, depth = 0, type = VSNR_TYPE_FLOAT32;
+    uint64_t offset = 0;
+    float spacing[3] = {1.0f, 1.0f, 1.0f};
+    float beta = 10.0f;
+    PARAMS p;
+    STACK s;
+    MAPPING in, out;
+
+    p.nit     = 20;
+    p.nBlocks = 0;
+    p.log     = false;
+    p.tol     = 0;
+    p.accel   = VSNR_ACCEL_NONE;
+
+    for (int a = 1; a < argc; a++) {
+        const char* o = argv[a];
+        const char* v = (a + 1 < argc ? argv[a+1] : NULL);
+
+        if (!v) { usage(); return 1; }
+        a++;
+
+        if      (strcmp(o, "-p") == 0)        paramsPath = v;
+        else if (strcmp(o, "-i") == 0)        input = v;
+        else if (strcmp(o, "-o") == 0)        output = v;
+        else if (strcmp(o, "--offset") == 0)  offset = strtoull(v, NULL, 10);
+        else if (strcmp(o, "--beta") == 0)    beta = (float)atof(v);
+        else if (strcmp(o, "--size") == 0) {
+            if (sscanf(v, "%dx%dx%d", &width, &height, &depth) != 3) { usage(); return 1; }
+        } else if (strcmp(o, "--type") == 0) {
+            type = (!strcmp(v, "float32") ? VSNR_TYPE_FLOAT32 : !strcmp(v, "uint16") ? VSNR_TYPE_UINT16 : !strcmp(v, "uint8") ? VSNR_TYPE_UINT8 : -1);
+            if (type < 0) { usage(); return 1; }
+        } else if (strcmp(o, "--spacing") == 0) {
+            if (!floats3(v, spacing) || MIN(MIN(spacing[0], spacing[1]), spacing[2]) <= 0) { usage(); return 1; }
+        } else { usage(); return 1; }
+    }
+    if (!paramsPath || !input || !output) { usage(); return 1; }
+
+    // 1. Parameters
+    if (!read_params(paramsPath, &p) || p.psis.empty()) {
+        fprintf(stderr, "%s: no filter, or not a parameter file of the plugin\n", paramsPath);
+        return 1;
+    }
+    if (p.nBlocks <= 0) p.nBlocks = getMaxBlocks();
+
+    // 2. Input, the planes of a raw volume are its only strip
+    if (!map_file(input, false, 0, &in)) {
+        fprintf(stderr, "%s: cannot be mapped\n", input);
+        unmap_file(&in);
+        return 1;
+    }
+
+    if (is_tiff(input)) {
+        if (!read_tiff(&in, &s)) {
+            fprintf(stderr, "%s: not an uncompressed grayscale TIFF stack\n", input);
+            unmap_file(&in);
+            return 1;
+        }
+    } else {
+        uint64_t plane = (uint64_t)width*height*sample_size(type);
+
+        if (width < 1 || height < 1 || depth < 1 || offset + depth*plane > in.size) {
+            fprintf(stderr, "%s: --size (and --type, --offset) do not match the file\n", input);
+            unmap_file(&in);
+            return 1;
+        }
+        s.width  = width;
+        s.height = height;
+        s.depth  = depth;
+        s.type   = type;
+        s.swap   = false;
+        for (int k = 0 ; k < depth ; ++k)
+            s.strips.push_back(std::vector< std::pair<uint64_t, uint64_t> >(1, std::make_pair(offset + k*plane, plane)));
+    }
+
+    // 3. Output, mapped before the solve so that the result is written in place
+    long long n = (long long)s.width*s.height*s.depth;
+    uint64_t plane = (uint64_t)s.width*s.height*sample_size(s.type);
+    uint64_t pixels = 0, size = n*sizeof(float);
+    bool big = false;
+
+    if (is_tiff(output)) size = tiff_layout(s.width, s.height, s.depth, &big, &pixels);
+
+    if (!map_file(output, true, size, &out)) {
+        fprintf(stderr, "%s: cannot be created (%llu bytes)\n", output, (unsigned long long)size);
+        unmap_file(&out);
+        unmap_file(&in);
+        return 1;
+    }
+    if (is_tiff(output)) write_tiff(&out, s.width, s.height, s.depth, big, pixels);
+
+    float* u = (float*)(out.data + pixels);
+    const void* u0 = u;
+    int samples = VSNR_TYPE_FLOAT32;
+    uint64_t at = 0;
+    float max = -INFINITY;
+
+    // samples in the host order as they lie in the file (8 and 16 bits are widened by the library), anything
+    // else converted into the output
+    if (!s.swap && !p.log && contiguous(&s, plane, &at) && at % sample_size(s.type) == 0) {
+        u0 = in.data + at;
+        samples = s.type;
+    } else {
+        float* dst = u;
+        for (int k = 0 ; k < s.depth ; ++k) {
+            for (size_t i = 0 ; i < s.strips[k].size() ; ++i) {
+                uint64_t count = s.strips[k][i].second / sample_size(s.type);
+                convert(in.data + s.strips[k][i].first, dst, count, s.type, s.swap, p.log);
+                dst += count;
+            }
+        }
+    }
+
+    for (long long i = 0 ; i < n ; ++i) {
+        float v = (samples == VSNR_TYPE_UINT16 ? ((const uint16_t*)u0)[i] : samples == VSNR_TYPE_UINT8 ? ((const uint8_t*)u0)[i] : ((const float*)u0)[i]);
+        max = MAX(max, v);
+    }
+
+    // 4. Denoises (n0 = height, n1 = width, n2 = depth as in the plugin)
+    float h = MIN(MIN(spacing[0], spacing[1]), spacing[2]);
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    void* ctx = VSNR_3D_CREATE_CONTEXT(s.height, s.width, s.depth, spacing[0] / h, spacing[1] / h, spacing[2] / h, p.nBlocks);
+    int ret = 0;
+
+    if (!ctx) {
+        fprintf(stderr, "not enough memory for a %dx%dx%d volume (%lld MB)\n", s.width, s.height, s.depth,
+                VSNR_3D_PEAK_MEMORY(s.height, s.width, s.depth, getSolver()) >> 20);
+        ret = 1;
+    } else if (VSNR_3D_SET_CONTEXT_ACCELERATION(ctx, p.accel, 1.6f) != 0) {
+        fprintf(stderr, "not enough memory for \"Acceleration: nesterov\"\n");
+        ret = 1;
+    } else {
+        int it;
+        float primal, dual;
+
+        VSNR_3D_SET_CONTEXT_TOLERANCE(ctx, p.tol, 10);
+        if (VSNR_3D_RUN_CONTEXT_TYPED(ctx, p.psis.data(), (int)p.psis.size(), u0, samples, p.nit, beta, u, VSNR_TYPE_FLOAT32, max, 0) != 0) {
+            fprintf(stderr, "%dx%dx%d : the run failed\n", s.width, s.height, s.depth);
+            ret = 1;
+        } else {
+            VSNR_3D_GET_CONTEXT_STATS(ctx, &it, &primal, &dual);
+
+            if (p.log)
+                for (long long i = 0 ; i < n ; ++i) u[i] = expf(u[i]) - 1.0f;
+
+            fprintf(stderr, "%dx%dx%d : %d iterations (primal %g, dual %g), %.1f s\n", s.width, s.height, s.depth, it, primal, dual,
+                    std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count());
+        }
+    }
+    VSNR_3D_DESTROY_CONTEXT(ctx);
+
+    unmap_file(&out);
+    unmap_file(&in);
+    if (ret) remove(output);
+    return ret;
+}
@@ -0,0 +1,1356 @@
+
+
+// ---------------------------------------------------- //
+//                                                      //
+//             VSNR 3D CPU BACKEND (FFTW/OpenMP)        //
+//                                                      //
+// ---------------------------------------------------- //
+// Original Algorithm :                                 //
+//   Pierre WEISS, Jerome FEHRENBACH                    //
+// Developers :                                         //
+//   Pierre WEISS, Mogan GAUTHIER, Jean EYMERIE         //
+// ---------------------------------------------------- //
+
+/////////////////////////////////////////////////////////
+//  Host implementation of vsnr3d.cu for machines      //
+//  without an NVIDIA card. Same row-major layout,     //
+//  same unnormalized transforms as cuFFT. The         //
+//  settings and the control of the iterations are     //
+//  those of the GPU engine, see vsnr_admm.h.          //
+/////////////////////////////////////////////////////////
+
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <omp.h>
+#include <fftw3.h>
+#include <atomic>
+#include <mutex>
+#include "vsnr3d.h"
+
+#define PI (3.141592653589793)
+
+#define SQ(a) ((a)*(a))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+typedef struct { float x, y; } CpC; // same layout as cufftComplex / fftwf_complex
+typedef float                  CpR;
+
+#define CPU_MARK_COUNT (VSNR_STAGE_COUNT+2) // boundaries of the stages of a run, the transfer in and out being apart
+
+
+// THREADS
+// -------------------------------------------------------------------------
+
+
+static std::mutex planner;           // the FFTW planner is not thread-safe, execution is
+static int budget = 0;               // OpenMP threads of the process, read by the first plan_fft
+static std::atomic<int> running(0);  // runs in progress in all the threads
+
+// Gives the calling thread its share of the budget for its next parallel loops and FFTs (see fftw_jobs),
+// so that runs started by several host threads split the cores instead of oversubscribing them.
+// Called every iteration, the share grows back as the other runs end.
+static void share_threads()
+{
+    // -
+    omp_set_num_threads(MAX(budget / MAX((int)running, 1), 1));
+}
+
+// Runs the njobs of a multi-threaded FFTW execution as an OpenMP loop of the calling thread instead of
+// FFTW's own threads : the plans are made for the whole budget, the transforms of a run use its share.
+static void fftw_jobs(void* (*work)(char*), char* jobdata, size_t elsize, int njobs, void* data)
+{
+    #pragma omp parallel for
+    for (int i = 0 ; i < njobs ; ++i)
+        work(jobdata + elsize*i);
+}
+
+
+// FFT
+// -------------------------------------------------------------------------
+
+
+// Plans a 3D R2C / C2R pair on the cuFFT dimension order (n2, n0, n1)
+static void plan_fft(fftwf_plan* planR2C, fftwf_plan* planC2R, int n0, int n1, int n2, CpR* r, CpC* c)
+{
+    std::lock_guard<std::mutex> guard(planner);
+
+    if (!budget) {
+        fftwf_init_threads();
+        fftwf_threads_set_callback(fftw_jobs, NULL);
+        budget = omp_get_max_threads();
+    }
+    fftwf_plan_with_nthreads(budget);
+
+    *planR2C = fftwf_plan_dft_r2c_3d(n2, n0, n1, r, (fftwf_complex*)c, FFTW_ESTIMATE);
+    *planC2R = fftwf_plan_dft_c2r_3d(n2, n0, n1, (fftwf_complex*)c, r, FFTW_ESTIMATE);
+}
+
+// Executes the R2C plan on new arrays (all buffers come from fftwf_malloc), counted and timed in prof
+static void fft_r2c(VSNR_PROFILE* prof, fftwf_plan plan, CpR* in, CpC* out)
+{
+    double t0 = omp_get_wtime();
+
+    fftwf_execute_dft_r2c(plan, in, (fftwf_complex*)out);
+    prof->fftMs += 1e3 * (omp_get_wtime() - t0);
+    prof->ffts++;
+}
+
+// Executes the C2R plan on new arrays, in is destroyed
+static void fft_c2r(VSNR_PROFILE* prof, fftwf_plan plan, CpC* in, CpR* out)
+{
+    double t0 = omp_get_wtime();
+
+    fftwf_execute_dft_c2r(plan, (fftwf_complex*)in, out);
+    prof->fftMs += 1e3 * (omp_get_wtime() - t0);
+    prof->ffts++;
+}
+
+
+// -------------------------------------------------------------------------
+
+
+// Computes out = u1.*u2
+static void product_carray(CpC* u1, CpC* u2, CpC* out, long n)
+{
+    #pragma omp parallel for
+    for (long i = 0 ; i < n ; ++i) {
+        float re = (u1[i].x * u2[i].x) - (u1[i].y * u2[i].y);
+        float im = (u1[i].y * u2[i].x) + (u1[i].x * u2[i].y);
+        out[i].x = re;
+        out[i].y = im;
+    }
+}
+
+// Computes out = u1.*u2, u1 real (filter spectra)
+static void product_rarray(float* u1, CpC* u2, CpC* out, long n)
+{
+    #pragma omp parallel for
+    for (long i = 0 ; i < n ; ++i) {
+        out[i].x = u1[i] * u2[i].x;
+        out[i].y = u1[i] * u2[i].y;
+    }
+}
+
+// Normalize an array
+static void normalize(CpR* u, long n)
+{
+    #pragma omp parallel for
+    for (long i = 0 ; i < n ; ++i)
+        u[i] = u[i] / (float)n;
+}
+
+// Index in [0, v) of the index i of the padded axis, see pad_index in vsnr3d.cu
+static long pad_index(long i, long v, int pad)
+{
+    if (pad == VSNR_PAD_PERIODIC) return i % v;
+
+    i = i % (2*v);
+    return (i < v ? i : 2*v-1-i);
+}
+
+// Sample of an output volume, see store_sample in vsnr3d.cu
+static inline void store_sample(float* u, long c, float v)          { u[c] = v; }
+static inline void store_sample(unsigned char* u, long c, float v)  { u[c] = (unsigned char)fminf(fmaxf(rintf(v), 0.0f), 255.0f); }
+static inline void store_sample(unsigned short* u, long c, float v) { u[c] = (unsigned short)fminf(fmaxf(rintf(v), 0.0f), 65535.0f); }
+
+// up = (u + offset)/max, the v0 x v1 x v2 volume u being extended to the n0 x n1 x n2 grid of up (the same grid
+// with VSNR_PAD_NONE)
+template<typename T>
+static void pad_volume(const T* u, int v0, int v1, int v2, CpR* up, int n0, int n1, int n2, int pad, float max, float offset)
+{
+    #pragma omp parallel for
+    for (long k = 0 ; k < n2 ; ++k)
+    for (long i = 0 ; i < n0 ; ++i) {
+        const T* row = u + (pad_index(k, v2, pad)*v0 + pad_index(i, v0, pad))*v1;
+        CpR* out = up + (k*n0 + i)*n1;
+        if (pad == VSNR_PAD_NONE) {
+            for (long j = 0 ; j < n1 ; ++j)
+                out[j] = ((float)row[j] + offset) / max;
+        } else {
+            for (long j = 0 ; j < n1 ; ++j)
+                out[j] = ((float)row[pad_index(j, v1, pad)] + offset) / max;
+        }
+    }
+}
+
+// u = (u0 - w/n)*max - offset on the v0 x v1 x v2 corner of the n0 x n1 x n2 grids u0 and w, see crop_volume in vsnr3d.cu
+template<typename T>
+static void crop_volume(const CpR* u0, const CpR* w, int n0, int n1, int n2, T* u, int v0, int v1, int v2, float max, float offset)
+{
+    long n = (long)n0*n1*n2;
+
+    #pragma omp parallel for
+    for (long k = 0 ; k < v2 ; ++k)
+    for (long i = 0 ; i < v0 ; ++i) {
+        const CpR* row0 = u0 + (k*n0 + i)*n1;
+        const CpR* roww = w + (k*n0 + i)*n1;
+        T* out = u + (k*v0 + i)*v1;
+        for (long j = 0 ; j < v1 ; ++j)
+            store_sample(out, j, (row0[j] - roww[j] / (float)n) * max - offset);
+    }
+}
+
+// Spectra of the finite differences, see fd_value in vsnr_engine.cuh
+// fft(dk)[f] = (1 - exp(2i pi f / nk)) / h, 1 / h on a singleton axis.
+
+// Returns fft(dk)[f]
+static inline CpC fd_value(long f, int nk, float h)
+{
+    CpC fd;
+
+    if (nk > 1) {
+        fd.x = 2.0 * SQ(sinf(PI * f / nk)) / h; // 1 - cos = 2 sin^2
+        fd.y = -sinf(2.0 * PI * f / nk) / h;
+    } else {
+        fd.x = 1.0 / h;
+        fd.y = 0.0;
+    }
+    return fd;
+}
+
+// Returns |fft(dk)[f]|
+static inline float fd_norm(long f, int nk, float h)
+{
+    // -
+    return (nk > 1 ? 2.0 * fabsf(sinf(PI * f / nk)) : 1.0) / h;
+}
+
+// Compute Phi : fphik = fdk .* fpsi, fphi = |fphi1|^2 + |fphi2|^2 + |fphi3|^2 (fpsi and fphi real), see compute_phi in vsnr_engine.cuh
+static void compute_phi(float* fpsi, CpC* fphi1, CpC* fphi2, CpC* fphi3, float* fphi, int n0, int n1, int n2, float dx, float dy, float dz)
+{
+    long h1 = n1/2+1;
+    long m  = (long)n0*n2*h1;
+
+    #pragma omp parallel for
+    for (long i = 0 ; i < m ; ++i) {
+        CpC fd1 = fd_value( i % h1,       n1, dx);
+        CpC fd2 = fd_value((i / h1) % n0, n0, dy);
+        CpC fd3 = fd_value( i / (h1*n0),  n2, dz);
+
+        fphi1[i].x = fd1.x * fpsi[i];
+        fphi1[i].y = fd1.y * fpsi[i];
+        fphi2[i].x = fd2.x * fpsi[i];
+        fphi2[i].y = fd2.y * fpsi[i];
+        fphi3[i].x = fd3.x * fpsi[i];
+        fphi3[i].y = fd3.y * fpsi[i];
+
+        fphi[i] = SQ(fphi1[i].x) + SQ(fphi1[i].y) + SQ(fphi2[i].x) + SQ(fphi2[i].y) + SQ(fphi3[i].x) + SQ(fphi3[i].y);
+    }
+}
+
+// fphi = |fd1|^2 + |fd2|^2 + |fd3|^2, i.e. sum_k |fphik|^2 = fpsi^2 fphi without storing fphik (stencil solvers)
+static void compute_phi_psi(float* fphi, int n0, int n1, int n2, float dx, float dy, float dz)
+{
+    long h1 = n1/2+1;
+    long m  = (long)n0*n2*h1;
+
+    #pragma omp parallel for
+    for (long i = 0 ; i < m ; ++i) {
+        fphi[i] = SQ(fd_norm( i % h1,       n1, dx)) +
+                  SQ(fd_norm((i / h1) % n0, n0, dy)) +
+                  SQ(fd_norm( i / (h1*n0),  n2, dz));
+    }
+}
+
+// Computes tmpi = -lambdai + beta * yi
+static void betay_m_lambda(CpR* l1, CpR* l2, CpR* l3, CpR* y1, CpR* y2, CpR* y3, CpR* tmp1, CpR* tmp2, CpR* tmp3, float beta, long n)
+{
+    #pragma omp parallel for
+    for (long i = 0 ; i < n ; ++i) {
+        tmp1[i] = (beta * y1[i]) - l1[i];
+        tmp2[i] = (beta * y2[i]) - l2[i];
+        tmp3[i] = (beta * y3[i]) - l3[i];
+    }
+}
+
+// Computes w = conj(u) * v
+static void conju_x_v(CpC* u, CpC* v, CpC* w, long n)
+{
+    #pragma omp parallel for
+    for (long i = 0 ; i < n ; ++i) {
+        float a1 = u[i].x;
+        float b1 = u[i].y;
+        float a2 = v[i].x;
+        float b2 = v[i].y;
+        w[i].x = (a1 * a2) + (b1 * b2);
+        w[i].y = (b2 * a1) - (b1 * a2);
+    }
+}
+
+// fx = (ftmp1 + ftmp2 + ftmp3) / (1 + beta*fphi);
+static void update_fx(CpC* ftmp1, CpC* ftmp2, CpC* ftmp3, float* fphi, CpC* fx, float beta, long n)
+{
+    #pragma omp parallel for
+    for (long i = 0 ; i < n ; ++i) {
+        float d = 1 + beta*fphi[i];
+        fx[i].x = (ftmp1[i].x + ftmp2[i].x + ftmp3[i].x) / d;
+        fx[i].y = (ftmp1[i].y + ftmp2[i].y + ftmp3[i].y) / d;
+    }
+}
+
+// -
+// Adds the residual terms of a voxel to v, see add_residuals in vsnr_engine.cuh
+static inline void add_residuals(float* v, float a1, float a2, float a3, float y1, float y2, float y3, float p1, float p2, float p3, float l1, float l2, float l3)
+{
+    v[0] += SQ(a1 - y1) + SQ(a2 - y2) + SQ(a3 - y3);
+    v[1] += SQ(y1 - p1) + SQ(y2 - p2) + SQ(y3 - p3);
+    v[2] += SQ(a1) + SQ(a2) + SQ(a3);
+    v[3] += SQ(y1) + SQ(y2) + SQ(y3);
+    v[4] += SQ(l1) + SQ(l2) + SQ(l3);
+}
+
+// res = (r0, ..., r4) unless res is NULL
+static void set_residuals(double* res, double r0, double r1, double r2, double r3, double r4)
+{
+    if (!res) return;
+    res[0] = r0;
+    res[1] = r1;
+    res[2] = r2;
+    res[3] = r3;
+    res[4] = r4;
+}
+
+// Ax (tmp) is relaxed in place by alpha, see update_y in vsnr_engine.cuh
+static void update_y(CpR* d1u0, CpR* d2u0, CpR* d3u0, CpR* tmp1, CpR* tmp2, CpR* tmp3, CpR* l1, CpR* l2, CpR* l3, CpR* y1, CpR* y2, CpR* y3, float beta, float alpha, long n, double* res)
+{
+    double r0 = 0, r1 = 0, r2 = 0, r3 = 0, r4 = 0;
+
+    #pragma omp parallel for reduction(+:r0,r1,r2,r3,r4)
+    for (long i = 0 ; i < n ; ++i) {
+        float v[VSNR_RES_SIZE] = {0, 0, 0, 0, 0};
+        float p1 = y1[i], p2 = y2[i], p3 = y3[i];
+        float a1 = tmp1[i], a2 = tmp2[i], a3 = tmp3[i];
+        tmp1[i] = (alpha * a1) + ((1.0f - alpha) * p1);
+        tmp2[i] = (alpha * a2) + ((1.0f - alpha) * p2);
+        tmp3[i] = (alpha * a3) + ((1.0f - alpha) * p3);
+        float t1 = d1u0[i] - (tmp1[i] + (l1[i] / beta));
+        float t2 = d2u0[i] - (tmp2[i] + (l2[i] / beta));
+        float t3 = d3u0[i] - (tmp3[i] + (l3[i] / beta));
+        float ng = sqrtf(SQ(t1) + SQ(t2) + SQ(t3));
+
+        if (ng > 1.0 / beta) {
+            y1[i] = d1u0[i] - t1 * (1.0 - (1.0 / (beta * ng)));
+            y2[i] = d2u0[i] - t2 * (1.0 - (1.0 / (beta * ng)));
+            y3[i] = d3u0[i] - t3 * (1.0 - (1.0 / (beta * ng)));
+        } else {
+            y1[i] = d1u0[i];
+            y2[i] = d2u0[i];
+            y3[i] = d3u0[i];
+        }
+
+        if (res) {
+            add_residuals(v, a1, a2, a3, y1[i], y2[i], y3[i], p1, p2, p3,
+                          l1[i] + (beta * (tmp1[i] - y1[i])),
+                          l2[i] + (beta * (tmp2[i] - y2[i])),
+                          l3[i] + (beta * (tmp3[i] - y3[i])));
+            r0 += v[0]; r1 += v[1]; r2 += v[2]; r3 += v[3]; r4 += v[4];
+        }
+    }
+
+    set_residuals(res, r0, r1, r2, r3, r4);
+}
+
+// -
+static void update_lambda(CpR* lambda, CpR* tmp, CpR* y, float beta, long n)
+{
+    #pragma omp parallel for
+    for (long i = 0 ; i < n ; ++i)
+        lambda[i] = lambda[i] + (beta * (tmp[i] - y[i]));
+}
+
+// Fast ADMM step, gamma < 0 (restart) sets y back to yp, see extrapolate in vsnr_engine.cuh
+static void extrapolate(CpR* y, CpR* yp, float gamma, long n)
+{
+    if (gamma < 0) {
+        memcpy(y, yp, n*sizeof(CpR));
+        return;
+    }
+
+    #pragma omp parallel for
+    for (long i = 0 ; i < n ; ++i) {
+        float t = y[i];
+        y[i]  = t + (gamma * (t - yp[i]));
+        yp[i] = t;
+    }
+}
+
+// Real-space finite differences, see gradient in vsnr_engine.cuh
+// Dk u[c] = (u[c] - u[c+ek]) / hk and DkT u[c] = (u[c] - u[c-ek]) / hk, periodic.
+
+// Computes d1u = D1 u, d2u = D2 u, d3u = D3 u
+static void gradient(CpR* u, CpR* d1u, CpR* d2u, CpR* d3u, int n0, int n1, int n2, float dx, float dy, float dz)
+{
+    long n  = (long)n0*n1*n2;
+    long s2 = n1;
+    long s3 = (long)n1*n0;
+
+    float o1 = (n1 > 1 ? 1.0 : 0.0);
+    float o2 = (n0 > 1 ? 1.0 : 0.0);
+    float o3 = (n2 > 1 ? 1.0 : 0.0);
+
+    #pragma omp parallel for
+    for (long c = 0 ; c < n ; ++c) {
+        long c1 = ( c % n1       == n1-1) ? c - (n1-1)    : c + 1;
+        long c2 = ((c / s2) % n0 == n0-1) ? c - s2*(n0-1) : c + s2;
+        long c3 = ( c / s3       == n2-1) ? c - s3*(n2-1) : c + s3;
+
+        d1u[c] = (u[c] - o1 * u[c1]) / dx;
+        d2u[c] = (u[c] - o2 * u[c2]) / dy;
+        d3u[c] = (u[c] - o3 * u[c3]) / dz;
+    }
+}
+
+// Computes tmp = D1T (beta*y1 - l1) + D2T (beta*y2 - l2) + D3T (beta*y3 - l3)
+static void adjoint_betay_m_lambda(CpR* l1, CpR* l2, CpR* l3, CpR* y1, CpR* y2, CpR* y3, CpR* tmp, float beta, int n0, int n1, int n2, float dx, float dy, float dz)
+{
+    long n  = (long)n0*n1*n2;
+    long s2 = n1;
+    long s3 = (long)n1*n0;
+
+    float o1 = (n1 > 1 ? 1.0 : 0.0);
+    float o2 = (n0 > 1 ? 1.0 : 0.0);
+    float o3 = (n2 > 1 ? 1.0 : 0.0);
+
+    #pragma omp parallel for
+    for (long c = 0 ; c < n ; ++c) {
+        long c1 = ( c % n1       == 0) ? c + (n1-1)    : c - 1;
+        long c2 = ((c / s2) % n0 == 0) ? c + s2*(n0-1) : c - s2;
+        long c3 = ( c / s3       == 0) ? c + s3*(n2-1) : c - s3;
+
+        tmp[c] = ((beta * y1[c] - l1[c]) - o1 * (beta * y1[c1] - l1[c1])) / dx
+               + ((beta * y2[c] - l2[c]) - o2 * (beta * y2[c2] - l2[c2])) / dy
+               + ((beta * y3[c] - l3[c]) - o3 * (beta * y3[c3] - l3[c3])) / dz;
+    }
+}
+
+// fx = conj(fpsi) .* ftmp / (1 + beta*fpsi^2*fphi), fpsi and fphi real, see update_fx_psi in vsnr_engine.cuh
+static void update_fx_psi(float* fpsi, CpC* ftmp, float* fphi, CpC* fx, float beta, long m)
+{
+    #pragma omp parallel for
+    for (long i = 0 ; i < m ; ++i) {
+        float p = fpsi[i];
+        float r = p / (1 + beta*SQ(p)*fphi[i]);
+        fx[i].x = r * ftmp[i].x;
+        fx[i].y = r * ftmp[i].y;
+    }
+}
+
+// y = prox_{f1/beta}(Ax+lambda/beta) then lambda += beta (Ax - y) at voxel c, with Ax relaxed by alpha
+// (g1, g2, g3) = Du0[c], (a1, a2, a3) = Ax[c]
+static inline void shrink_y_lambda(long c, float g1, float g2, float g3, float a1, float a2, float a3, CpR* l1, CpR* l2, CpR* l3, CpR* y1, CpR* y2, CpR* y3, float beta, float alpha, float* v)
+{
+    float p1 = y1[c], p2 = y2[c], p3 = y3[c];
+    float h1 = (alpha * a1) + ((1.0f - alpha) * p1);
+    float h2 = (alpha * a2) + ((1.0f - alpha) * p2);
+    float h3 = (alpha * a3) + ((1.0f - alpha) * p3);
+    float t1 = g1 - (h1 + (l1[c] / beta));
+    float t2 = g2 - (h2 + (l2[c] / beta));
+    float t3 = g3 - (h3 + (l3[c] / beta));
+    float ng = sqrtf(SQ(t1) + SQ(t2) + SQ(t3));
+
+    if (ng > 1.0 / beta) {
+        y1[c] = g1 - t1 * (1.0 - (1.0 / (beta * ng)));
+        y2[c] = g2 - t2 * (1.0 - (1.0 / (beta * ng)));
+        y3[c] = g3 - t3 * (1.0 - (1.0 / (beta * ng)));
+    } else {
+        y1[c] = g1;
+        y2[c] = g2;
+        y3[c] = g3;
+    }
+
+    l1[c] = l1[c] + (beta * (h1 - y1[c]));
+    l2[c] = l2[c] + (beta * (h2 - y2[c]));
+    l3[c] = l3[c] + (beta * (h3 - y3[c]));
+
+    if (v) add_residuals(v, a1, a2, a3, y1[c], y2[c], y3[c], p1, p2, p3, l1[c], l2[c], l3[c]);
+}
+
+// update_y followed by update_lambda, Ax is taken on the fly from w = n (psi * x)
+static void update_y_lambda(CpR* d1u0, CpR* d2u0, CpR* d3u0, CpR* w, CpR* l1, CpR* l2, CpR* l3, CpR* y1, CpR* y2, CpR* y3, float beta, float alpha, int n0, int n1, int n2, float dx, float dy, float dz, double* res)
+{
+    long n  = (long)n0*n1*n2;
+    long s2 = n1;
+    long s3 = (long)n1*n0;
+
+    float o1 = (n1 > 1 ? 1.0 : 0.0);
+    float o2 = (n0 > 1 ? 1.0 : 0.0);
+    float o3 = (n2 > 1 ? 1.0 : 0.0);
+
+    double r0 = 0, r1 = 0, r2 = 0, r3 = 0, r4 = 0;
+
+    #pragma omp parallel for reduction(+:r0,r1,r2,r3,r4)
+    for (long c = 0 ; c < n ; ++c) {
+        float v[VSNR_RES_SIZE] = {0, 0, 0, 0, 0};
+        long c1 = ( c % n1       == n1-1) ? c - (n1-1)    : c + 1;
+        long c2 = ((c / s2) % n0 == n0-1) ? c - s2*(n0-1) : c + s2;
+        long c3 = ( c / s3       == n2-1) ? c - s3*(n2-1) : c + s3;
+
+        shrink_y_lambda(c, d1u0[c], d2u0[c], d3u0[c],
+                        (w[c] - o1 * w[c1]) / (dx * n),  // Ax1
+                        (w[c] - o2 * w[c2]) / (dy * n),  // Ax2
+                        (w[c] - o3 * w[c3]) / (dz * n),  // Ax3
+                        l1, l2, l3, y1, y2, y3, beta, alpha, res ? v : NULL);
+        r0 += v[0]; r1 += v[1]; r2 += v[2]; r3 += v[3]; r4 += v[4];
+    }
+
+    set_residuals(res, r0, r1, r2, r3, r4);
+}
+
+// Same as update_y_lambda with Du0 recomputed from u0 (low-memory solver)
+static void update_y_lambda_u0(CpR* u0, CpR* w, CpR* l1, CpR* l2, CpR* l3, CpR* y1, CpR* y2, CpR* y3, float beta, float alpha, int n0, int n1, int n2, float dx, float dy, float dz, double* res)
+{
+    long n  = (long)n0*n1*n2;
+    long s2 = n1;
+    long s3 = (long)n1*n0;
+
+    float o1 = (n1 > 1 ? 1.0 : 0.0);
+    float o2 = (n0 > 1 ? 1.0 : 0.0);
+    float o3 = (n2 > 1 ? 1.0 : 0.0);
+
+    double r0 = 0, r1 = 0, r2 = 0, r3 = 0, r4 = 0;
+
+    #pragma omp parallel for reduction(+:r0,r1,r2,r3,r4)
+    for (long c = 0 ; c < n ; ++c) {
+        float v[VSNR_RES_SIZE] = {0, 0, 0, 0, 0};
+        long c1 = ( c % n1       == n1-1) ? c - (n1-1)    : c + 1;
+        long c2 = ((c / s2) % n0 == n0-1) ? c - s2*(n0-1) : c + s2;
+        long c3 = ( c / s3       == n2-1) ? c - s3*(n2-1) : c + s3;
+
+        shrink_y_lambda(c, (u0[c] - o1 * u0[c1]) / dx,  // D1u0
+                           (u0[c] - o2 * u0[c2]) / dy,  // D2u0
+                           (u0[c] - o3 * u0[c3]) / dz,  // D3u0
+                        (w[c] - o1 * w[c1]) / (dx * n),  // Ax1
+                        (w[c] - o2 * w[c2]) / (dy * n),  // Ax2
+                        (w[c] - o3 * w[c3]) / (dz * n),  // Ax3
+                        l1, l2, l3, y1, y2, y3, beta, alpha, res ? v : NULL);
+        r0 += v[0]; r1 += v[1]; r2 += v[2]; r3 += v[3]; r4 += v[4];
+    }
+
+    set_residuals(res, r0, r1, r2, r3, r4);
+}
+
+// Persistent solver state for one geometry, see VSNR_CONTEXT in vsnr3d.cu. The settings of the iterations are in VSNR_CONTROL.
+struct CPU_CONTEXT : VSNR_CONTROL {
+    int solver; // VSNR_SOLVER_*, decides which buffers below are allocated
+    int n0, n1, n2;
+    long n, m;
+    float dx, dy, dz;
+
+    int pad;        // padding, see VSNR_CONTEXT
+    int v0, v1, v2;
+    long v;
+
+    fftwf_plan planR2C, planC2R;
+
+    void* arena;    // one allocation holding the buffers below (but yp, lp), see carve
+
+    CpR *gu0; // real
+
+    float *fpsi, *fphi; // real m-sized spectra
+    CpC *fx;            // complex
+
+    float *bank;    // filter list fbank was built for (host copy), NULL if none
+    int bankLength;
+    float rms;      // rms of u0 used to scale the filters, 0 : ||u0||
+
+    CpR *yp1, *yp2, *yp3; // real
+    CpR *lp1, *lp2, *lp3;
+    float *fbank;   // real m-sized spectrum, sum_i eta_i |PSI_i|^2 / mmax_i
+
+    double marks[CPU_MARK_COUNT]; // stage boundaries of a run (s), see mark in vsnr_engine.cuh
+
+    VSNR_PROFILE prof;      // instrumentation, see VSNR_CONTEXT
+
+    CpC *fphi1, *fphi2, *fphi3; // complex
+    CpC *ftmp1, *ftmp2, *ftmp3; // complex
+    CpR  *tmp1,  *tmp2,  *tmp3; // real
+    CpR  *d1u0,  *d2u0,  *d3u0; // real
+    CpR    *y1,    *y2,    *y3; // real
+    CpR    *l1,    *l2,    *l3; // real
+};
+
+// Buffer the residuals of an iteration are summed into, NULL if they are not needed, see is_summed
+static double* residuals(CPU_CONTEXT* ctx, int check, double* res)
+{
+    // -
+    return (is_summed(ctx, check) ? res : NULL);
+}
+
+// Fast ADMM step on y and lambda
+static void extrapolate_all(CPU_CONTEXT* ctx, float gamma)
+{
+    long n = ctx->n;
+
+    extrapolate(ctx->y1, ctx->yp1, gamma, n);
+    extrapolate(ctx->y2, ctx->yp2, gamma, n);
+    extrapolate(ctx->y3, ctx->yp3, gamma, n);
+    extrapolate(ctx->l1, ctx->lp1, gamma, n);
+    extrapolate(ctx->l2, ctx->lp2, gamma, n);
+    extrapolate(ctx->l3, ctx->lp3, gamma, n);
+}
+
+// Main function, returns w = n (psi * x) as VSNR_ADMM_GPU in vsnr_engine.cuh
+static CpR* VSNR_ADMM_CPU(CPU_CONTEXT* ctx, float *u0, int nit, float beta)
+{
+    int n0 = ctx->n0, n1 = ctx->n1, n2 = ctx->n2;
+    long n = ctx->n;
+    long m = ctx->m;
+    float dx = ctx->dx, dy = ctx->dy, dz = ctx->dz;
+
+    fftwf_plan planR2C = ctx->planR2C;
+    fftwf_plan planC2R = ctx->planC2R;
+
+    float *fpsi = ctx->fpsi, *fphi = ctx->fphi;
+    CpC *fx     = ctx->fx;
+    CpC *fphi1 = ctx->fphi1, *fphi2 = ctx->fphi2, *fphi3 = ctx->fphi3;
+    CpC *ftmp1 = ctx->ftmp1, *ftmp2 = ctx->ftmp2, *ftmp3 = ctx->ftmp3;
+    CpR  *tmp1 = ctx->tmp1,   *tmp2 = ctx->tmp2,   *tmp3 = ctx->tmp3;
+    CpR  *d1u0 = ctx->d1u0,   *d2u0 = ctx->d2u0,   *d3u0 = ctx->d3u0;
+    CpR    *y1 = ctx->y1,       *y2 = ctx->y2,       *y3 = ctx->y3;
+    CpR    *l1 = ctx->l1,       *l2 = ctx->l2,       *l3 = ctx->l3;
+
+    // Computes d1u0, d2u0, d3u0
+    gradient(u0, d1u0, d2u0, d3u0, n0, n1, n2, dx, dy, dz);
+
+    // Computes fphi1, fphi2, fphi3 & fphi
+    compute_phi(fpsi, fphi1, fphi2, fphi3, fphi, n0, n1, n2, dx, dy, dz);
+
+    // Initialization, or y and lambda of the previous run (warm start)
+    if (!(ctx->warm && ctx->solved)) {
+        memset(y1, 0, n*sizeof(CpR));
+        memset(y2, 0, n*sizeof(CpR));
+        memset(y3, 0, n*sizeof(CpR));
+
+        memset(l1, 0, n*sizeof(CpR));
+        memset(l2, 0, n*sizeof(CpR));
+        memset(l3, 0, n*sizeof(CpR));
+    }
+
+    ctx->iterations = 0;
+    ctx->primal = ctx->dual = 0;
+
+    // Fast ADMM state
+    float a = 1, c = INFINITY;
+    if (ctx->accel == VSNR_ACCEL_NESTEROV) {
+        memset(ctx->yp1, 0, n*sizeof(CpR));
+        memset(ctx->yp2, 0, n*sizeof(CpR));
+        memset(ctx->yp3, 0, n*sizeof(CpR));
+        memset(ctx->lp1, 0, n*sizeof(CpR));
+        memset(ctx->lp2, 0, n*sizeof(CpR));
+        memset(ctx->lp3, 0, n*sizeof(CpR));
+    }
+    ctx->marks[3] = omp_get_wtime();
+
+    // Main algorithm
+    for (int k = 0 ; k < nit ; ++k) {
+        share_threads();
+        int check = is_checked(ctx, k, nit);
+        double res[VSNR_RES_SIZE];
+
+        // -------------------------------------------------------------
+        // First step, x update : (I+beta ATA)x = AT (-lambda+beta*ATy)
+        // -------------------------------------------------------------
+        betay_m_lambda(l1, l2, l3, y1, y2, y3, tmp1, tmp2, tmp3, beta, n);
+        fft_r2c(&ctx->prof, planR2C, tmp1, ftmp1);
+        fft_r2c(&ctx->prof, planR2C, tmp2, ftmp2);
+        fft_r2c(&ctx->prof, planR2C, tmp3, ftmp3);
+        conju_x_v(fphi1, ftmp1, ftmp1, m);
+        conju_x_v(fphi2, ftmp2, ftmp2, m);
+        conju_x_v(fphi3, ftmp3, ftmp3, m);
+        update_fx(ftmp1, ftmp2, ftmp3, fphi, fx, beta, m);
+
+        // --------------------------------------------------------
+        // Second step y update : y = prox_{f1/beta}(Ax+lambda/beta)
+        // --------------------------------------------------------
+        product_carray(fphi1, fx, ftmp1, m);
+        product_carray(fphi2, fx, ftmp2, m);
+        product_carray(fphi3, fx, ftmp3, m);
+        fft_c2r(&ctx->prof, planC2R, ftmp1, tmp1); // tmp1 = Ax1
+        fft_c2r(&ctx->prof, planC2R, ftmp2, tmp2); // tmp2 = Ax2
+        fft_c2r(&ctx->prof, planC2R, ftmp3, tmp3); // tmp3 = Ax3
+        normalize(tmp1, n);
+        normalize(tmp2, n);
+        normalize(tmp3, n);
+        update_y(d1u0, d2u0, d3u0, tmp1, tmp2, tmp3, l1, l2, l3, y1, y2, y3, beta, ctx->alpha, n, residuals(ctx, check, res));
+
+        // --------------------------
+        // Third step lambda update
+        // --------------------------
+        update_lambda(l1, tmp1, y1, beta, n);
+        update_lambda(l2, tmp2, y2, beta, n);
+        update_lambda(l3, tmp3, y3, beta, n);
+
+        if (check && read_residuals(ctx, res, k, nit, beta)) break;
+
+        // ----------------------------
+        // Acceleration, see accel
+        // ----------------------------
+        if (ctx->accel == VSNR_ACCEL_NESTEROV)
+            extrapolate_all(ctx, restart_step(&a, &c, beta * (res[0] + res[1])));
+
+        if (ctx->accel == VSNR_ACCEL_ADAPTIVE && check)
+            balance_beta(res, &beta);
+
+    }
+    ctx->marks[4] = omp_get_wtime();
+
+    // Last but not the least : w = n (psi * x)
+    product_rarray(fpsi, fx, ftmp1, m);
+    fft_c2r(&ctx->prof, planC2R, ftmp1, tmp1);
+    return tmp1;
+}
+
+
+// Main function, stencil solver, see VSNR_ADMM_STENCIL_GPU in vsnr_engine.cuh
+static CpR* VSNR_ADMM_STENCIL_CPU(CPU_CONTEXT* ctx, float *u0, int nit, float beta)
+{
+    int lowmem = (ctx->solver == VSNR_SOLVER_LOWMEM);
+    int n0 = ctx->n0, n1 = ctx->n1, n2 = ctx->n2;
+    long n = ctx->n;
+    long m = ctx->m;
+    float dx = ctx->dx, dy = ctx->dy, dz = ctx->dz;
+
+    fftwf_plan planR2C = ctx->planR2C;
+    fftwf_plan planC2R = ctx->planC2R;
+
+    float *fpsi = ctx->fpsi, *fphi = ctx->fphi;
+    CpC *fx    = ctx->fx;
+    CpC *ftmp  = ctx->ftmp1;
+    CpR  *tmp  = ctx->tmp1;
+    CpR  *d1u0 = ctx->d1u0,   *d2u0 = ctx->d2u0,   *d3u0 = ctx->d3u0;
+    CpR    *y1 = ctx->y1,       *y2 = ctx->y2,       *y3 = ctx->y3;
+    CpR    *l1 = ctx->l1,       *l2 = ctx->l2,       *l3 = ctx->l3;
+
+    // Computes d1u0, d2u0, d3u0 (recomputed in update_y_lambda_u0 by the low-memory solver)
+    if (!lowmem)
+        gradient(u0, d1u0, d2u0, d3u0, n0, n1, n2, dx, dy, dz);
+
+    // Computes fphi
+    compute_phi_psi(fphi, n0, n1, n2, dx, dy, dz);
+
+    // Initialization, or y and lambda of the previous run (warm start)
+    if (!(ctx->warm && ctx->solved)) {
+        memset(y1, 0, n*sizeof(CpR));
+        memset(y2, 0, n*sizeof(CpR));
+        memset(y3, 0, n*sizeof(CpR));
+
+        memset(l1, 0, n*sizeof(CpR));
+        memset(l2, 0, n*sizeof(CpR));
+        memset(l3, 0, n*sizeof(CpR));
+    }
+
+    // x = 0 if there is no iteration
+    memset(tmp, 0, n*sizeof(CpR));
+
+    ctx->iterations = 0;
+    ctx->primal = ctx->dual = 0;
+
+    // Fast ADMM state
+    float a = 1, c = INFINITY;
+    if (ctx->accel == VSNR_ACCEL_NESTEROV) {
+        memset(ctx->yp1, 0, n*sizeof(CpR));
+        memset(ctx->yp2, 0, n*sizeof(CpR));
+        memset(ctx->yp3, 0, n*sizeof(CpR));
+        memset(ctx->lp1, 0, n*sizeof(CpR));
+        memset(ctx->lp2, 0, n*sizeof(CpR));
+        memset(ctx->lp3, 0, n*sizeof(CpR));
+    }
+    ctx->marks[3] = omp_get_wtime();
+
+    // Main algorithm
+    for (int k = 0 ; k < nit ; ++k) {
+        share_threads();
+        int check = is_checked(ctx, k, nit);
+        double res[VSNR_RES_SIZE];
+
+        // -------------------------------------------------------------
+        // First step, x update : (I+beta ATA)x = AT (-lambda+beta*ATy)
+        // -------------------------------------------------------------
+        adjoint_betay_m_lambda(l1, l2, l3, y1, y2, y3, tmp, beta, n0, n1, n2, dx, dy, dz);
+        fft_r2c(&ctx->prof, planR2C, tmp, ftmp);
+        update_fx_psi(fpsi, ftmp, fphi, fx, beta, m);
+
+        // --------------------------------------------------------
+        // Second step y update : y = prox_{f1/beta}(Ax+lambda/beta)
+        // Third step lambda update
+        // --------------------------------------------------------
+        product_rarray(fpsi, fx, ftmp, m);
+        fft_c2r(&ctx->prof, planC2R, ftmp, tmp); // tmp = n * (psi * x)
+        if (lowmem)
+            update_y_lambda_u0(u0, tmp, l1, l2, l3, y1, y2, y3, beta, ctx->alpha, n0, n1, n2, dx, dy, dz, residuals(ctx, check, res));
+        else
+            update_y_lambda(d1u0, d2u0, d3u0, tmp, l1, l2, l3, y1, y2, y3, beta, ctx->alpha, n0, n1, n2, dx, dy, dz, residuals(ctx, check, res));
+
+        if (check && read_residuals(ctx, res, k, nit, beta)) break;
+
+        // ----------------------------
+        // Acceleration, see accel
+        // ----------------------------
+        if (ctx->accel == VSNR_ACCEL_NESTEROV)
+            extrapolate_all(ctx, restart_step(&a, &c, beta * (res[0] + res[1])));
+
+        if (ctx->accel == VSNR_ACCEL_ADAPTIVE && check)
+            balance_beta(res, &beta);
+
+    }
+    ctx->marks[4] = omp_get_wtime();
+
+    // Last but not the least : tmp already holds w = n (psi * x)
+    return tmp;
+}
+
+// Sets Gabor
+static void create_gabor(CpR* psi, int n0, int n1, int n2, float level, float sigmax, float sigmay, float sigmaz, float thetax, float thetay, float thetaz, float phase, float lambda)
+{
+    long n = (long)n0*n1*n2;
+
+    float tx = thetax * PI / 180.0;
+    float ty = thetay * PI / 180.0;
+    float tz = thetaz * PI / 180.0;
+
+    float off_x = (n1 / 2) + 1;
+    float off_y = (n0 / 2) + 1;
+    float off_z = (n2 / 2) + 1;
+
+    float cx = cosf(tx);
+    float sx = sinf(tx);
+
+    float cy = cosf(ty);
+    float sy = sinf(ty);
+
+    float cz = cosf(tz);
+    float sz = sinf(tz);
+
+    float nn;
+
+    phase = phase * PI / 180.0;
+    nn    = PI / sqrtf(sigmax*sigmay*sigmaz);
+
+    #pragma omp parallel for
+    for (long c = 0 ; c < n ; ++c) {
+
+        int i = c % n1;
+        int j = (c / n1) % n0;
+        int k = c / ((long)n1*n0);
+
+        float x = off_x - i;
+        float y = off_y - j;
+        float z = off_z - k;
+
+        float x_t = (x*(cy*cz))              - (y*(sz*cy))              + (z*sy);
+        float y_t = (x*((sy*sx*cz)+(sz*cx))) + (y*((cx*cz)-(sz*sy*sx))) - (z*(sx*cy));
+        float z_t = (x*((sz*sx)-(sy*cx*cz))) + (y*((sx*cz)+(sy*sz*cx))) + (z*(cy*cx));
+
+        float val = expf(-0.5*(SQ(x_t/sigmax)+SQ(y_t/sigmay)+SQ(z_t/sigmaz))) * cosf((x_t*lambda/sigmax)+phase);
+        psi[c] = level * val / nn;
+
+    }
+}
+
+// Sets fpsi = |fftn(psi)|^2 of the Gabor of create_gabor (level 1, phase and lambda 0) in closed form, see
+// create_gabor_spectrum and gabor_aliases in vsnr_engine.cuh. Returns -1 without setting fpsi if the filter
+// has to be sampled in space.
+static int create_gabor_spectrum(float* fpsi, int n0, int n1, int n2, float sigmax, float sigmay, float sigmaz, float thetax, float thetay, float thetaz)
+{
+    long h1 = n1/2+1;
+    long m  = (long)n0*n2*h1;
+
+    float cx = cosf(thetax * PI / 180.0), sx = sinf(thetax * PI / 180.0);
+    float cy = cosf(thetay * PI / 180.0), sy = sinf(thetay * PI / 180.0);
+    float cz = cosf(thetaz * PI / 180.0), sz = sinf(thetaz * PI / 180.0);
+
+    float R[9] = {cy*cz,                 -(sz*cy),              sy,
+                  (sy*sx*cz)+(sz*cx),    (cx*cz)-(sz*sy*sx),    -(sx*cy),
+                  (sz*sx)-(sy*cx*cz),    (sx*cz)+(sy*sz*cx),    cy*cx};
+    float sigma[3] = {sigmax, sigmay, sigmaz};
+    int size[3] = {n1, n0, n2};
+    float amp = sqrtf(sigmax*sigmay*sigmaz) / PI, smin = INFINITY, e;
+    int r;
+
+    for (int a = 0 ; a < 3 ; ++a) {
+        e = 0;
+        for (int b = 0 ; b < 3 ; ++b)
+            e += SQ(R[3*b+a] * sigma[b]);
+        if (6*sqrtf(e) > size[a]/2 - 1) return -1;
+
+        smin = MIN(smin, sigma[a]);
+        amp *= sqrtf(2.0 * PI) * sigma[a];
+    }
+
+    r = (int)ceilf(0.903f / smin - 0.5f);
+    r = MAX(r, 0);
+    if (r > 2) return -1;
+
+    #pragma omp parallel for
+    for (long i = 0 ; i < m ; ++i) {
+        int fk[3] = {(int)(i % h1), (int)((i / h1) % n0), (int)(i / (h1*n0))};
+        float f[3], w[3], q, sum = 0;
+
+        for (int a = 0 ; a < 3 ; ++a)
+            f[a] = (float)(2*fk[a] < size[a] ? fk[a] : fk[a] - size[a]) / size[a];
+
+        // the centers n/2 + 1 are on a sample, all the aliases have the same phase
+        for (int s2 = -r ; s2 <= r ; ++s2)
+        for (int s1 = -r ; s1 <= r ; ++s1)
+        for (int s0 = -r ; s0 <= r ; ++s0) {
+            w[0] = 2.0 * PI * (f[0] + s0);
+            w[1] = 2.0 * PI * (f[1] + s1);
+            w[2] = 2.0 * PI * (f[2] + s2);
+
+            q = 0;
+            for (int b = 0 ; b < 3 ; ++b)
+                q += SQ(sigma[b] * (R[3*b]*w[0] + R[3*b+1]*w[1] + R[3*b+2]*w[2]));
+            sum += expf(-0.5 * q);
+        }
+
+        fpsi[i] = SQ(amp * sum);
+    }
+
+    return 0;
+}
+
+// Sets fpsi = |fftn(dirac)|^2 = val^2
+static void create_dirac_spectrum(float* fpsi, float val, long m)
+{
+    #pragma omp parallel for
+    for (long i = 0 ; i < m ; ++i)
+        fpsi[i] = SQ(val);
+}
+
+// Sets fpsi = |f|^2 (real)
+static void compute_squared_norm(CpC* f, float* fpsi, long m)
+{
+    #pragma omp parallel for
+    for (long i = 0 ; i < m ; ++i)
+        fpsi[i] = SQ(f[i].x) + SQ(f[i].y);
+}
+
+// Sets fsum = sqrtf(val * fbank)
+static void compute_sqrtf(float* fbank, float* fsum, float val, long m)
+{
+    #pragma omp parallel for
+    for (long i = 0 ; i < m ; ++i)
+        fsum[i] = sqrtf(val * fbank[i]);
+}
+
+// Returns max_k max(fpsi * |fdk|) over the 3 axes in one sweep of fpsi, see fd_product_max in vsnr_engine.cuh
+static float fd_product_max(float* fpsi, int n0, int n1, int n2, float dx, float dy, float dz)
+{
+    long h1 = n1/2+1;
+    long m  = (long)n0*n2*h1;
+    float mmax = 0.0;
+
+    #pragma omp parallel for reduction(max:mmax)
+    for (long i = 0 ; i < m ; ++i) {
+        float fd = MAX(fd_norm( i % h1,       n1, dx),
+                   MAX(fd_norm((i / h1) % n0, n0, dy),
+                       fd_norm( i / (h1*n0),  n2, dz)));
+        mmax = MAX(mmax, fabsf(fpsi[i] * fd));
+    }
+
+    return mmax;
+}
+
+// Returns the l2 norm of u
+static float norm2(CpR* u, long n)
+{
+    double sum = 0.0;
+
+    #pragma omp parallel for reduction(+:sum)
+    for (long i = 0 ; i < n ; ++i)
+        sum += (double)u[i] * u[i];
+
+    return (float)sqrt(sum);
+}
+
+// Sets fsum += fpsitemp / alpha
+static void update_psi(float* fpsitemp, float* fsum, float alpha, long m)
+{
+    #pragma omp parallel for
+    for (long i = 0 ; i < m ; ++i)
+        fsum[i] += fpsitemp[i] / alpha;
+}
+
+// Builds fbank = sum_i eta_i |PSI_i|^2 / mmax_i, see CREATE_BANK in vsnr3d.cu
+// fpsi and the work buffers of the ADMM (not yet in use) hold the intermediate spectra.
+static void CREATE_BANK_CPU(CPU_CONTEXT* ctx, float* psis, int length)
+{
+    int  i = 0;
+    long m = ctx->m;
+
+    float eta = 1.0, mmax;
+
+    float *psitemp  = ctx->tmp1;
+    float *fpsitemp = ctx->fpsi;
+    CpC *fgabor     = ctx->ftmp1;
+
+    memset(ctx->fbank, 0, m*sizeof(float));
+
+    while (i < length) {
+
+        if (psis[i] == 0.0) {
+            create_dirac_spectrum(fpsitemp, 1, m); // fpsitemp = |fftn(dirac)|^2;
+            eta = psis[i+1];
+            i += 2;
+        } else if (psis[i] == 1.0) {
+            // 1 : amplitude,
+            // 2 : sigmaX, 3 : sigmaY, 4 : sigmaZ,
+            // 5 : thetaX, 6 : thetaY, 7 : thetaZ,
+            if (create_gabor_spectrum(fpsitemp, ctx->n0, ctx->n1, ctx->n2, psis[i+2], psis[i+3], psis[i+4], psis[i+5], psis[i+6], psis[i+7]) != 0) {
+                create_gabor(psitemp, ctx->n0, ctx->n1, ctx->n2, 1.0, psis[i+2], psis[i+3], psis[i+4], psis[i+5], psis[i+6], psis[i+7], 0.0, 0.0);
+                fft_r2c(&ctx->prof, ctx->planR2C, psitemp, fgabor);
+                compute_squared_norm(fgabor, fpsitemp, m); // fpsitemp = |fgabor|^2;
+            }
+            eta = psis[i+1];
+            i += 8;
+        }
+
+        mmax = fd_product_max(fpsitemp, ctx->n0, ctx->n1, ctx->n2, ctx->dx, ctx->dy, ctx->dz); // mmax = max_k |fdk|*|fpsitemp|;
+
+        update_psi(fpsitemp, ctx->fbank, mmax / eta, m); // fbank += |fpsitemp|^2 * eta_i / mmax_i;
+
+    }
+
+    free(ctx->bank);
+    ctx->bank = (float*)malloc(length*sizeof(float));
+    ctx->bankLength = length;
+    memcpy(ctx->bank, psis, length*sizeof(float));
+}
+
+// This function creates the filters from a Java list of filters
+// PSI = sqrtf(sum_i |PSI_i|^2/alpha_i) with alpha_i = sqrt(n) n^2 mmax_i / (||u0|| eta_i), fpsi = n PSI, see CREATE_FILTERS in vsnr3d.cu
+static void CREATE_FILTERS_CPU(CPU_CONTEXT* ctx, float* psis, float *gu0, int length, float max)
+{
+    long n = ctx->n;
+    float norm;
+
+    if (!ctx->bank || ctx->bankLength != length || memcmp(ctx->bank, psis, length*sizeof(float)))
+        CREATE_BANK_CPU(ctx, psis, length);
+
+    // Computes the l2 norm of u0, or takes it from the rms of the whole volume (tiles)
+    if (ctx->rms > 0)
+        norm = ctx->rms / max * sqrtf((float)n);
+    else
+        norm = norm2(gu0, n);
+
+    compute_sqrtf(ctx->fbank, ctx->fpsi, norm / sqrtf((float)n), ctx->m); // fpsi = n sqrtf(sum_i |fpsi_i|^2 / alpha_i);
+}
+
+// Frees a context
+void VSNR_3D_CPU_DESTROY_CONTEXT(void* context)
+{
+    CPU_CONTEXT* ctx = (CPU_CONTEXT*)context;
+
+    if (!ctx) return;
+
+    fftwf_free(ctx->arena);
+    free(ctx->bank);
+
+    fftwf_free(ctx->yp1);
+    fftwf_free(ctx->yp2);
+    fftwf_free(ctx->yp3);
+
+    fftwf_free(ctx->lp1);
+    fftwf_free(ctx->lp2);
+    fftwf_free(ctx->lp3);
+
+    {
+        std::lock_guard<std::mutex> guard(planner);
+        if (ctx->planR2C) fftwf_destroy_plan(ctx->planR2C);
+        if (ctx->planC2R) fftwf_destroy_plan(ctx->planC2R);
+    }
+
+    free(ctx);
+}
+
+// fftwf_malloc that raises *failed instead of returning NULL silently
+static void* cpu_malloc(CPU_CONTEXT* ctx, size_t bytes, int* failed)
+{
+    double t0 = omp_get_wtime();
+    void* p = fftwf_malloc(bytes);
+
+    if (!p) *failed = 1;
+    else    ctx->prof.bytes += bytes;
+    ctx->prof.peakBytes = MAX(ctx->prof.peakBytes, ctx->prof.bytes);
+    ctx->prof.allocMs += 1e3 * (omp_get_wtime() - t0);
+    ctx->prof.allocs++;
+    return p;
+}
+
+// Takes the next buffer of "bytes" from the arena at *p, see carve in vsnr_engine.cuh
+static void* carve(char** p, size_t bytes)
+{
+    void* b = *p;
+
+    *p += (bytes + VSNR_ARENA_ALIGN-1) / VSNR_ARENA_ALIGN * VSNR_ARENA_ALIGN;
+    return b;
+}
+
+// Carves the buffers of a context from the arena at p (which may be NULL to size it), returns its bytes
+static size_t carve_buffers(CPU_CONTEXT* ctx, char* p)
+{
+    char* p0 = p;
+    long n = ctx->n;
+    long m = ctx->m;
+
+    ctx->gu0  = (CpR*)carve(&p, n*sizeof(CpR));
+
+    ctx->fpsi = (float*)carve(&p, m*sizeof(float));
+    ctx->fphi = (float*)carve(&p, m*sizeof(float));
+    ctx->fx   = (CpC*)carve(&p, m*sizeof(CpC));
+
+    ctx->fbank = (float*)carve(&p, m*sizeof(float));
+
+    ctx->ftmp1 = (CpC*)carve(&p, m*sizeof(CpC));
+    ctx->tmp1  = (CpR*)carve(&p, n*sizeof(CpR));
+
+    ctx->y1 = (CpR*)carve(&p, n*sizeof(CpR));
+    ctx->y2 = (CpR*)carve(&p, n*sizeof(CpR));
+    ctx->y3 = (CpR*)carve(&p, n*sizeof(CpR));
+
+    ctx->l1 = (CpR*)carve(&p, n*sizeof(CpR));
+    ctx->l2 = (CpR*)carve(&p, n*sizeof(CpR));
+    ctx->l3 = (CpR*)carve(&p, n*sizeof(CpR));
+
+    if (ctx->solver != VSNR_SOLVER_LOWMEM) {
+        ctx->d1u0 = (CpR*)carve(&p, n*sizeof(CpR));
+        ctx->d2u0 = (CpR*)carve(&p, n*sizeof(CpR));
+        ctx->d3u0 = (CpR*)carve(&p, n*sizeof(CpR));
+    }
+
+    if (ctx->solver == VSNR_SOLVER_FFT) {
+        ctx->fphi1 = (CpC*)carve(&p, m*sizeof(CpC));
+        ctx->fphi2 = (CpC*)carve(&p, m*sizeof(CpC));
+        ctx->fphi3 = (CpC*)carve(&p, m*sizeof(CpC));
+
+        ctx->ftmp2 = (CpC*)carve(&p, m*sizeof(CpC));
+        ctx->ftmp3 = (CpC*)carve(&p, m*sizeof(CpC));
+
+        ctx->tmp2 = (CpR*)carve(&p, n*sizeof(CpR));
+        ctx->tmp3 = (CpR*)carve(&p, n*sizeof(CpR));
+    }
+
+    return p - p0;
+}
+
+// Same contract as VSNR_3D_CREATE_CONTEXT, returns NULL if an allocation fails
+// The arena comes from fftwf_malloc and its buffers are aligned alike, so every FFT operand
+// has the alignment the plans were made for.
+void* VSNR_3D_CPU_CREATE_CONTEXT(int n0, int n1, int n2, float dx, float dy, float dz, int solver)
+{
+    CPU_CONTEXT* ctx = (CPU_CONTEXT*)calloc(1, sizeof(CPU_CONTEXT));
+    long n = (long)n0*n1*n2;
+    long m = (long)n0*n2*(n1/2+1);
+    int failed = 0;
+
+    ctx->solver = solver;
+    ctx->n0 = n0;
+    ctx->n1 = n1;
+    ctx->n2 = n2;
+    ctx->n  = n;
+    ctx->m  = m;
+    ctx->dx = dx;
+    ctx->dy = dy;
+    ctx->dz = dz;
+    ctx->every = 10;
+    ctx->alpha = 1;
+    ctx->pad = VSNR_PAD_NONE;
+    ctx->v0  = n0;
+    ctx->v1  = n1;
+    ctx->v2  = n2;
+    ctx->v   = n;
+
+    // 1. Alloc memory, same arena as VSNR_3D_CREATE_CONTEXT
+    ctx->arena = cpu_malloc(ctx, carve_buffers(ctx, NULL), &failed);
+    if (failed) {
+        VSNR_3D_CPU_DESTROY_CONTEXT(ctx);
+        return NULL;
+    }
+    carve_buffers(ctx, (char*)ctx->arena);
+
+    // 2. Plans
+    double t0 = omp_get_wtime();
+    plan_fft(&ctx->planR2C, &ctx->planC2R, n0, n1, n2, ctx->tmp1, ctx->ftmp1);
+    ctx->prof.allocMs += 1e3 * (omp_get_wtime() - t0);
+
+    return ctx;
+}
+
+// Bytes of a sample of type (VSNR_TYPE_*)
+static size_t sample_size(int type)
+{
+    // -
+    return (type == VSNR_TYPE_UINT8 ? 1 : type == VSNR_TYPE_UINT16 ? 2 : sizeof(float));
+}
+
+// gu0 = (u + offset)/max on the grid of the context, u being a volume of samples of type (VSNR_TYPE_*)
+static void load_volume(CPU_CONTEXT* ctx, const void* u, int type, float max, float offset)
+{
+    if (type == VSNR_TYPE_UINT8)
+        pad_volume((const unsigned char*)u, ctx->v0, ctx->v1, ctx->v2, ctx->gu0, ctx->n0, ctx->n1, ctx->n2, ctx->pad, max, offset);
+    else if (type == VSNR_TYPE_UINT16)
+        pad_volume((const unsigned short*)u, ctx->v0, ctx->v1, ctx->v2, ctx->gu0, ctx->n0, ctx->n1, ctx->n2, ctx->pad, max, offset);
+    else
+        pad_volume((const float*)u, ctx->v0, ctx->v1, ctx->v2, ctx->gu0, ctx->n0, ctx->n1, ctx->n2, ctx->pad, max, offset);
+}
+
+// u = (gu0 - w/n)*max - offset on the volume of the context, as samples of type (VSNR_TYPE_*)
+static void store_volume(CPU_CONTEXT* ctx, const CpR* w, void* u, int type, float max, float offset)
+{
+    if (type == VSNR_TYPE_UINT8)
+        crop_volume(ctx->gu0, w, ctx->n0, ctx->n1, ctx->n2, (unsigned char*)u, ctx->v0, ctx->v1, ctx->v2, max, offset);
+    else if (type == VSNR_TYPE_UINT16)
+        crop_volume(ctx->gu0, w, ctx->n0, ctx->n1, ctx->n2, (unsigned short*)u, ctx->v0, ctx->v1, ctx->v2, max, offset);
+    else
+        crop_volume(ctx->gu0, w, ctx->n0, ctx->n1, ctx->n2, (float*)u, ctx->v0, ctx->v1, ctx->v2, max, offset);
+}
+
+// Same contract as VSNR_3D_RUN_CONTEXT_TYPED, without failure (the buffers are allocated with the context)
+void VSNR_3D_CPU_RUN_CONTEXT(void* context, float* psis, int length, const void* u0, int in, int nit, float beta, void* u, int out, float max, float offset)
+{
+    CPU_CONTEXT* ctx = (CPU_CONTEXT*)context;
+    CpR *w;
+
+    double timed = ctx->prof.fftMs + ctx->prof.transferMs;
+    int threads = omp_get_max_threads();
+
+    running++;
+    share_threads();
+
+    // 1. Copies u0 to the work buffer in float, padded and scaled (the transfers of the GPU backend)
+    ctx->marks[0] = omp_get_wtime();
+    load_volume(ctx, u0, in, max, offset);
+    ctx->marks[1] = omp_get_wtime();
+    ctx->prof.transferMs += 1e3 * (ctx->marks[1] - ctx->marks[0]);
+
+    // 2. Prepares filters
+    CREATE_FILTERS_CPU(ctx, psis, ctx->gu0, length, max);
+    ctx->marks[2] = omp_get_wtime();
+
+    // 3. Denoises the image
+    if (ctx->solver == VSNR_SOLVER_FFT)
+        w = VSNR_ADMM_CPU(ctx, ctx->gu0, nit, beta);
+    else
+        w = VSNR_ADMM_STENCIL_CPU(ctx, ctx->gu0, nit, beta);
+    ctx->solved = 1;
+
+    // 4. Writes u = u0 - w/n to u, cropped, scaled and converted (the final stage, there is no copy back)
+    store_volume(ctx, w, u, out, max, offset);
+    ctx->marks[5] = ctx->marks[6] = omp_get_wtime();
+
+    ctx->prof.transfers += 2;
+    ctx->prof.transferBytes += ctx->v*(sample_size(in) + sample_size(out));
+    ctx->prof.kernelMs += 1e3 * (ctx->marks[6] - ctx->marks[0]) - (ctx->prof.fftMs + ctx->prof.transferMs - timed);
+    ctx->prof.runs++;
+
+    running--;
+    omp_set_num_threads(threads);
+}
+
+// Same contract as VSNR_3D_SET_CONTEXT_RMS
+void VSNR_3D_CPU_SET_CONTEXT_RMS(void* context, float rms)
+{
+    ((CPU_CONTEXT*)context)->rms = rms;
+}
+
+// Same contract as VSNR_3D_SET_CONTEXT_TOLERANCE
+void VSNR_3D_CPU_SET_CONTEXT_TOLERANCE(void* context, float tol, int every)
+{
+    CPU_CONTEXT* ctx = (CPU_CONTEXT*)context;
+
+    ctx->tol   = tol;
+    ctx->every = every;
+}
+
+// Same contract as VSNR_3D_SET_CONTEXT_WARM_START
+void VSNR_3D_CPU_SET_CONTEXT_WARM_START(void* context, int warm)
+{
+    ((CPU_CONTEXT*)context)->warm = warm;
+}
+
+// Same contract as VSNR_3D_GET_CONTEXT_STATS
+void VSNR_3D_CPU_GET_CONTEXT_STATS(void* context, int* iterations, float* primal, float* dual)
+{
+    CPU_CONTEXT* ctx = (CPU_CONTEXT*)context;
+
+    *iterations = ctx->iterations;
+    *primal     = ctx->primal;
+    *dual       = ctx->dual;
+}
+
+// Solves the v0 x v1 x v2 volumes of the next runs on the n0 x n1 x n2 grid of the context, see setPadding
+void VSNR_3D_CPU_SET_CONTEXT_PADDING(void* context, int pad, int v0, int v1, int v2)
+{
+    CPU_CONTEXT* ctx = (CPU_CONTEXT*)context;
+
+    ctx->pad = pad;
+    ctx->v0  = v0;
+    ctx->v1  = v1;
+    ctx->v2  = v2;
+    ctx->v   = (long)v0*v1*v2;
+}
+
+// Same contract as VSNR_3D_GET_CONTEXT_PROFILE
+void VSNR_3D_CPU_GET_CONTEXT_PROFILE(void* context, VSNR_PROFILE* profile)
+{
+    // -
+    *profile = ((CPU_CONTEXT*)context)->prof;
+}
+
+// Same contract as VSNR_3D_SET_CONTEXT_PROGRESS
+void VSNR_3D_CPU_SET_CONTEXT_PROGRESS(void* context, VSNR_PROGRESS progress, int every, void* user)
+{
+    CPU_CONTEXT* ctx = (CPU_CONTEXT*)context;
+
+    ctx->progress      = progress;
+    ctx->progressEvery = every;
+    ctx->progressUser  = user;
+}
+
+// Same contract as VSNR_3D_GET_CONTEXT_TIMES
+void VSNR_3D_CPU_GET_CONTEXT_TIMES(void* context, float* times)
+{
+    CPU_CONTEXT* ctx = (CPU_CONTEXT*)context;
+    double* t = ctx->marks;
+
+    times[VSNR_STAGE_TRANSFER]   = (float)(1e3 * ((t[1] - t[0]) + (t[6] - t[5])));
+    times[VSNR_STAGE_FILTERS]    = (float)(1e3 * (t[2] - t[1]));
+    times[VSNR_STAGE_SETUP]      = (float)(1e3 * (t[3] - t[2]));
+    times[VSNR_STAGE_ITERATIONS] = (float)(1e3 * (t[4] - t[3]));
+    times[VSNR_STAGE_FINAL]      = (float)(1e3 * (t[5] - t[4]));
+}
+
+// Same contract as VSNR_3D_SET_CONTEXT_ACCELERATION
+int VSNR_3D_CPU_SET_CONTEXT_ACCELERATION(void* context, int accel, float alpha)
+{
+    CPU_CONTEXT* ctx = (CPU_CONTEXT*)context;
+    long n = ctx->n;
+    int failed = 0;
+
+    if (accel == VSNR_ACCEL_NESTEROV && !ctx->yp1) {
+        ctx->yp1 = (CpR*)cpu_malloc(ctx, n*sizeof(CpR), &failed);
+        ctx->yp2 = (CpR*)cpu_malloc(ctx, n*sizeof(CpR), &failed);
+        ctx->yp3 = (CpR*)cpu_malloc(ctx, n*sizeof(CpR), &failed);
+        ctx->lp1 = (CpR*)cpu_malloc(ctx, n*sizeof(CpR), &failed);
+        ctx->lp2 = (CpR*)cpu_malloc(ctx, n*sizeof(CpR), &failed);
+        ctx->lp3 = (CpR*)cpu_malloc(ctx, n*sizeof(CpR), &failed);
+
+        if (failed) {
+            ctx->prof.bytes -= n*sizeof(CpR) * ((ctx->yp1 != NULL) + (ctx->yp2 != NULL) + (ctx->yp3 != NULL) +
+                                                (ctx->lp1 != NULL) + (ctx->lp2 != NULL) + (ctx->lp3 != NULL));
+            fftwf_free(ctx->yp1); fftwf_free(ctx->yp2); fftwf_free(ctx->yp3);
+            fftwf_free(ctx->lp1); fftwf_free(ctx->lp2); fftwf_free(ctx->lp3);
+            ctx->yp1 = ctx->yp2 = ctx->yp3 = NULL;
+            ctx->lp1 = ctx->lp2 = ctx->lp3 = NULL;
+            return -1;
+        }
+    }
+
+    ctx->accel = accel;
+    ctx->alpha = (accel == VSNR_ACCEL_RELAX ? alpha : 1);
+    return 0;
+}
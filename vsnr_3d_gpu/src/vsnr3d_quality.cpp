@@ -0,0 +1,331 @@
+// ---------------------------------------------------- //
+//                                                      //
+//             VSNR 3D QUALITY / SPEED HARNESS          //
+//                                                      //
+// ---------------------------------------------------- //
+// Original Algorithm :                                 //
+//   Pierre WEISS, Jerome FEHRENBACH                    //
+// Developers :                                         //
+//   Pierre WEISS, Mogan GAUTHIER, Jean EYMERIE         //
+// ---------------------------------------------------- //
+
+/////////////////////////////////////////////////////////
+//  Denoises synthetic volumes of known ground truth   //
+//  (smooth structures plus stationary noise of the    //
+//  dirac / gabor model of the filters) with           //
+//  VSNR_3D_FIJI_GPU over a matrix of sizes, solvers,  //
+//  precisions, filter gains and iteration counts, and //
+//  reports the PSNR and SSIM to the ground truth next //
+//  to the wall time and the peak memory. The          //
+//  configurations no other one beats on all four are  //
+//  flagged (Pareto).                                  //
+/////////////////////////////////////////////////////////
+
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <vector>
+#include "vsnr3d_tools.h"
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+// One configuration of a size
+typedef struct {
+    int solver, precision, nit;
+    float gain;
+    double ms, psnr, ssim;
+    long long peak;
+} RESULT;
+
+// Standard normal samples of a xorshift generator, the same on every platform
+static double gaussian(uint64_t* state)
+{
+    double u[2];
+
+    for (int i = 0; i < 2; i++) {
+        *state ^= *state << 13;
+        *state ^= *state >> 7;
+        *state ^= *state << 17;
+        u[i] = ((*state >> 11) + 0.5) / 9007199254740992.0; // ]0, 1[
+    }
+    return sqrt(-2.0 * log(u[0])) * cos(2.0 * M_PI * u[1]);
+}
+
+// Ground truth in [0, 1] : smooth background, soft spheres and a slow texture (j along n1, i along n0, k along n2)
+static void truth(float* u, int n0, int n1, int n2)
+{
+    const float c[3][4] = {{0.3f, 0.4f, 0.5f, 0.15f}, {0.7f, 0.6f, 0.4f, 0.1f}, {0.5f, 0.25f, 0.6f, 0.08f}};
+
+    for (int k = 0; k < n2; k++)
+    for (int i = 0; i < n0; i++)
+    for (int j = 0; j < n1; j++) {
+        float x = (float)j / n1, y = (float)i / n0, z = (n2 > 1 ? (float)k / n2 : 0.5f);
+        float v = 0.2f + 0.15f * x + 0.1f * y * z + 0.05f * sinf(6.0f * x) * cosf(4.0f * y);
+
+        for (int s = 0; s < 3; s++) {
+            float d = sqrtf((x - c[s][0])*(x - c[s][0]) + (y - c[s][1])*(y - c[s][1]) + (z - c[s][2])*(z - c[s][2]));
+            v += 0.25f * (1.0f - tanhf((d - c[s][3]) * 60.0f)) / 2.0f;
+        }
+        u[((size_t)k*n0 + i)*n1 + j] = MIN(v, 1.0f);
+    }
+}
+
+// Sampled Gaussian exp(-x^2 / (2 sigma^2)) on [-r, r], r = 4 sigma (at least 0)
+static std::vector<float> gaussian_kernel(float sigma)
+{
+    int r = (int)ceilf(4.0f * sigma);
+    std::vector<float> g(2*r + 1);
+
+    for (int x = -r; x <= r; x++)
+        g[x + r] = expf(-0.5f * x * x / (sigma * sigma));
+    return g;
+}
+
+// Convolves u by the centered kernel g along axis (0 : n1, 1 : n0, 2 : n2), periodic or clamped at the borders
+static void convolve(float* u, int n0, int n1, int n2, int axis, const std::vector<float>& g, bool periodic)
+{
+    int size[3]   = {n1, n0, n2};
+    long stride[3] = {1, n1, (long)n0*n1};
+    int nk = size[axis], r = (int)g.size() / 2;
+    long s = stride[axis], n = (long)n0*n1*n2;
+    std::vector<float> line(nk);
+
+    for (long c = 0; c < n; c++) {
+        if ((c / s) % nk != 0) continue; // first voxel of a line
+
+        for (int a = 0; a < nk; a++) line[a] = u[c + a*s];
+        for (int a = 0; a < nk; a++) {
+            double v = 0;
+            for (int o = -r; o <= r; o++) {
+                int b = a + o;
+                b = (periodic ? ((b % nk) + nk) % nk : MIN(MAX(b, 0), nk - 1));
+                v += g[o + r] * line[b];
+            }
+            u[c + a*s] = (float)v;
+        }
+    }
+}
+
+// Rescales u to a standard deviation of level
+static void normalize_std(float* u, long n, float level)
+{
+    double s = 0, s2 = 0;
+
+    for (long i = 0; i < n; i++) {
+        s  += u[i];
+        s2 += (double)u[i] * u[i];
+    }
+    double sd = sqrt(MAX(s2 / n - (s / n) * (s / n), 1e-30));
+    for (long i = 0; i < n; i++) u[i] = (float)((u[i] - s / n) * level / sd);
+}
+
+// Adds the noise of the filters to u : gaussian white noise convolved (periodically) with the axis-aligned gabor
+// of create_gabor (sigma, thetas 0), of standard deviation levels[0], plus white noise (dirac) of levels[1]
+static void add_noise(float* u, int n0, int n1, int n2, const float* sigma, const float* levels, uint64_t seed)
+{
+    long n = (long)n0*n1*n2;
+    std::vector<float> b(n);
+    uint64_t state = seed * 0x9E3779B97F4A7C15ull + 1;
+
+    for (long i = 0; i < n; i++) b[i] = (float)gaussian(&state);
+    for (int a = 0; a < 3; a++)
+        convolve(b.data(), n0, n1, n2, a, gaussian_kernel(sigma[a]), true);
+    normalize_std(b.data(), n, levels[0]);
+
+    for (long i = 0; i < n; i++) u[i] += b[i] + levels[1] * (float)gaussian(&state);
+}
+
+// PSNR of u to the ground truth t of range 1
+static double psnr(const float* u, const float* t, long n)
+{
+    double mse = 0;
+
+    for (long i = 0; i < n; i++) mse += ((double)u[i] - t[i]) * ((double)u[i] - t[i]);
+    mse /= n;
+    return (mse > 0 ? 10.0 * log10(1.0 / mse) : INFINITY);
+}
+
+// Mean SSIM of u to t (range 1) with a separable gaussian window of sigma 1.5 (clamped at the borders)
+static double ssim(const float* u, const float* t, int n0, int n1, int n2)
+{
+    long n = (long)n0*n1*n2;
+    std::vector<float> mu(u, u + n), mt(t, t + n), uu(n), tt(n), ut(n);
+    std::vector<float> g = gaussian_kernel(1.5f);
+    const double c1 = 0.01 * 0.01, c2 = 0.03 * 0.03;
+    double s = 0, w = 0;
+
+    for (float v : g) w += v;
+    for (float& v : g) v = (float)(v / w);
+
+    for (long i = 0; i < n; i++) {
+        uu[i] = u[i] * u[i];
+        tt[i] = t[i] * t[i];
+        ut[i] = u[i] * t[i];
+    }
+
+    float* maps[5] = {mu.data(), mt.data(), uu.data(), tt.data(), ut.data()};
+    for (int m = 0; m < 5; m++)
+        for (int a = 0; a < 3; a++)
+            if ((a == 0 ? n1 : a == 1 ? n0 : n2) > 1) convolve(maps[m], n0, n1, n2, a, g, false);
+
+    for (long i = 0; i < n; i++) {
+        double a = mu[i], b = mt[i];
+        double va = uu[i] - a*a, vb = tt[i] - b*b, cov = ut[i] - a*b;
+        s += ((2*a*b + c1) * (2*cov + c2)) / ((a*a + b*b + c1) * (va + vb + c2));
+    }
+    return s / n;
+}
+
+// Peak memory of the last destroyed context (the one of VSNR_3D_FIJI_GPU), -1 if unknown
+static long long peak_bytes()
+{
+    char json[1024];
+    const char* p;
+
+    VSNR_3D_GET_CONTEXT_PROFILE_JSON(NULL, json, sizeof(json));
+    p = strstr(json, "\"peak_bytes\":");
+    return (p ? atoll(p + 13) : -1);
+}
+
+static void usage()
+{
+    fprintf(stderr,
+        "usage: vsnr3d_quality [options]\n"
+        "  --sizes WxHxD,...        n1 x n0 x n2 volumes (default 64x64x32,128x128x64)\n"
+        "  --solvers fft,stencil    any of fft, stencil, lowmem (default fft,stencil,lowmem)\n"
+        "  --precisions float,half  any of float, half, bf16 (default float)\n"
+        "  --nits a,b,...           ADMM iterations (default 5,10,20,50,100)\n"
+        "  --gains a,b,...          levels of the filters over the levels of the noise (default 1,10,30)\n"
+        "  --stripes SX,SY,SZ       sigmas of the gabor of the stripes, along W, H, D (default 1,30,1)\n"
+        "  --levels G,D             standard deviations of the stripes and of the white noise (default 0.05,0.01)\n"
+        "  --beta B                 ADMM penalty (default 10)\n"
+        "  --seed S                 seed of the noise (default 1)\n"
+        "  --backend B              gpu, cpu or auto (default auto)\n"
+        "  --json                   JSON lines instead of CSV\n"
+        "\n"
+        "The ground truth lies in [0, 1], the levels are relative to this range. The volumes are denoised with\n"
+        "the filters the noise was made of (a gabor of the given sigmas and a dirac), of levels gain times the noise\n"
+        "levels : the levels of the filters are weights of the model, not standard deviations, and are best swept.\n"
+        "One row per configuration: wall time of VSNR_3D_FIJI_GPU (context included), peak memory of its\n"
+        "context, PSNR and mean SSIM (3D gaussian window of sigma 1.5) to the ground truth, the same for\n"
+        "the noisy input, and pareto = 1 if no other configuration of the size is at least as fast, as small,\n"
+        "as close in PSNR and in SSIM and better on one of them.\n");
+}
+
+// Prints the results of a size, pareto flags included
+static void report(bool json, int n0, int n1, int n2, const std::vector<RESULT>& r, double psnr0, double ssim0)
+{
+    for (size_t a = 0; a < r.size(); a++) {
+        bool pareto = true;
+
+        for (size_t b = 0; b < r.size() && pareto; b++) {
+            bool noWorse = (r[b].ms <= r[a].ms && r[b].peak <= r[a].peak && r[b].psnr >= r[a].psnr && r[b].ssim >= r[a].ssim);
+            bool better  = (r[b].ms <  r[a].ms || r[b].peak <  r[a].peak || r[b].psnr >  r[a].psnr || r[b].ssim >  r[a].ssim);
+            if (b != a && noWorse && better) pareto = false;
+        }
+
+        if (json)
+            printf("{\"n1\":%d,\"n0\":%d,\"n2\":%d,\"solver\":\"%s\",\"precision\":\"%s\",\"backend\":\"%s\",\"gain\":%g,\"nit\":%d,"
+                   "\"ms\":%.3f,\"peak_bytes\":%lld,\"psnr\":%.3f,\"ssim\":%.5f,\"psnr_input\":%.3f,\"ssim_input\":%.5f,\"pareto\":%d}\n",
+                   n1, n0, n2, solverNames[r[a].solver], precisionNames[r[a].precision], backendNames[getBackend()], r[a].gain, r[a].nit,
+                   r[a].ms, r[a].peak, r[a].psnr, r[a].ssim, psnr0, ssim0, pareto ? 1 : 0);
+        else
+            printf("%d,%d,%d,%s,%s,%s,%g,%d,%.3f,%lld,%.3f,%.5f,%.3f,%.5f,%d\n",
+                   n1, n0, n2, solverNames[r[a].solver], precisionNames[r[a].precision], backendNames[getBackend()], r[a].gain, r[a].nit,
+                   r[a].ms, r[a].peak, r[a].psnr, r[a].ssim, psnr0, ssim0, pareto ? 1 : 0);
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char** argv)
+{
+    TOOL_OPTIONS opt;
+    std::vector<int> precisions = {VSNR_PRECISION_FLOAT}, nits = {5, 10, 20, 50, 100};
+    std::vector<float> gains = {1.0f, 10.0f, 30.0f};
+    float sigma[3] = {1.0f, 30.0f, 1.0f}, levels[2] = {0.05f, 0.01f};
+    uint64_t seed = 1;
+    int ret = 0;
+
+    opt.sizes   = "64x64x32,128x128x64";
+    opt.solvers = {VSNR_SOLVER_FFT, VSNR_SOLVER_STENCIL, VSNR_SOLVER_LOWMEM};
+    opt.beta    = 10.0f;
+    opt.json    = false;
+
+    for (int a = 1; a < argc; a++) {
+        int t = tool_option(argc, argv, &a, &opt);
+        if (t < 0) { usage(); return 1; }
+        if (t > 0) continue;
+
+        const char* o = argv[a];
+        const char* v = (a + 1 < argc ? argv[++a] : NULL);
+        if (!v) { usage(); return 1; }
+
+        if      (strcmp(o, "--nits") == 0)   nits = ints(v);
+        else if (strcmp(o, "--gains") == 0)  gains = floats(v);
+        else if (strcmp(o, "--seed") == 0)   seed = strtoull(v, NULL, 10);
+        else if (strcmp(o, "--precisions") == 0) {
+            if (!names(v, precisionNames, 3, &precisions)) { usage(); return 1; }
+        } else if (strcmp(o, "--stripes") == 0) {
+            if (sscanf(v, "%f,%f,%f", &sigma[0], &sigma[1], &sigma[2]) != 3 || MIN(MIN(sigma[0], sigma[1]), sigma[2]) <= 0) { usage(); return 1; }
+        } else if (strcmp(o, "--levels") == 0) {
+            if (sscanf(v, "%f,%f", &levels[0], &levels[1]) != 2 || levels[0] < 0 || levels[1] < 0) { usage(); return 1; }
+        } else { usage(); return 1; }
+    }
+
+    // the filters of the noise : gabor (sigmaX along W, no rotation) then dirac, levels set per gain
+    float psis[10] = {1.0f, 0.0f, sigma[0], sigma[1], sigma[2], 0.0f, 0.0f, 0.0f, 0.0f, 0.0f};
+
+    if (!opt.json)
+        printf("n1,n0,n2,solver,precision,backend,gain,nit,ms,peak_bytes,psnr,ssim,psnr_input,ssim_input,pareto\n");
+
+    for (const char* p = opt.sizes; *p; ) {
+        int n1, n0, n2;
+        if (!next_size(&p, &n0, &n1, &n2)) return 1;
+
+        long n = (long)n0*n1*n2;
+        std::vector<float> t(n), u0(n), u(n);
+        std::vector<RESULT> results;
+        float max = -INFINITY;
+
+        truth(t.data(), n0, n1, n2);
+        u0 = t;
+        add_noise(u0.data(), n0, n1, n2, sigma, levels, seed);
+        for (long i = 0; i < n; i++) max = MAX(max, u0[i]);
+
+        for (int pr : precisions)
+        for (int s : opt.solvers)
+        for (float gain : gains)
+        for (int nit : nits) {
+            RESULT r;
+
+            setPrecision(pr);
+            setSolver(s);
+            psis[1] = gain * levels[0];
+            psis[9] = gain * levels[1];
+
+            r.solver    = s;
+            r.precision = pr;
+            r.gain      = gain;
+            r.nit       = nit;
+            r.ms = now();
+            if (VSNR_3D_FIJI_GPU(psis, 10, u0.data(), n0, n1, n2, nit, opt.beta, u.data(), getMaxBlocks(), max, 1.0f, 1.0f, 1.0f) != 0) {
+                fprintf(stderr, "%dx%dx%d %s %s gain %g nit %d : run failed, skipped\n", n1, n0, n2, solverNames[s], precisionNames[pr], gain, nit);
+                ret = 1;
+                continue;
+            }
+            r.ms   = now() - r.ms;
+            r.peak = peak_bytes();
+            r.psnr = psnr(u.data(), t.data(), n);
+            r.ssim = ssim(u.data(), t.data(), n0, n1, n2);
+            results.push_back(r);
+        }
+
+        report(opt.json, n0, n1, n2, results, psnr(u0.data(), t.data(), n), ssim(u0.data(), t.data(), n0, n1, n2));
+    }
+
+    return ret;
+}
@@ -0,0 +1,323 @@
+
+
+// ---------------------------------------------------- //
+//                                                      //
+//             VSNR 3D TILED (OUT-OF-CORE) DRIVER       //
+//                                                      //
+// ---------------------------------------------------- //
+// Original Algorithm :                                 //
+//   Pierre WEISS, Jerome FEHRENBACH                    //
+// Developers :                                         //
+//   Pierre WEISS, Mogan GAUTHIER, Jean EYMERIE         //
+// ---------------------------------------------------- //
+
+/////////////////////////////////////////////////////////
+//  Denoises a raw float volume that does not fit in   //
+//  memory. The volume is cut in overlapping bricks of //
+//  the same size, so that one context (one filter     //
+//  bank) serves all of them. Bricks are read, solved  //
+//  and blended back in a 3 stage pipeline that never  //
+//  holds more than "depth" bricks on the host.        //
+/////////////////////////////////////////////////////////
+
+
+#ifdef __linux
+#define _export_ extern "C"
+#elif _WIN32
+#define _export_ extern "C" __declspec(dllexport)
+#endif
+
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "vsnr3d.h"
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+#ifdef _WIN32
+#define fseek64 _fseeki64
+#else
+#define fseek64 fseeko
+#endif
+
+
+// BRICKS
+// -------------------------------------------------------------------------
+
+// Origins of the bricks of size b along an axis of size n, consecutive bricks share "overlap" voxels
+// and the last one is moved back to end on the border (all bricks have the same size)
+static std::vector<int> brick_origins(int n, int b, int overlap)
+{
+    std::vector<int> o;
+    int step = MAX(b - overlap, 1);
+
+    for (int s = 0 ; ; s += step) {
+        o.push_back(MIN(s, n - b));
+        if (s + b >= n) break;
+    }
+    return o;
+}
+
+// Blending weights of the bricks along an axis, w[k*b + t] for brick k and local index t.
+// Linear ramps over the overlaps (none on the borders of the volume), normalized so that
+// the weights of each voxel sum to 1.
+static std::vector<float> brick_weights(int n, int b, int overlap, const std::vector<int>& o)
+{
+    int count = (int)o.size();
+    std::vector<float> w(count*b);
+    std::vector<float> sum(n, 0.0f);
+
+    for (int k = 0 ; k < count ; ++k) {
+        for (int t = 0 ; t < b ; ++t) {
+            // distance to the nearest edge of the brick that is not a border of the volume
+            int d0 = (o[k] == 0     ? n : t);
+            int d1 = (o[k] + b == n ? n : b - 1 - t);
+            float r = (MIN(d0, d1) + 1.0f) / (overlap + 1.0f);
+
+            w[k*b + t] = MIN(r, 1.0f);
+            sum[o[k] + t] += w[k*b + t];
+        }
+    }
+
+    for (int k = 0 ; k < count ; ++k)
+        for (int t = 0 ; t < b ; ++t)
+            w[k*b + t] /= sum[o[k] + t];
+
+    return w;
+}
+
+
+// I/O
+// -------------------------------------------------------------------------
+
+// Reads the brick of size b0 x b1 x b2 at (o0, o1, o2), one row (b1 floats) at a time
+static bool read_brick(FILE* f, float* u, int n0, int n1, int o0, int o1, int o2, int b0, int b1, int b2)
+{
+    for (int k = 0 ; k < b2 ; ++k) {
+        for (int j = 0 ; j < b0 ; ++j) {
+            long long c = o1 + (long long)n1*((o0 + j) + (long long)n0*(o2 + k));
+
+            if (fseek64(f, c*sizeof(float), SEEK_SET) != 0) return false;
+            if (fread(&u[b1*(j + b0*k)], sizeof(float), b1, f) != (size_t)b1) return false;
+        }
+    }
+    return true;
+}
+
+// out += w .* u on the brick, parts of the output not yet written read as 0
+static bool accumulate_brick(FILE* f, float* u, float* row, int n0, int n1, int o0, int o1, int o2, int b0, int b1, int b2, const float* w0, const float* w1, const float* w2)
+{
+    for (int k = 0 ; k < b2 ; ++k) {
+        for (int j = 0 ; j < b0 ; ++j) {
+            long long c = o1 + (long long)n1*((o0 + j) + (long long)n0*(o2 + k));
+            float* ur = &u[b1*(j + b0*k)];
+            float wjk = w0[j] * w2[k];
+            size_t r;
+
+            if (fseek64(f, c*sizeof(float), SEEK_SET) != 0) return false;
+            r = fread(row, sizeof(float), b1, f);
+            memset(row + r, 0, (b1 - r)*sizeof(float));
+
+            for (int i = 0 ; i < b1 ; ++i)
+                row[i] += wjk * w1[i] * ur[i];
+
+            if (fseek64(f, c*sizeof(float), SEEK_SET) != 0) return false;
+            if (fwrite(row, sizeof(float), b1, f) != (size_t)b1) return false;
+        }
+    }
+    return true;
+}
+
+// Max and rms of the whole file, read sequentially by chunks of "chunk" floats
+static bool volume_stats(FILE* f, long long n, long long chunk, float* max, float* rms)
+{
+    std::vector<float> buf(chunk);
+    double sum = 0.0;
+    float m = -INFINITY;
+
+    if (fseek64(f, 0, SEEK_SET) != 0) return false;
+
+    for (long long c = 0 ; c < n ; c += chunk) {
+        size_t len = (size_t)MIN(chunk, n - c);
+
+        if (fread(buf.data(), sizeof(float), len, f) != len) return false;
+
+        for (size_t i = 0 ; i < len ; ++i) {
+            sum += (double)buf[i] * buf[i];
+            m = MAX(m, buf[i]);
+        }
+    }
+
+    *max = m;
+    *rms = (float)sqrt(sum / n);
+    return true;
+}
+
+
+// PIPELINE
+// -------------------------------------------------------------------------
+
+// Slots cycle free -> loaded (reader) -> solved (solver) -> free (writer)
+typedef struct {
+    std::mutex lock;
+    std::condition_variable changed;
+    std::deque<int> free, loaded, solved; // slot indices
+    bool failed;
+} PIPELINE;
+
+static void push(PIPELINE* p, std::deque<int>& q, int slot)
+{
+    std::lock_guard<std::mutex> guard(p->lock);
+    q.push_back(slot);
+    p->changed.notify_all();
+}
+
+// Returns the next slot of q, -1 if the pipeline failed
+static int pop(PIPELINE* p, std::deque<int>& q)
+{
+    std::unique_lock<std::mutex> guard(p->lock);
+    int slot;
+
+    p->changed.wait(guard, [&]{ return p->failed || !q.empty(); });
+    if (p->failed) return -1;
+
+    slot = q.front();
+    q.pop_front();
+    return slot;
+}
+
+static void fail(PIPELINE* p)
+{
+    std::lock_guard<std::mutex> guard(p->lock);
+    p->failed = true;
+    p->changed.notify_all();
+}
+
+
+// MAIN FUNCTION
+// -------------------------------------------------------------------------
+
+// Denoises the raw float32 volume "input" (n1 fastest, then n0, then n2, same layout as u0) into "output"
+// with bricks of b0 x b1 x b2 voxels (clamped to the volume) overlapping by "overlap" voxels.
+// At most "depth" bricks (>= 1) are held on the host, reading, solving and writing run concurrently.
+// max <= 0 takes the maximum of the volume. Returns 0 on success, -1 if a file, the context or the run of a brick
+// failed (the pipeline stops at the first failed brick, output is then incomplete).
+_export_ int VSNR_3D_TILED(const char* input, const char* output, float* psis, int length, int n0, int n1, int n2, int nit, float beta, int nBlocks, float max, float dx, float dy, float dz, int b0, int b1, int b2, int overlap, int depth)
+{
+    FILE *fin, *fout;
+    void* ctx;
+    float vmax, rms;
+    long long nb;
+    int count, ret = 0;
+    PIPELINE p;
+
+    b0 = MAX(MIN(b0, n0), 1);
+    b1 = MAX(MIN(b1, n1), 1);
+    b2 = MAX(MIN(b2, n2), 1);
+    nb = (long long)b0*b1*b2;
+    depth = MAX(depth, 1);
+
+    std::vector<int> o0 = brick_origins(n0, b0, overlap);
+    std::vector<int> o1 = brick_origins(n1, b1, overlap);
+    std::vector<int> o2 = brick_origins(n2, b2, overlap);
+    std::vector<float> w0 = brick_weights(n0, b0, overlap, o0);
+    std::vector<float> w1 = brick_weights(n1, b1, overlap, o1);
+    std::vector<float> w2 = brick_weights(n2, b2, overlap, o2);
+    count = (int)(o0.size() * o1.size() * o2.size());
+
+    fin = fopen(input, "rb");
+    if (!fin) return -1;
+
+    fout = fopen(output, "w+b");
+    if (!fout) {
+        fclose(fin);
+        return -1;
+    }
+
+    // 1. Global statistics, the filters of every brick are scaled by the rms of the volume
+    if (!volume_stats(fin, (long long)n0*n1*n2, nb, &vmax, &rms)) {
+        fclose(fin);
+        fclose(fout);
+        return -1;
+    }
+    if (max <= 0) max = vmax;
+
+    // 2. One context for all bricks, the filter bank is built by the first run only
+    ctx = VSNR_3D_CREATE_CONTEXT(b0, b1, b2, dx, dy, dz, nBlocks);
+    if (!ctx) {
+        fclose(fin);
+        fclose(fout);
+        return -1;
+    }
+    VSNR_3D_SET_CONTEXT_RMS(ctx, rms);
+
+    // 3. Pipeline, brick "index" is (i1, i0, i2) with i1 fastest
+    std::vector< std::vector<float> > u(depth, std::vector<float>(nb));
+    std::vector<int> brick(depth);
+    p.failed = false;
+    for (int s = 0 ; s < depth ; ++s) p.free.push_back(s);
+
+    std::thread reader([&]{
+        for (int index = 0 ; index < count ; ++index) {
+            int s = pop(&p, p.free);
+            int i1 = index % o1.size(), i0 = (index / o1.size()) % o0.size(), i2 = index / (o1.size() * o0.size());
+
+            if (s < 0) return;
+            brick[s] = index;
+            if (!read_brick(fin, u[s].data(), n0, n1, o0[i0], o1[i1], o2[i2], b0, b1, b2)) {
+                fail(&p);
+                return;
+            }
+            push(&p, p.loaded, s);
+        }
+    });
+
+    std::thread writer([&]{
+        std::vector<float> row(b1);
+
+        for (int done = 0 ; done < count ; ++done) {
+            int s = pop(&p, p.solved);
+            int index, i1, i0, i2;
+
+            if (s < 0) return;
+            index = brick[s];
+            i1 = index % o1.size(), i0 = (index / o1.size()) % o0.size(), i2 = index / (o1.size() * o0.size());
+
+            if (!accumulate_brick(fout, u[s].data(), row.data(), n0, n1, o0[i0], o1[i1], o2[i2], b0, b1, b2, &w0[i0*b0], &w1[i1*b1], &w2[i2*b2])) {
+                fail(&p);
+                return;
+            }
+            push(&p, p.free, s);
+        }
+    });
+
+    for (int done = 0 ; done < count ; ++done) {
+        int s = pop(&p, p.loaded);
+
+        if (s < 0) break;
+        if (VSNR_3D_RUN_CONTEXT(ctx, psis, length, u[s].data(), nit, beta, u[s].data(), max) != 0) {
+            fail(&p);
+            break;
+        }
+        push(&p, p.solved, s);
+    }
+
+    reader.join();
+    writer.join();
+
+    if (p.failed || fflush(fout) != 0) ret = -1;
+
+    VSNR_3D_DESTROY_CONTEXT(ctx);
+    fclose(fin);
+    if (fclose(fout) != 0) ret = -1;
+
+    return ret;
+}
@@ -0,0 +1,136 @@
+// ---------------------------------------------------- //
+//                                                      //
+//             VSNR 3D TOOLS                            //
+//                                                      //
+// ---------------------------------------------------- //
+// Original Algorithm :                                 //
+//   Pierre WEISS, Jerome FEHRENBACH                    //
+// Developers :                                         //
+//   Pierre WEISS, Mogan GAUTHIER, Jean EYMERIE         //
+// ---------------------------------------------------- //
+
+/////////////////////////////////////////////////////////
+//  Option parsing and timing shared by vsnr3d_bench   //
+//  and vsnr3d_quality.                                //
+/////////////////////////////////////////////////////////
+
+#ifndef VSNR3D_TOOLS_H
+#define VSNR3D_TOOLS_H
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <chrono>
+#include "vsnr3d.h"
+
+// Names of the settings on the command line, indexed by their VSNR_* value
+static const char* const solverNames[]    = {"fft", "stencil", "lowmem"};
+static const char* const precisionNames[] = {"float", "half", "bf16"};
+static const char* const backendNames[]   = {"gpu", "cpu"};
+static const char* const paddingNames[]   = {"none", "mirror", "periodic"};
+
+// Options of both tools
+typedef struct {
+    const char* sizes;          // "WxHxD,...", see next_size
+    std::vector<int> solvers;   // VSNR_SOLVER_*
+    float beta;
+    bool json;
+} TOOL_OPTIONS;
+
+// Index of name in names, -1 if not found
+static inline int lookup(const char* name, const char* const* names, int count)
+{
+    for (int i = 0; i < count; i++)
+        if (strcmp(name, names[i]) == 0) return i;
+    return -1;
+}
+
+// Wall clock in ms
+static inline double now()
+{
+    // -
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Parses "a,b,c" into ints
+static inline std::vector<int> ints(const char* s)
+{
+    std::vector<int> v;
+    for (const char* p = s; *p; ) {
+        v.push_back(atoi(p));
+        while (*p && *p != ',') p++;
+        if (*p) p++;
+    }
+    return v;
+}
+
+// Parses "a,b,c" into floats
+static inline std::vector<float> floats(const char* s)
+{
+    std::vector<float> v;
+    for (const char* p = s; *p; ) {
+        v.push_back((float)atof(p));
+        while (*p && *p != ',') p++;
+        if (*p) p++;
+    }
+    return v;
+}
+
+// Parses "a,b,...,names[k]" into indices of names, false if one is unknown
+static inline bool names(const char* s, const char* const* list, int count, std::vector<int>* v)
+{
+    char buf[256];
+
+    strncpy(buf, s, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = 0;
+    v->clear();
+    for (char* t = strtok(buf, ","); t; t = strtok(NULL, ",")) {
+        int i = lookup(t, list, count);
+        if (i < 0) return false;
+        v->push_back(i);
+    }
+    return !v->empty();
+}
+
+// Reads the next "WxHxD" of the list at *p into n1 x n0 x n2 and moves *p past it,
+// false (after printing it) if it is not a valid size
+static inline bool next_size(const char** p, int* n0, int* n1, int* n2)
+{
+    *n0 = *n1 = *n2 = 0;
+    if (sscanf(*p, "%dx%dx%d", n1, n0, n2) != 3 || *n0 < 1 || *n1 < 1 || *n2 < 1) {
+        fprintf(stderr, "invalid size %s\n", *p);
+        return false;
+    }
+    while (**p && **p != ',') (*p)++;
+    if (**p) (*p)++;
+    return true;
+}
+
+// Takes the option at argv[*a] if it is one of both tools (--sizes, --solvers, --beta, --backend, --json) and moves
+// *a past its value. Returns 1 if taken, 0 if the tool has to parse it (*a unchanged), -1 if its value is missing
+// or invalid.
+static inline int tool_option(int argc, char** argv, int* a, TOOL_OPTIONS* opt)
+{
+    const char* o = argv[*a];
+    const char* v = (*a + 1 < argc ? argv[*a+1] : NULL);
+
+    if (strcmp(o, "--json") == 0) { opt->json = true; return 1; }
+    if (strcmp(o, "--sizes") && strcmp(o, "--solvers") && strcmp(o, "--beta") && strcmp(o, "--backend")) return 0;
+    if (!v) return -1;
+    (*a)++;
+
+    if      (strcmp(o, "--sizes") == 0)   opt->sizes = v;
+    else if (strcmp(o, "--beta") == 0)    opt->beta = (float)atof(v);
+    else if (strcmp(o, "--solvers") == 0) {
+        if (!names(v, solverNames, 3, &opt->solvers)) return -1;
+    } else {
+        int b = (strcmp(v, "auto") == 0 ? VSNR_BACKEND_AUTO : lookup(v, backendNames, 2));
+        if (b < 0 && strcmp(v, "auto") != 0) return -1;
+        setBackend(b);
+    }
+    return 1;
+}
+
+#endif
@@ -0,0 +1,167 @@
+
+
+// ---------------------------------------------------- //
+//                                                      //
+//           VSNR ADMM CONTROL (GPU AND CPU)            //
+//                                                      //
+// ---------------------------------------------------- //
+// Original Algorithm :                                 //
+//   Pierre WEISS, Jerome FEHRENBACH                    //
+// Developers :                                         //
+//   Pierre WEISS, Mogan GAUTHIER, Jean EYMERIE         //
+// ---------------------------------------------------- //
+
+/////////////////////////////////////////////////////////
+//  Settings, instrumentation and host-side control    //
+//  of the ADMM shared by the GPU engine               //
+//  (vsnr_engine.cuh) and the CPU backend              //
+//  (vsnr3d_cpu.cpp) : which iterations sum and check  //
+//  the residuals, the stopping test, the fast ADMM    //
+//  restart and the residual balancing. Plain C++,     //
+//  no CUDA.                                           //
+/////////////////////////////////////////////////////////
+
+#ifndef VSNR_ADMM_H
+#define VSNR_ADMM_H
+
+
+#include <math.h>
+#include <cmath>
+#include <algorithm>
+
+#ifdef __CUDACC__
+#define VSNR_HD __host__ __device__
+#else
+#define VSNR_HD
+#endif
+
+#define VSNR_ARENA_ALIGN (256) // alignment of the buffers carved from one allocation, as cudaMalloc, see carve
+
+#define VSNR_RES_SIZE (5) // sums of |Ax - y|^2, |y - y_prev|^2, |Ax|^2, |y|^2, |lambda|^2, see add_residuals
+#define VSNR_FAST_SIZE (3) // a, c and gamma of the fast ADMM, see restart_step
+
+#define VSNR_SOLVER_FFT     (0) // D R2C + D C2R per iteration
+#define VSNR_SOLVER_STENCIL (1) // 1 R2C + 1 C2R per iteration, real-space gradients
+#define VSNR_SOLVER_LOWMEM  (2) // stencil iterations, Du0 and fphi_k recomputed on the fly
+
+#define VSNR_ACCEL_NONE     (0) // plain ADMM, fixed beta
+#define VSNR_ACCEL_RELAX    (1) // over-relaxation, Ax replaced by alpha Ax + (1 - alpha) y_prev
+#define VSNR_ACCEL_NESTEROV (2) // fast ADMM with restart, y and lambda extrapolated every iteration
+#define VSNR_ACCEL_ADAPTIVE (3) // residual balancing, beta is updated on the checked iterations
+
+#define VSNR_PRECISION_FLOAT (0) // storage of the ADMM state y, lambda, Du0 (computations are in float)
+#define VSNR_PRECISION_HALF  (1) // IEEE half, 5 bits exponent, 10 bits mantissa
+#define VSNR_PRECISION_BF16  (2) // bfloat16, 8 bits exponent, 7 bits mantissa
+
+// Instrumentation of a solver, cumulative over its runs, see VSNR_3D_GET_CONTEXT_PROFILE
+typedef struct {
+    long long ffts;          // FFT executions
+    long long kernels;       // kernel launches and cuBLAS calls (not counted by the CPU backend)
+    long long allocs;        // buffers allocated
+    long long transfers;     // copies between host and device (u0, u, residuals, filter maxima)
+    long long transferBytes;
+    long long bytes;         // memory held by the context, buffers and cuFFT work areas
+    long long peakBytes;     // largest value of bytes
+    double fftMs;            // time spent in the FFTs
+    double kernelMs;         // time of the runs spent outside of the FFTs and the timed transfers
+    double allocMs;          // time spent in the allocations and the FFT plans
+    double transferMs;
+    int runs;
+} VSNR_PROFILE;
+
+// Called every "every" iterations of a run (and on the last one) with the relative residuals, see VSNR_3D_SET_CONTEXT_PROGRESS
+typedef void (*VSNR_PROGRESS)(int iteration, int nit, float primal, float dual, void* user);
+
+// Settings and statistics of the iterations, common to the GPU engine (VSNR_ENGINE) and the CPU backend (CPU_CONTEXT)
+typedef struct {
+    int warm;        // runs start from y and lambda of the previous run
+    int solved;      // y and lambda hold the state of a finished run
+
+    float tol;       // stops when both relative residuals are below tol (0 : runs nit iterations)
+    int every;       // residuals are checked every "every" iterations, and after the last one
+    int iterations;  // iterations and relative residuals of the last run
+    float primal, dual;
+
+    VSNR_PROGRESS progress; // NULL if none
+    int progressEvery;
+    void* progressUser;
+
+    int accel;       // VSNR_ACCEL_*
+    float alpha;     // relaxation factor, 1 unless accel == VSNR_ACCEL_RELAX
+} VSNR_CONTROL;
+
+
+// CONTROL
+// -------------------------------------------------------------------------
+
+
+// Returns 1 if the residuals summed during iteration k (of nit) have to be read by read_residuals
+inline int is_checked(const VSNR_CONTROL* c, int k, int nit)
+{
+    int periodic = (c->tol > 0 || c->accel == VSNR_ACCEL_ADAPTIVE);
+
+    return (k == nit-1 || (periodic && (k+1) % c->every == 0) || (c->progress && (k+1) % c->progressEvery == 0));
+}
+
+// Returns 1 if the residuals of an iteration have to be summed : on the checked iterations, and every
+// iteration with VSNR_ACCEL_NESTEROV (read by restart_step)
+inline int is_summed(const VSNR_CONTROL* c, int check)
+{
+    // -
+    return (check || c->accel == VSNR_ACCEL_NESTEROV);
+}
+
+// Reads the VSNR_RES_SIZE sums res of iteration k (of nit), returns 1 if the loop can stop.
+// primal = |Ax - y| / max(|Ax|, |y|), dual = beta |y - y_prev| / |lambda| (the A^T of the dual residual is left out)
+template <typename T>
+int read_residuals(VSNR_CONTROL* c, const T* res, int k, int nit, float beta)
+{
+    int stop;
+
+    c->iterations = k+1;
+    c->primal = std::sqrt(res[0]) / std::max<double>(std::sqrt(std::max(res[2], res[3])), 1e-20);
+    c->dual   = beta * std::sqrt(res[1]) / std::max<double>(std::sqrt(res[4]), 1e-20);
+
+    stop = (c->tol > 0 && c->primal <= c->tol && c->dual <= c->tol);
+
+    if (c->progress && (stop || k == nit-1 || (k+1) % c->progressEvery == 0))
+        c->progress(k+1, nit, c->primal, c->dual, c->progressUser);
+
+    return stop;
+}
+
+// Fast ADMM with restart (Goldstein, O'Donoghue, Setzer, Baraniuk 2014) : a is the momentum, c the last accepted
+// residual (1 and +inf before the first iteration) and ck = beta (res[0] + res[1]) = beta |Ax - y|^2 + beta |y - y_hat|^2
+// the combined residual of the iteration. Returns the weight gamma of the next extrapolate, the momentum restarts
+// when the residual does not decrease (gamma = -1 then).
+VSNR_HD inline float restart_step(float* a, float* c, float ck)
+{
+    float a1, gamma;
+
+    if (ck >= 0.999f * (*c)) {
+        *a = 1;
+        *c = *c / 0.999f;
+        return -1;
+    }
+
+    a1    = (1 + sqrtf(1 + 4*(*a)*(*a))) / 2;
+    gamma = (*a - 1) / a1;
+    *a = a1;
+    *c = ck;
+    return gamma;
+}
+
+// Residual balancing (Boyd et al. 2011, 3.4.1) on the sums res of the last check : beta is doubled when
+// the primal residual |Ax - y| is 10 times the dual residual beta |y - y_prev|, halved in the opposite
+// case. lambda is unscaled and is kept as is, the x updates take beta as it is.
+template <typename T>
+void balance_beta(const T* res, float* beta)
+{
+    T r = std::sqrt(res[0]);
+    T s = (*beta) * std::sqrt(res[1]);
+
+    if (r > 10 * s) *beta *= 2;
+    else if (s > 10 * r) *beta /= 2;
+}
+
+#endif
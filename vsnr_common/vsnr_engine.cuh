@@ -0,0 +1,1326 @@
+
+
+// ---------------------------------------------------- //
+//                                                      //
+//           VSNR ENGINE (2D AND 3D SOLVER)             //
+//                                                      //
+// ---------------------------------------------------- //
+// Original Algorithm :                                 //
+//   Pierre WEISS, Jerome FEHRENBACH                    //
+// Developers :                                         //
+//   Pierre WEISS, Mogan GAUTHIER, Jean EYMERIE         //
+// ---------------------------------------------------- //
+
+/////////////////////////////////////////////////////////
+//  ADMM shared by vsnr2d.cu (D = 2) and vsnr3d.cu     //
+//  (D = 3) : the kernels and the driver of a run on a //
+//  VSNR_ENGINE<D> (solvers, precisions, residual      //
+//  checks and acceleration). The D components of the  //
+//  gradient (y, lambda, Du0, fphi...) are passed as a //
+//  VSNR_VEC and the loops over them are unrolled at   //
+//  compile time. The 2D library runs its planes as    //
+//  one D = 2 grid stacked along n2. The settings and //
+//  the host-side control are in vsnr_admm.h, shared   //
+//  with the CPU backend. Included once by each        //
+//  library.                                           //
+/////////////////////////////////////////////////////////
+
+#ifndef VSNR_ENGINE_CUH
+#define VSNR_ENGINE_CUH
+
+
+#include <math.h>
+#include <stdio.h>
+#include "cuda.h"
+#include "cuda_runtime.h"
+#include "cufft.h"
+#include <cuda_fp16.h>
+#include <cuda_bf16.h>
+#include <cublas_v2.h>
+#include <mutex>
+#include "vsnr_admm.h"
+
+#define PI (3.141592653589793)
+
+#define SQ(a) ((a)*(a))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+typedef cufftComplex CuC; // struct { float x, y }
+typedef cufftReal    CuR; // float
+
+#define VSNR_MAX_DEVICES (16) // devices whose launch limits are cached, see device_limits
+
+#define VSNR_MAX_SAMPLES (0x7fffffff / 2) // largest real or spectrum size of a grid, the kernels index it with int and step past it by their stride
+
+#define VSNR_MARK_COUNT (6) // boundaries of the stages of a run, the driver records 3 (setup done) and 4 (iterations done), see mark
+
+#define VSNR_TIMED_FFT      (0) // operations timed by events, see timed_begin
+#define VSNR_TIMED_TRANSFER (1)
+#define VSNR_TIMED_POOL     (64) // timed operations between two reads of their events
+
+// D buffers, one per axis (e.g. y1, y2, y3), passed by value to the kernels
+template <int D, typename T>
+struct VSNR_VEC {
+    T* c[D];
+};
+
+// Grid of n1 (fastest) x n0 x n2 samples, spacing h[k] along the axis k (0 : n1, 1 : n0, 2 : n2).
+// The kernels differentiate along the first D axes, the 2D library stacks its planes along n2.
+typedef struct {
+    int n0, n1, n2;
+    float h[3];
+} VSNR_GRID;
+
+// Returns the VSNR_VEC of type S of D untyped buffers (state buffers, see ld / st)
+template <int D, typename S>
+VSNR_VEC<D, S> vec_cast(VSNR_VEC<D, void> v)
+{
+    VSNR_VEC<D, S> r;
+
+    for (int k = 0 ; k < D ; ++k)
+        r.c[k] = (S*)v.c[k];
+    return r;
+}
+
+
+// DEBUG
+// -------------------------------------------------------------------------
+
+
+// Disp lastCudaError in file
+void __dispLastCudaError(FILE* file, const char* string)
+{
+    // -
+    fprintf(file,"~ %s: %s\n", string, cudaGetErrorString(cudaGetLastError()));
+}
+
+// Disp a string relative to err from a cufft function in file
+void __dispCufftError(FILE* file, const char* string, int err)
+{
+    switch (err) {
+        case 0 :
+            fprintf(file, "# %s: CUFFT_SUCCESS\n", string);
+            break;
+        case 1 :
+            fprintf(file, "# %s: CUFFT_INVALID_PLAN\n", string);
+            break;
+        case 2 :
+            fprintf(file, "# %s: CUFFT_ALLOC_FAILED\n", string);
+            break;
+        case 3 :
+            fprintf(file, "# %s: CUFFT_INVALID_TYPE\n", string);
+            break;
+        case 4 :
+            fprintf(file, "# %s: CUFFT_INVALID_VALUE\n", string);
+            break;
+        case 5 :
+            fprintf(file, "# %s: CUFFT_INTERNAL_ERROR\n", string);
+            break;
+        case 6 :
+            fprintf(file, "# %s: CUFFT_EXEC_FAILED\n", string);
+            break;
+        case 7 :
+            fprintf(file, "# %s: CUFFT_SETUP_FAILED\n", string);
+            break;
+        case 8 :
+            fprintf(file, "# %s: CUFFT_INVALID_SIZE\n", string);
+            break;
+        case 9 :
+            fprintf(file, "# %s: CUFFT_UNALIGNED_DATA\n", string);
+            break;
+        case 10 :
+            fprintf(file, "# %s: CUFFT_INCOMPLETE_PARAMETER_LIST\n", string);
+            break;
+        case 11 :
+            fprintf(file, "# %s: CUFFT_INVALID_DEVICE\n", string);
+            break;
+        case 12 :
+            fprintf(file, "# %s: CUFFT_PARSE_ERROR\n", string);
+            break;
+        case 13 :
+            fprintf(file, "# %s: CUFFT_NO_WORKSPACE\n", string);
+            break;
+        case 14 :
+            fprintf(file, "# %s: CUFFT_NOT_IMPLEMENTED\n", string);
+            break;
+        case 15 :
+            fprintf(file, "# %s: CUFFT_LICENSE_ERROR\n", string);
+            break;
+        case 16 :
+            fprintf(file, "# %s: CUFFT_NOT_SUPPORTED\n", string);
+            break;
+        default :
+            fprintf(file, "# %s: UNKNOWN_ERROR\n", string);
+    }
+}
+
+
+// -------------------------------------------------------------------------
+
+
+// u = u*val;
+__global__ void multiply(CuR* u, int n, float val)
+{
+    int i    = blockIdx.x * blockDim.x + threadIdx.x;
+    int step = blockDim.x * gridDim.x;
+
+    for ( ; i < n ; i += step)
+        u[i] = u[i] * val;
+}
+
+// u = u/val;
+__global__ void divide(CuR* u, int n, float val)
+{
+    int i    = blockIdx.x * blockDim.x + threadIdx.x;
+    int step = blockDim.x * gridDim.x;
+
+    for ( ; i < n ; i += step)
+        u[i] = u[i] / val;
+}
+
+// adds two vectors w = u + v
+__global__ void add(CuR* u, CuR* v, CuR* w, int n)
+{
+    int i    = blockIdx.x * blockDim.x + threadIdx.x;
+    int step = blockDim.x * gridDim.x;
+
+    for ( ; i < n ; i += step)
+        w[i] = u[i] + v[i];
+}
+
+// substracts two vectors w = u - v
+__global__ void substract(CuR* u, CuR* v, CuR* w, int n)
+{
+    int i    = blockIdx.x * blockDim.x + threadIdx.x;
+    int step = blockDim.x * gridDim.x;
+
+    for ( ; i < n ; i += step)
+        w[i] = u[i] - v[i];
+}
+
+
+// GRID
+// -------------------------------------------------------------------------
+
+
+// Size of the axis k
+__host__ __device__ inline int axis_size(const VSNR_GRID& g, int k)
+{
+    // -
+    return (k == 0 ? g.n1 : (k == 1 ? g.n0 : g.n2));
+}
+
+// Samples of one transform : the whole grid for D = 3, one plane for D = 2 (the n2 planes are transformed as a batch)
+template <int D>
+__host__ __device__ inline int fft_samples(const VSNR_GRID& g)
+{
+    // -
+    return (D == 3 ? g.n2 : 1)*g.n0*g.n1;
+}
+
+// Size of the spectrum of one transform (R2C layout), the filter spectra are shared by the planes
+template <int D>
+__host__ __device__ inline int fft_spectrum(const VSNR_GRID& g)
+{
+    // -
+    return (D == 3 ? g.n2 : 1)*g.n0*(g.n1/2+1);
+}
+
+// Filter scale of the plane of i in arrays of planes of size p, 1 if scale is NULL (one plane), see VSNR_ENGINE
+__device__ inline float plane_scale(const float* scale, int i, int p)
+{
+    // -
+    return (scale ? scale[i / p] : 1.0f);
+}
+
+// Index of c + ek (periodic) in a real array of the grid
+__device__ inline int next_index(const VSNR_GRID& g, int c, int k)
+{
+    int s  = (k == 0 ? 1 : (k == 1 ? g.n1 : g.n1*g.n0));
+    int nk = axis_size(g, k);
+    int i  = (k == 2 ? c / s : (c / s) % nk);
+
+    return (i == nk-1) ? c - s*(nk-1) : c + s;
+}
+
+// Index of c - ek (periodic) in a real array of the grid
+__device__ inline int prev_index(const VSNR_GRID& g, int c, int k)
+{
+    int s  = (k == 0 ? 1 : (k == 1 ? g.n1 : g.n1*g.n0));
+    int nk = axis_size(g, k);
+    int i  = (k == 2 ? c / s : (c / s) % nk);
+
+    return (i == 0) ? c + s*(nk-1) : c - s;
+}
+
+// Frequency index along the axis k of i in a spectrum of the grid (n1/2+1 x n0 x n2, R2C layout)
+__device__ inline int frequency(const VSNR_GRID& g, int i, int k)
+{
+    int h1 = g.n1/2+1;
+
+    return (k == 0 ? i % h1 : (k == 1 ? (i / h1) % g.n0 : i / (h1*g.n0)));
+}
+
+
+// FINITE DIFFERENCES
+// -------------------------------------------------------------------------
+
+
+// Spectra of the finite differences d1, d2, d3 (periodic, forward, spacing h)
+// fft(dk)[f] = (1 - exp(2i pi f / nk)) / h at the frequency index f of an axis
+// of size nk, 1 / h on a singleton axis. They are never stored, the kernels
+// below take them in closed form.
+
+// Returns fft(dk)[f]
+__device__ CuC fd_value(int f, int nk, float h)
+{
+    CuC fd;
+
+    if (nk > 1) {
+        fd.x = 2.0 * SQ(sinf(PI * f / nk)) / h; // 1 - cos = 2 sin^2
+        fd.y = -sinf(2.0 * PI * f / nk) / h;
+    } else {
+        fd.x = 1.0 / h;
+        fd.y = 0.0;
+    }
+    return fd;
+}
+
+// Returns |fft(dk)[f]|
+__device__ float fd_norm(int f, int nk, float h)
+{
+    // -
+    return (nk > 1 ? 2.0 * fabsf(sinf(PI * f / nk)) : 1.0) / h;
+}
+
+// Compute Phi : fphik = fdk .* fpsi, fphi = sum_k |fphik|^2 (fpsi and fphi real), on the spectrum of one transform
+template <int D>
+__global__ void compute_phi(float* fpsi, VSNR_VEC<D, CuC> fphik, float* fphi, VSNR_GRID g)
+{
+    int m    = fft_spectrum<D>(g);
+    int i    = blockIdx.x * blockDim.x + threadIdx.x;
+    int step = blockDim.x * gridDim.x;
+    CuC fd, *f;
+    float p, s;
+
+    for ( ; i < m ; i += step) {
+        p = fpsi[i];
+        s = 0.0;
+
+        #pragma unroll
+        for (int k = 0 ; k < D ; ++k) {
+            fd = fd_value(frequency(g, i, k), axis_size(g, k), g.h[k]);
+            f  = fphik.c[k];
+            f[i].x = fd.x * p;
+            f[i].y = fd.y * p;
+            s += SQ(f[i].x);
+            s += SQ(f[i].y);
+        }
+
+        fphi[i] = s;
+    }
+}
+
+// fphi = sum_k |fdk|^2, i.e. sum_k |fphik|^2 = fpsi^2 fphi without storing fphik (stencil solvers)
+template <int D>
+__global__ void compute_phi_psi(float* fphi, VSNR_GRID g)
+{
+    int m    = fft_spectrum<D>(g);
+    int i    = blockIdx.x * blockDim.x + threadIdx.x;
+    int step = blockDim.x * gridDim.x;
+    float s;
+
+    for ( ; i < m ; i += step) {
+        s = 0.0;
+
+        #pragma unroll
+        for (int k = 0 ; k < D ; ++k)
+            s += SQ(fd_norm(frequency(g, i, k), axis_size(g, k), g.h[k]));
+
+        fphi[i] = s;
+    }
+}
+
+// fx = sum_k conj(s fphik) .* ftmpk / (1 + beta s^2 fphi) on the m values of the spectra of the planes, s being the
+// scale of the plane (see plane_scale) and fphik, fphi the mt values shared by the planes (see compute_phi)
+template <int D>
+__global__ void update_fx(VSNR_VEC<D, CuC> fphik, VSNR_VEC<D, CuC> ftmp, float* fphi, CuC* fx, const float* scale, float beta, int mt, int m)
+{
+    int i    = blockIdx.x * blockDim.x + threadIdx.x;
+    int step = blockDim.x * gridDim.x;
+    float sx, sy, s, d;
+    CuC p, t;
+    int f;
+
+    for ( ; i < m ; i += step) {
+        f  = i % mt;
+        s  = plane_scale(scale, i, mt);
+        d  = 1 + beta*SQ(s)*fphi[f];
+        sx = 0.0;
+        sy = 0.0;
+
+        #pragma unroll
+        for (int k = 0 ; k < D ; ++k) {
+            p = fphik.c[k][f];
+            t = ftmp.c[k][i];
+            sx += (p.x * t.x) + (p.y * t.y);
+            sy += (t.y * p.x) - (p.y * t.x);
+        }
+
+        fx[i].x = (s * sx) / d;
+        fx[i].y = (s * sy) / d;
+    }
+}
+
+// ftmpk = s fphik .* fx, see update_fx
+template <int D>
+__global__ void product_phi(VSNR_VEC<D, CuC> fphik, CuC* fx, VSNR_VEC<D, CuC> ftmp, const float* scale, int mt, int m)
+{
+    int i    = blockIdx.x * blockDim.x + threadIdx.x;
+    int step = blockDim.x * gridDim.x;
+    float s;
+    CuC p, x;
+    int f;
+
+    for ( ; i < m ; i += step) {
+        f = i % mt;
+        s = plane_scale(scale, i, mt);
+        x = fx[i];
+
+        #pragma unroll
+        for (int k = 0 ; k < D ; ++k) {
+            p = fphik.c[k][f];
+            ftmp.c[k][i].x = s * ((p.x * x.x) - (p.y * x.y));
+            ftmp.c[k][i].y = s * ((p.y * x.x) + (p.x * x.y));
+        }
+    }
+}
+
+// ftmp = s fpsi .* fx (fpsi real), see update_fx
+__global__ void product_psi(float* fpsi, CuC* fx, CuC* ftmp, const float* scale, int mt, int m)
+{
+    int i    = blockIdx.x * blockDim.x + threadIdx.x;
+    int step = blockDim.x * gridDim.x;
+    float p;
+
+    for ( ; i < m ; i += step) {
+        p = plane_scale(scale, i, mt) * fpsi[i % mt];
+        ftmp[i].x = p * fx[i].x;
+        ftmp[i].y = p * fx[i].y;
+    }
+}
+
+
+// ADMM STATE
+// -------------------------------------------------------------------------
+
+
+// Loads / stores of the ADMM state, S = float, __half or __nv_bfloat16 (see VSNR_PRECISION_*)
+__device__ inline float ld(float v)         { return v; }
+__device__ inline float ld(__half v)        { return __half2float(v); }
+__device__ inline float ld(__nv_bfloat16 v) { return __bfloat162float(v); }
+
+__device__ inline void st(float* p, float v)         { *p = v; }
+__device__ inline void st(__half* p, float v)        { *p = __float2half(v); }
+__device__ inline void st(__nv_bfloat16* p, float v) { *p = __float2bfloat16(v); }
+
+// Computes tmpk = -lambdak + beta * yk
+template <int D, typename S>
+__global__ void betay_m_lambda(VSNR_VEC<D, S> l, VSNR_VEC<D, S> y, VSNR_VEC<D, CuR> tmp, float beta, int n)
+{
+    int i    = blockIdx.x * blockDim.x + threadIdx.x;
+    int step = blockDim.x * gridDim.x;
+
+    for ( ; i < n ; i += step) {
+        #pragma unroll
+        for (int k = 0 ; k < D ; ++k)
+            tmp.c[k][i] = (beta * ld(y.c[k][i])) - ld(l.c[k][i]);
+    }
+}
+
+// Adds the residual terms of a voxel to the per-thread sums v (see VSNR_RES_SIZE) :
+// a = Ax, y = new y, p = previous y, l = new lambda
+template <int D>
+__device__ void add_residuals(float* v, const float* a, const float* y, const float* p, const float* l)
+{
+    float s[VSNR_RES_SIZE] = {0, 0, 0, 0, 0};
+
+    #pragma unroll
+    for (int k = 0 ; k < D ; ++k) {
+        s[0] += SQ(a[k] - y[k]);
+        s[1] += SQ(y[k] - p[k]);
+        s[2] += SQ(a[k]);
+        s[3] += SQ(y[k]);
+        s[4] += SQ(l[k]);
+    }
+
+    for (int r = 0 ; r < VSNR_RES_SIZE ; ++r)
+        v[r] += s[r];
+}
+
+// Adds the per-thread sums v of a block to res, one atomicAdd per block and sum
+// (called by all the threads of the block, blockDim.x <= 1024)
+__device__ void reduce_residuals(float* res, float* v)
+{
+    __shared__ float s[1024];
+    int t = threadIdx.x;
+
+    for (int k = 0 ; k < VSNR_RES_SIZE ; ++k) {
+        s[t] = v[k];
+        __syncthreads();
+
+        for (int h = 1 ; h < (int)blockDim.x ; h *= 2) {
+            if (t % (2*h) == 0 && t + h < (int)blockDim.x) s[t] += s[t+h];
+            __syncthreads();
+        }
+
+        if (t == 0) atomicAdd(&res[k], s[0]);
+        __syncthreads();
+    }
+}
+
+// Returns the prox of |.| / beta at g - t, i.e. z = g - t (1 - 1 / (beta |t|)) if |t| > 1 / beta, g otherwise
+template <int D>
+__device__ void shrink(const float* g, const float* t, float beta, float* z)
+{
+    float ng = 0.0;
+
+    #pragma unroll
+    for (int k = 0 ; k < D ; ++k)
+        ng += SQ(t[k]);
+    ng = sqrtf(ng);
+
+    #pragma unroll
+    for (int k = 0 ; k < D ; ++k)
+        z[k] = (ng > 1.0 / beta) ? g[k] - t[k] * (1.0 - (1.0 / (beta * ng))) : g[k];
+}
+
+// y = prox_{f1/beta}(Ax+lambda/beta), adds the residuals to res unless it is NULL. tmp holds nt Ax (unnormalized
+// C2R of nt samples), Ax is relaxed to alpha Ax + (1 - alpha) y_prev in place for update_lambda.
+template <int D, typename S>
+__global__ void update_y(VSNR_VEC<D, S> du0, VSNR_VEC<D, CuR> tmp, VSNR_VEC<D, S> l, VSNR_VEC<D, S> y, float beta, float alpha, float nt, int n, float* res)
+{
+    int i    = blockIdx.x * blockDim.x + threadIdx.x;
+    int step = blockDim.x * gridDim.x;
+    float p[D], a[D], g[D], t[D], z[D], m[D];
+    float v[VSNR_RES_SIZE] = {0, 0, 0, 0, 0};
+
+    for ( ; i < n ; i += step) {
+        #pragma unroll
+        for (int k = 0 ; k < D ; ++k) {
+            p[k] = ld(y.c[k][i]);
+            g[k] = ld(du0.c[k][i]);
+            a[k] = tmp.c[k][i] / nt;
+            tmp.c[k][i] = (alpha * a[k]) + ((1.0f - alpha) * p[k]);
+            t[k] = g[k] - (tmp.c[k][i] + (ld(l.c[k][i]) / beta));
+        }
+
+        shrink<D>(g, t, beta, z);
+
+        #pragma unroll
+        for (int k = 0 ; k < D ; ++k) {
+            st(&y.c[k][i], z[k]);
+            m[k] = ld(l.c[k][i]) + (beta * (tmp.c[k][i] - z[k]));
+        }
+
+        if (res) add_residuals<D>(v, a, z, p, m);
+    }
+
+    if (res) reduce_residuals(res, v);
+}
+
+// -
+template <typename S>
+__global__ void update_lambda(S* lambda, CuR* tmp, S* y, float beta, int n)
+{
+    int i    = blockIdx.x * blockDim.x + threadIdx.x ;
+    int step = blockDim.x * gridDim.x;
+
+    for ( ; i < n ; i += step)
+        st(&lambda[i], ld(lambda[i]) + (beta * (tmp[i] - ld(y[i]))));
+}
+
+// restart_step on the device, 1 thread : w holds the momentum a, the last accepted residual c and the
+// weight gamma of the next extrapolate, res the sums of the iteration (the first one if first is set)
+__global__ void restart_weight(const float* res, float beta, float* w, int first)
+{
+    float a = (first ? 1.0f : w[0]);
+    float c = (first ? INFINITY : w[1]);
+
+    w[2] = restart_step(&a, &c, beta * (res[0] + res[1]));
+    w[0] = a;
+    w[1] = c;
+}
+
+// Fast ADMM step with the weight gamma = w[2] of restart_weight : y = y + gamma (y - yp) and yp = y,
+// gamma = 0 only saves y and gamma < 0 (restart) sets y back to the previous iterate yp
+template <typename S>
+__global__ void extrapolate(S* y, S* yp, const float* w, int n)
+{
+    int i    = blockIdx.x * blockDim.x + threadIdx.x;
+    int step = blockDim.x * gridDim.x;
+    float gamma = w[2];
+    float t;
+
+    for ( ; i < n ; i += step) {
+        if (gamma < 0) {
+            st(&y[i], ld(yp[i]));
+            continue;
+        }
+        t = ld(y[i]);
+        st(&y[i], t + (gamma * (t - ld(yp[i]))));
+        st(&yp[i], t);
+    }
+}
+
+
+// REAL-SPACE OPERATORS
+// -------------------------------------------------------------------------
+
+
+// Real-space finite differences (see fd_value)
+// Dk u[c] = (u[c] - u[c+ek]) / hk and DkT u[c] = (u[c] - u[c-ek]) / hk, periodic.
+// On a singleton axis they reduce to u / hk like their spectra.
+
+// Computes duk = Dk u
+template <int D, typename S>
+__global__ void gradient(CuR* u, VSNR_VEC<D, S> du, VSNR_GRID g)
+{
+    int n    = g.n0*g.n1*g.n2;
+    int c    = blockIdx.x * blockDim.x + threadIdx.x;
+    int step = blockDim.x * gridDim.x;
+    float o[D];
+
+    #pragma unroll
+    for (int k = 0 ; k < D ; ++k)
+        o[k] = (axis_size(g, k) > 1 ? 1.0 : 0.0);
+
+    for ( ; c < n ; c += step) {
+        #pragma unroll
+        for (int k = 0 ; k < D ; ++k)
+            st(&du.c[k][c], (u[c] - o[k] * u[next_index(g, c, k)]) / g.h[k]);
+    }
+}
+
+// Computes tmp = sum_k DkT (beta*yk - lk)
+template <int D, typename S>
+__global__ void adjoint_betay_m_lambda(VSNR_VEC<D, S> l, VSNR_VEC<D, S> y, CuR* tmp, float beta, VSNR_GRID g)
+{
+    int n    = g.n0*g.n1*g.n2;
+    int c    = blockIdx.x * blockDim.x + threadIdx.x;
+    int step = blockDim.x * gridDim.x;
+    float o[D], s;
+    int ck;
+
+    #pragma unroll
+    for (int k = 0 ; k < D ; ++k)
+        o[k] = (axis_size(g, k) > 1 ? 1.0 : 0.0);
+
+    for ( ; c < n ; c += step) {
+        s = 0.0;
+
+        #pragma unroll
+        for (int k = 0 ; k < D ; ++k) {
+            ck = prev_index(g, c, k);
+            s += ((beta * ld(y.c[k][c]) - ld(l.c[k][c])) - o[k] * (beta * ld(y.c[k][ck]) - ld(l.c[k][ck]))) / g.h[k];
+        }
+
+        tmp[c] = s;
+    }
+}
+
+// fx = conj(s fpsi) .* ftmp / (1 + beta s^2 fpsi^2 fphi), fpsi and fphi real (see compute_phi_psi and update_fx)
+__global__ void update_fx_psi(float* fpsi, CuC* ftmp, float* fphi, CuC* fx, const float* scale, float beta, int mt, int m)
+{
+    int i    = blockIdx.x * blockDim.x + threadIdx.x;
+    int step = blockDim.x * gridDim.x;
+    float p, r;
+    int f;
+
+    for ( ; i < m ; i += step) {
+        f = i % mt;
+        p = plane_scale(scale, i, mt) * fpsi[f];
+        r = p / (1 + beta*SQ(p)*fphi[f]);
+        fx[i].x = r * ftmp[i].x;
+        fx[i].y = r * ftmp[i].y;
+    }
+}
+
+// y = prox_{f1/beta}(Ax+lambda/beta) then lambda += beta (Ax - y) at voxel c, with Ax relaxed by alpha
+// g = Du0[c], a = Ax[c], adds the residuals to v unless it is NULL
+template <int D, typename S>
+__device__ void shrink_y_lambda(int c, const float* g, const float* a, VSNR_VEC<D, S> l, VSNR_VEC<D, S> y, float beta, float alpha, float* v)
+{
+    float p[D], h[D], m[D], t[D], z[D];
+
+    #pragma unroll
+    for (int k = 0 ; k < D ; ++k) {
+        p[k] = ld(y.c[k][c]);
+        h[k] = (alpha * a[k]) + ((1.0f - alpha) * p[k]);
+        m[k] = ld(l.c[k][c]);
+        t[k] = g[k] - (h[k] + (m[k] / beta));
+    }
+
+    shrink<D>(g, t, beta, z);
+
+    #pragma unroll
+    for (int k = 0 ; k < D ; ++k) {
+        m[k] = m[k] + (beta * (h[k] - z[k]));
+        st(&y.c[k][c], z[k]);
+        st(&l.c[k][c], m[k]);
+    }
+
+    if (v) add_residuals<D>(v, a, z, p, m);
+}
+
+// update_y followed by update_lambda, Ax = D (psi * x) is taken on the fly
+// from w = nt (psi * x), the unnormalized C2R of fpsi .* fx (see fft_samples)
+template <int D, typename S>
+__global__ void update_y_lambda(VSNR_VEC<D, S> du0, CuR* w, VSNR_VEC<D, S> l, VSNR_VEC<D, S> y, float beta, float alpha, VSNR_GRID g, float* res)
+{
+    int n    = g.n0*g.n1*g.n2;
+    int nt   = fft_samples<D>(g);
+    int c    = blockIdx.x * blockDim.x + threadIdx.x;
+    int step = blockDim.x * gridDim.x;
+    float o[D], du[D], a[D];
+    float v[VSNR_RES_SIZE] = {0, 0, 0, 0, 0};
+
+    #pragma unroll
+    for (int k = 0 ; k < D ; ++k)
+        o[k] = (axis_size(g, k) > 1 ? 1.0 : 0.0);
+
+    for ( ; c < n ; c += step) {
+        #pragma unroll
+        for (int k = 0 ; k < D ; ++k) {
+            du[k] = ld(du0.c[k][c]);
+            a[k]  = (w[c] - o[k] * w[next_index(g, c, k)]) / (g.h[k] * nt); // Axk
+        }
+
+        shrink_y_lambda<D>(c, du, a, l, y, beta, alpha, res ? v : NULL);
+    }
+
+    if (res) reduce_residuals(res, v);
+}
+
+// Same as update_y_lambda with Du0 recomputed from u0 (low-memory solver)
+template <int D, typename S>
+__global__ void update_y_lambda_u0(CuR* u0, CuR* w, VSNR_VEC<D, S> l, VSNR_VEC<D, S> y, float beta, float alpha, VSNR_GRID g, float* res)
+{
+    int n    = g.n0*g.n1*g.n2;
+    int nt   = fft_samples<D>(g);
+    int c    = blockIdx.x * blockDim.x + threadIdx.x;
+    int step = blockDim.x * gridDim.x;
+    float o[D], du[D], a[D];
+    float v[VSNR_RES_SIZE] = {0, 0, 0, 0, 0};
+    int ck;
+
+    #pragma unroll
+    for (int k = 0 ; k < D ; ++k)
+        o[k] = (axis_size(g, k) > 1 ? 1.0 : 0.0);
+
+    for ( ; c < n ; c += step) {
+        #pragma unroll
+        for (int k = 0 ; k < D ; ++k) {
+            ck    = next_index(g, c, k);
+            du[k] = (u0[c] - o[k] * u0[ck]) / g.h[k];         // Dku0
+            a[k]  = (w[c] - o[k] * w[ck]) / (g.h[k] * nt);   // Axk
+        }
+
+        shrink_y_lambda<D>(c, du, a, l, y, beta, alpha, res ? v : NULL);
+    }
+
+    if (res) reduce_residuals(res, v);
+}
+
+
+// FILTERS
+// -------------------------------------------------------------------------
+
+
+// Sets fpsi = |f|^2 (real)
+__global__ void compute_squared_norm(CuC* f, float* fpsi, int m)
+{
+    int i    = blockIdx.x * blockDim.x + threadIdx.x;
+    int step = blockDim.x * gridDim.x;
+
+    for ( ; i < m ; i += step)
+        fpsi[i] = SQ(f[i].x) + SQ(f[i].y);
+}
+
+// Sets fpsi = |fftn(dirac)|^2 = val^2
+__global__ void create_dirac_spectrum(float* fpsi, float val, int m)
+{
+    int i    = blockIdx.x * blockDim.x + threadIdx.x;
+    int step = blockDim.x * gridDim.x;
+
+    for ( ; i < m ; i += step)
+        fpsi[i] = SQ(val);
+}
+
+// Gabor filter of the first D axes without modulation : amp exp(-|S^-1 R x|^2 / 2), S = diag(sigma), R a
+// rotation (row k gives the coordinate k of R x), sampled on the grid at x = center - index, see create_gabor.
+// Only |fftn(psi)| is needed, which does not depend on the integer part of the center.
+typedef struct {
+    float R[9];       // D x D, row major
+    float sigma[3];
+    float frac[3];    // fractional part of the center along the axes of the grid (0 : n1, 1 : n0, 2 : n2)
+    float amp;
+    int r;            // aliases summed on each side of the spectrum, see gabor_aliases
+} VSNR_GABOR;
+
+// Returns the number of aliases of the spectrum of gb that matter on each side along an axis, or -1 if the
+// filter has to be sampled in space and transformed : its Gaussian does not fit in the grid (6 standard
+// deviations on both sides of the center) or it is so narrow that the spectrum folds more than twice.
+template <int D>
+int gabor_aliases(const VSNR_GABOR& gb, VSNR_GRID g)
+{
+    float smin = INFINITY, e;
+    int r;
+
+    for (int a = 0 ; a < D ; ++a) {
+        // standard deviation along the axis a
+        e = 0;
+        for (int b = 0 ; b < D ; ++b)
+            e += SQ(gb.R[b*D+a] * gb.sigma[b]);
+        if (6*sqrtf(e) > axis_size(g, a)/2 - 1) return -1;
+
+        smin = MIN(smin, gb.sigma[a]);
+    }
+
+    // an alias r+1 frequencies away weighs less than exp(-2 pi^2 smin^2 (r + 1/2)^2) < 1e-7
+    r = (int)ceilf(0.903f / smin - 0.5f);
+    r = MAX(r, 0);
+    return (r <= 2 ? r : -1);
+}
+
+// Sets fpsi = |fftn(psi)|^2 of the Gabor gb in closed form (gabor_aliases(gb, g) >= 0) : the sampled Gaussian
+// has the periodized Fourier transform sum_s amp (2 pi)^(D/2) det(S) exp(-|S R w_s|^2 / 2), w_s = 2 pi (f + s)
+// for the frequencies f in [-1/2, 1/2[ of the axes, one phase per alias when the center is not on a sample.
+template <int D>
+__global__ void create_gabor_spectrum(float* fpsi, VSNR_GABOR gb, VSNR_GRID g)
+{
+    int m    = g.n0*g.n2*(g.n1/2+1);
+    int i    = blockIdx.x * blockDim.x + threadIdx.x;
+    int step = blockDim.x * gridDim.x;
+    int r[3] = {0, 0, 0};
+    float f[3], w[3], t, q, re, im, amp = gb.amp;
+
+    for (int a = 0 ; a < D ; ++a) {
+        r[a] = gb.r;
+        amp *= sqrtf(2.0 * PI) * gb.sigma[a];
+    }
+
+    for ( ; i < m ; i += step) {
+        for (int a = 0 ; a < D ; ++a) {
+            int nk = axis_size(g, a);
+            int fk = frequency(g, i, a);
+            f[a] = (float)(2*fk < nk ? fk : fk - nk) / nk;
+        }
+
+        re = im = 0;
+        for (int s2 = -r[2] ; s2 <= r[2] ; ++s2)
+        for (int s1 = -r[1] ; s1 <= r[1] ; ++s1)
+        for (int s0 = -r[0] ; s0 <= r[0] ; ++s0) {
+            int s[3] = {s0, s1, s2};
+
+            for (int a = 0 ; a < D ; ++a)
+                w[a] = 2.0 * PI * (f[a] + s[a]);
+
+            // |S R w|^2 and the phase of the alias
+            q = t = 0;
+            for (int b = 0 ; b < D ; ++b) {
+                float x = 0;
+                for (int a = 0 ; a < D ; ++a)
+                    x += gb.R[b*D+a] * w[a];
+                q += SQ(gb.sigma[b] * x);
+                t += s[b] * gb.frac[b];
+            }
+            q = expf(-0.5 * q);
+            re += q * cosf(2.0 * PI * t);
+            im -= q * sinf(2.0 * PI * t);
+        }
+
+        fpsi[i] = SQ(amp) * (SQ(re) + SQ(im));
+    }
+}
+
+// Sets *mmax = max(*mmax, max_k max |fdk| * fpsi) over the D axes in one sweep of fpsi (real, >= 0), *mmax
+// is zeroed beforehand and stays on the device. The non-negative maxima of the blocks order as their int bits.
+template <int D>
+__global__ void fd_product_max(float* fpsi, VSNR_GRID g, float* mmax)
+{
+    __shared__ float s[1024];
+    int m    = g.n0*g.n2*(g.n1/2+1);
+    int i    = blockIdx.x * blockDim.x + threadIdx.x;
+    int step = blockDim.x * gridDim.x;
+    int t    = threadIdx.x;
+    float v = 0.0, fd;
+
+    for ( ; i < m ; i += step) {
+        fd = 0.0;
+
+        #pragma unroll
+        for (int k = 0 ; k < D ; ++k)
+            fd = MAX(fd, fd_norm(frequency(g, i, k), axis_size(g, k), g.h[k]));
+
+        v = MAX(v, fpsi[i] * fd);
+    }
+
+    s[t] = v;
+    __syncthreads();
+
+    for (int h = 1 ; h < (int)blockDim.x ; h *= 2) {
+        if (t % (2*h) == 0 && t + h < (int)blockDim.x) s[t] = MAX(s[t], s[t+h]);
+        __syncthreads();
+    }
+
+    if (t == 0) atomicMax((int*)mmax, __float_as_int(s[0]));
+}
+
+// Sets fsum += fpsitemp / alpha with alpha = *mmax / eta, mmax on the device (see fd_product_max)
+__global__ void update_psi(float* fpsitemp, float* fsum, float* mmax, float eta, int m)
+{
+    int i    = blockIdx.x * blockDim.x + threadIdx.x;
+    int step = blockDim.x * gridDim.x;
+    float alpha = *mmax / eta;
+
+    for ( ; i < m ; i += step)
+        fsum[i] += fpsitemp[i] / alpha;
+}
+
+// Launch limits (maxGridSize[1], maxThreadsDim[0]) of the current device, the properties
+// of the first VSNR_MAX_DEVICES devices are only queried once
+inline void device_limits(int* grid, int* blocks)
+{
+    static int cache[VSNR_MAX_DEVICES][2];
+    static std::mutex lock;
+    struct cudaDeviceProp properties;
+    int device = 0;
+
+    cudaGetDevice(&device);
+
+    if (device < VSNR_MAX_DEVICES) {
+        std::lock_guard<std::mutex> guard(lock);
+
+        if (!cache[device][0]) {
+            cudaGetDeviceProperties(&properties, device);
+            cache[device][0] = properties.maxGridSize[1];
+            cache[device][1] = properties.maxThreadsDim[0];
+        }
+        *grid   = cache[device][0];
+        *blocks = cache[device][1];
+        return;
+    }
+
+    cudaGetDeviceProperties(&properties, device);
+    *grid   = properties.maxGridSize[1];
+    *blocks = properties.maxThreadsDim[0];
+}
+
+// Bytes rounded up to VSNR_ARENA_ALIGN
+inline size_t aligned(size_t bytes)
+{
+    // -
+    return (bytes + VSNR_ARENA_ALIGN-1) / VSNR_ARENA_ALIGN * VSNR_ARENA_ALIGN;
+}
+
+// Takes the next buffer of "bytes" from the arena at *p (a single cudaMalloc holding the buffers of a solver)
+inline void* carve(char** p, size_t bytes)
+{
+    void* b = *p;
+
+    *p += aligned(bytes);
+    return b;
+}
+
+
+// SOLVER
+// -------------------------------------------------------------------------
+
+
+// State of the ADMM on a grid of D dimensions : plans, buffers and settings shared by the runs. The 3D contexts
+// (VSNR_CONTEXT in vsnr3d.cu, D = 3) and the 2D batches (VSNR_BATCH in vsnr2d.cu, D = 2, the planes stacked along
+// n2) derive from it, allocate its buffers and call VSNR_ADMM. The settings of the iterations are in VSNR_CONTROL.
+template <int D>
+struct VSNR_ENGINE : VSNR_CONTROL {
+    int solver;      // VSNR_SOLVER_*, decides which buffers below are allocated
+    int precision;   // VSNR_PRECISION_*, type of the state buffers du0, y, l (and yp, lp)
+
+    int n, m;        // real samples and spectrum values of the whole grid
+    VSNR_GRID grid;
+    int dimGrid, dimBlock;
+
+    cufftHandle planR2C, planC2R; // one transform per plane for D = 2, see fft_samples
+    cudaStream_t stream;          // every kernel, copy and FFT of the runs
+
+    float *fpsi, *fphi; // real spectra of one transform (fft_spectrum), fpsi = fftn(psi) is set before a run
+    float* scale;       // device, filter scale of each plane, NULL if there is one scale (1), see plane_scale
+    CuC *fx;            // complex
+
+    float* res;      // device, VSNR_RES_SIZE sums
+    float* fast;     // device, VSNR_FAST_SIZE, state of restart_weight (VSNR_ACCEL_NESTEROV only)
+    float sums[VSNR_RES_SIZE]; // host copy of res at the last check
+
+    cudaEvent_t marks[VSNR_MARK_COUNT]; // recorded at the boundaries of a run, see mark
+    VSNR_PROFILE prof;
+    cudaEvent_t timed[2*VSNR_TIMED_POOL]; // start and stop of the timed operations not read yet, see harvest
+    int timedKind[VSNR_TIMED_POOL];       // VSNR_TIMED_*
+    int timedCount;
+
+    VSNR_VEC<D, void> yp, lp; // state, previous y and lambda (VSNR_ACCEL_NESTEROV only)
+
+    VSNR_VEC<D, CuC> fphik; // complex, fphi1, fphi2 (, fphi3) of one transform (VSNR_SOLVER_FFT only)
+    VSNR_VEC<D, CuC> ftmp;  // complex, ftmp.c[0] only but with VSNR_SOLVER_FFT
+    VSNR_VEC<D, CuR> tmp;   // real, tmp.c[0] only but with VSNR_SOLVER_FFT
+
+    VSNR_VEC<D, void> du0;  // state, d1u0, d2u0 (, d3u0), not stored by VSNR_SOLVER_LOWMEM
+    VSNR_VEC<D, void> y;    // state
+    VSNR_VEC<D, void> l;    // state
+};
+
+// Creates the events of mark and timed_begin
+template <int D>
+void create_events(VSNR_ENGINE<D>* e)
+{
+    for (int k = 0 ; k < VSNR_MARK_COUNT ; ++k)
+        cudaEventCreate(&e->marks[k]);
+    for (int k = 0 ; k < 2*VSNR_TIMED_POOL ; ++k)
+        cudaEventCreate(&e->timed[k]);
+}
+
+// Destroys the events of create_events, if they were created
+template <int D>
+void destroy_events(VSNR_ENGINE<D>* e)
+{
+    for (int k = 0 ; k < VSNR_MARK_COUNT ; ++k)
+        if (e->marks[k]) cudaEventDestroy(e->marks[k]);
+    for (int k = 0 ; k < 2*VSNR_TIMED_POOL ; ++k)
+        if (e->timed[k]) cudaEventDestroy(e->timed[k]);
+}
+
+// Records the boundary k of a run (see VSNR_MARK_COUNT)
+template <int D>
+void mark(VSNR_ENGINE<D>* e, int k)
+{
+    // -
+    cudaEventRecord(e->marks[k], e->stream);
+}
+
+// Adds the times of the FFTs and transfers recorded since the last call to the profile
+template <int D>
+void harvest(VSNR_ENGINE<D>* e)
+{
+    float t;
+
+    if (e->timedCount == 0) return;
+
+    cudaEventSynchronize(e->timed[2*e->timedCount-1]);
+    for (int i = 0 ; i < e->timedCount ; ++i) {
+        cudaEventElapsedTime(&t, e->timed[2*i], e->timed[2*i+1]);
+        if (e->timedKind[i] == VSNR_TIMED_FFT) e->prof.fftMs      += t;
+        else                                   e->prof.transferMs += t;
+    }
+    e->timedCount = 0;
+}
+
+// Brackets an FFT or a transfer (VSNR_TIMED_*) with events, read once the pool is full
+template <int D>
+void timed_begin(VSNR_ENGINE<D>* e, int kind)
+{
+    if (e->timedCount == VSNR_TIMED_POOL) harvest(e);
+
+    e->timedKind[e->timedCount] = kind;
+    cudaEventRecord(e->timed[2*e->timedCount], e->stream);
+}
+
+// -
+template <int D>
+void timed_end(VSNR_ENGINE<D>* e)
+{
+    cudaEventRecord(e->timed[2*e->timedCount+1], e->stream);
+    e->timedCount++;
+}
+
+// fftn, counted and timed
+template <int D>
+void fft_r2c(VSNR_ENGINE<D>* e, CuR* in, CuC* out)
+{
+    timed_begin(e, VSNR_TIMED_FFT);
+    cufftExecR2C(e->planR2C, in, out);
+    timed_end(e);
+    e->prof.ffts++;
+}
+
+// ifftn (unnormalized), counted and timed
+template <int D>
+void fft_c2r(VSNR_ENGINE<D>* e, CuC* in, CuR* out)
+{
+    timed_begin(e, VSNR_TIMED_FFT);
+    cufftExecC2R(e->planC2R, in, out);
+    timed_end(e);
+    e->prof.ffts++;
+}
+
+// cudaMemcpy on the stream of the engine, counted and timed, returns once dst is written
+template <int D>
+void copy(VSNR_ENGINE<D>* e, void* dst, const void* src, size_t bytes, cudaMemcpyKind kind)
+{
+    timed_begin(e, VSNR_TIMED_TRANSFER);
+    cudaMemcpyAsync(dst, src, bytes, kind, e->stream);
+    timed_end(e);
+    cudaStreamSynchronize(e->stream);
+    e->prof.transfers++;
+    e->prof.transferBytes += bytes;
+}
+
+// Grid size of a kernel launch, counts the launch
+template <int D>
+int launch(VSNR_ENGINE<D>* e)
+{
+    e->prof.kernels++;
+    return e->dimGrid;
+}
+
+// Returns 1 if the residuals summed during iteration k (of nit) have to be read by check_residuals (see is_checked),
+// res is cleared whenever they are summed (see is_summed)
+template <int D>
+int check_iteration(VSNR_ENGINE<D>* e, int k, int nit)
+{
+    int check = is_checked(e, k, nit);
+
+    if (is_summed(e, check))
+        cudaMemsetAsync(e->res, 0, VSNR_RES_SIZE*sizeof(float), e->stream);
+    return check;
+}
+
+// Buffer the residuals of an iteration are summed into, NULL if they are not needed, see check_iteration
+template <int D>
+float* residuals(VSNR_ENGINE<D>* e, int check)
+{
+    // -
+    return (is_summed(e, check) ? e->res : NULL);
+}
+
+// Reads the residuals summed during iteration k (of nit) into sums, returns 1 if the loop can stop (see read_residuals)
+template <int D>
+int check_residuals(VSNR_ENGINE<D>* e, int k, int nit, float beta)
+{
+    copy(e, e->sums, e->res, VSNR_RES_SIZE*sizeof(float), cudaMemcpyDeviceToHost);
+    return read_residuals(e, e->sums, k, nit, beta);
+}
+
+// Fast ADMM step on y and lambda after iteration k, the weight stays on the device (see restart_weight)
+template <int D, typename S>
+void extrapolate_all(VSNR_ENGINE<D>* e, int k, float beta)
+{
+    int n = e->n;
+
+    restart_weight<<<1,1,0,e->stream>>>(e->res, beta, e->fast, k == 0);
+    e->prof.kernels++;
+
+    for (int d = 0 ; d < D ; ++d) {
+        extrapolate<<<launch(e),e->dimBlock,0,e->stream>>>((S*)e->y.c[d], (S*)e->yp.c[d], e->fast, n);
+        extrapolate<<<launch(e),e->dimBlock,0,e->stream>>>((S*)e->l.c[d], (S*)e->lp.c[d], e->fast, n);
+    }
+}
+
+// Initial state of a run : y and lambda cleared (unless they are kept by a warm start), and the fast ADMM state
+template <int D, typename S>
+void init_state(VSNR_ENGINE<D>* e)
+{
+    int n = e->n;
+
+    if (!(e->warm && e->solved)) {
+        for (int k = 0 ; k < D ; ++k) {
+            cudaMemsetAsync(e->y.c[k], 0, n*sizeof(S), e->stream);
+            cudaMemsetAsync(e->l.c[k], 0, n*sizeof(S), e->stream);
+        }
+    }
+
+    e->iterations = 0;
+    e->primal = e->dual = 0;
+
+    if (e->accel == VSNR_ACCEL_NESTEROV) {
+        for (int k = 0 ; k < D ; ++k) {
+            cudaMemsetAsync(e->yp.c[k], 0, n*sizeof(S), e->stream);
+            cudaMemsetAsync(e->lp.c[k], 0, n*sizeof(S), e->stream);
+        }
+    }
+}
+
+// FFT solver, S is the type of the state buffers (see VSNR_PRECISION_*). Returns w = nt (psi * x) where nt
+// is the size of one transform (see fft_samples) : the result is u = u0 - w/nt, written by the caller.
+template <int D, typename S>
+CuR* VSNR_ADMM_GPU(VSNR_ENGINE<D>* e, float *u0, int nit, float beta)
+{
+    int n  = e->n;
+    int m  = e->m;
+    int mt = fft_spectrum<D>(e->grid);
+    float nt = fft_samples<D>(e->grid);
+    int dimBlock = e->dimBlock;
+    VSNR_GRID g  = e->grid;
+
+    float *fpsi = e->fpsi, *fphi = e->fphi, *scale = e->scale;
+    CuC *fx = e->fx;
+    VSNR_VEC<D, CuC> fphik = e->fphik, ftmp = e->ftmp;
+    VSNR_VEC<D, CuR> tmp   = e->tmp;
+    VSNR_VEC<D, S>   du0   = vec_cast<D, S>(e->du0);
+    VSNR_VEC<D, S>   y     = vec_cast<D, S>(e->y);
+    VSNR_VEC<D, S>   l     = vec_cast<D, S>(e->l);
+
+    // Computes d1u0, d2u0 (, d3u0)
+    gradient<<<launch(e),dimBlock,0,e->stream>>>(u0, du0, g);
+
+    // Computes fphi1, fphi2 (, fphi3) & fphi
+    compute_phi<<<launch(e),dimBlock,0,e->stream>>>(fpsi, fphik, fphi, g);
+
+    // Initialization, or y and lambda of the previous run (warm start)
+    init_state<D, S>(e);
+    mark(e, 3);
+
+    // Main algorithm
+    for (int k = 0 ; k < nit ; ++k) {
+        int check = check_iteration(e, k, nit);
+
+        // -------------------------------------------------------------
+        // First step, x update : (I+beta ATA)x = AT (-lambda+beta*ATy)
+        // -------------------------------------------------------------
+        // fx = sum_k conj(fphik).*fftn(-lambdak+beta*yk) / (1+beta*fphi);
+        betay_m_lambda<<<launch(e),dimBlock,0,e->stream>>>(l, y, tmp, beta, n);
+        for (int d = 0 ; d < D ; ++d)
+            fft_r2c(e, tmp.c[d], ftmp.c[d]);
+        update_fx<<<launch(e),dimBlock,0,e->stream>>>(fphik, ftmp, fphi, fx, scale, beta, mt, m);
+
+        // --------------------------------------------------------
+        // Second step y update : y = prox_{f1/beta}(Ax+lambda/beta)
+        // --------------------------------------------------------
+        product_phi<<<launch(e),dimBlock,0,e->stream>>>(fphik, fx, ftmp, scale, mt, m);
+        for (int d = 0 ; d < D ; ++d)
+            fft_c2r(e, ftmp.c[d], tmp.c[d]); // tmpd = nt Axd
+        update_y<<<launch(e),dimBlock,0,e->stream>>>(du0, tmp, l, y, beta, e->alpha, nt, n, residuals(e, check));
+
+        // --------------------------
+        // Third step lambda update
+        // --------------------------
+        for (int d = 0 ; d < D ; ++d)
+            update_lambda<<<launch(e),dimBlock,0,e->stream>>>(l.c[d], tmp.c[d], y.c[d], beta, n);
+
+        if (check && check_residuals(e, k, nit, beta)) break;
+
+        // ----------------------------
+        // Acceleration, see accel
+        // ----------------------------
+        if (e->accel == VSNR_ACCEL_NESTEROV)
+            extrapolate_all<D, S>(e, k, beta);
+
+        if (e->accel == VSNR_ACCEL_ADAPTIVE && check)
+            balance_beta(e->sums, &beta);
+
+    }
+    mark(e, 4);
+
+    // Last but not the least : w = nt (psi * x)
+    product_psi<<<launch(e),dimBlock,0,e->stream>>>(fpsi, fx, ftmp.c[0], scale, mt, m);
+    fft_c2r(e, ftmp.c[0], tmp.c[0]);
+    return tmp.c[0];
+}
+
+// Stencil solver : same iterations as VSNR_ADMM_GPU with A = D psi applied as a convolution by psi (FFT)
+// followed by the real-space stencils, 1 R2C + 1 C2R per iteration instead of D + D.
+// VSNR_SOLVER_LOWMEM does not store Du0. Returns w = nt (psi * x) as VSNR_ADMM_GPU.
+template <int D, typename S>
+CuR* VSNR_ADMM_STENCIL_GPU(VSNR_ENGINE<D>* e, float *u0, int nit, float beta)
+{
+    int lowmem = (e->solver == VSNR_SOLVER_LOWMEM);
+    int n  = e->n;
+    int m  = e->m;
+    int mt = fft_spectrum<D>(e->grid);
+    int dimBlock = e->dimBlock;
+    VSNR_GRID g  = e->grid;
+
+    float *fpsi = e->fpsi, *fphi = e->fphi, *scale = e->scale;
+    CuC *fx = e->fx;
+    CuC *ftmp = e->ftmp.c[0];
+    CuR  *tmp = e->tmp.c[0];
+    VSNR_VEC<D, S> du0 = vec_cast<D, S>(e->du0);
+    VSNR_VEC<D, S> y   = vec_cast<D, S>(e->y);
+    VSNR_VEC<D, S> l   = vec_cast<D, S>(e->l);
+
+    // Computes d1u0, d2u0 (, d3u0), recomputed in update_y_lambda_u0 by the low-memory solver
+    if (!lowmem)
+        gradient<<<launch(e),dimBlock,0,e->stream>>>(u0, du0, g);
+
+    // Computes fphi
+    compute_phi_psi<D><<<launch(e),dimBlock,0,e->stream>>>(fphi, g);
+
+    // Initialization, or y and lambda of the previous run (warm start)
+    init_state<D, S>(e);
+
+    // x = 0 if there is no iteration
+    cudaMemsetAsync(tmp, 0, n*sizeof(CuR), e->stream);
+    mark(e, 3);
+
+    // Main algorithm
+    for (int k = 0 ; k < nit ; ++k) {
+        int check = check_iteration(e, k, nit);
+
+        // -------------------------------------------------------------
+        // First step, x update : (I+beta ATA)x = AT (-lambda+beta*ATy)
+        // -------------------------------------------------------------
+        // fx = conj(fpsi).*fftn(sum_k DkT (-lambdak+beta*yk)) / (1+beta*fpsi^2*fphi);
+        adjoint_betay_m_lambda<<<launch(e),dimBlock,0,e->stream>>>(l, y, tmp, beta, g);
+        fft_r2c(e, tmp, ftmp);
+        update_fx_psi<<<launch(e),dimBlock,0,e->stream>>>(fpsi, ftmp, fphi, fx, scale, beta, mt, m);
+
+        // --------------------------------------------------------
+        // Second step y update : y = prox_{f1/beta}(Ax+lambda/beta)
+        // Third step lambda update
+        // --------------------------------------------------------
+        product_psi<<<launch(e),dimBlock,0,e->stream>>>(fpsi, fx, ftmp, scale, mt, m);
+        fft_c2r(e, ftmp, tmp); // tmp = nt (psi * x)
+        if (lowmem)
+            update_y_lambda_u0<<<launch(e),dimBlock,0,e->stream>>>(u0, tmp, l, y, beta, e->alpha, g, residuals(e, check));
+        else
+            update_y_lambda<<<launch(e),dimBlock,0,e->stream>>>(du0, tmp, l, y, beta, e->alpha, g, residuals(e, check));
+
+        if (check && check_residuals(e, k, nit, beta)) break;
+
+        // ----------------------------
+        // Acceleration, see accel
+        // ----------------------------
+        if (e->accel == VSNR_ACCEL_NESTEROV)
+            extrapolate_all<D, S>(e, k, beta);
+
+        if (e->accel == VSNR_ACCEL_ADAPTIVE && check)
+            balance_beta(e->sums, &beta);
+
+    }
+    mark(e, 4);
+
+    // Last but not the least : tmp already holds w = nt (psi * x)
+    return tmp;
+}
+
+// Runs the ADMM on u0 (device, n samples) with the solver and the precision of the engine, y and lambda
+// are kept for a warm start. Returns w = nt (psi * x), see VSNR_ADMM_GPU.
+template <int D>
+CuR* VSNR_ADMM(VSNR_ENGINE<D>* e, float *u0, int nit, float beta)
+{
+    CuR* w;
+
+    if (e->solver == VSNR_SOLVER_FFT) {
+        if      (e->precision == VSNR_PRECISION_HALF) w = VSNR_ADMM_GPU<D, __half>(e, u0, nit, beta);
+        else if (e->precision == VSNR_PRECISION_BF16) w = VSNR_ADMM_GPU<D, __nv_bfloat16>(e, u0, nit, beta);
+        else                                          w = VSNR_ADMM_GPU<D, float>(e, u0, nit, beta);
+    } else {
+        if      (e->precision == VSNR_PRECISION_HALF) w = VSNR_ADMM_STENCIL_GPU<D, __half>(e, u0, nit, beta);
+        else if (e->precision == VSNR_PRECISION_BF16) w = VSNR_ADMM_STENCIL_GPU<D, __nv_bfloat16>(e, u0, nit, beta);
+        else                                          w = VSNR_ADMM_STENCIL_GPU<D, float>(e, u0, nit, beta);
+    }
+
+    e->solved = 1;
+    return w;
+}
+
+#endif